@@ -0,0 +1,394 @@
+#include "accesslog.h"
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
+int alog_enabled = 0;
+__thread alog_rec * alog_cur = NULL;
+
+static __thread alog_ring * local_ring = NULL;
+static __thread uint64_t local_seq = 0;
+static alog_ring * rings = NULL;        //all registered rings (push only)
+
+static int log_fd = -1;                 //-1: no text log
+static int cap_fd = -1;                 //-1: no capture
+static uint64_t cap_start_ns = 0;       //monotonic start of the capture
+static uint64_t cap_count = 0;          //records captured
+static uint64_t cap_lost = 0;           //records dropped or sampled out, missing from the capture
+static int log_sample = 1;
+static int stop = 0;
+static pthread_t writer;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cv = PTHREAD_COND_INITIALIZER;
+static pthread_key_t ring_key;          //releases the ring when its thread exits
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+#define OUT_LEN (64 * 1024)
+
+static const char * cache_name[] = {
+        "-",
+        "HIT",
+        "MISS",
+        "STALE",
+        "REVALIDATED",
+        "NEG",
+        "PEER",
+        "TUNNEL"
+};
+
+/**
+ * thread exit: the writer keeps draining the ring, a new thread can reuse it
+ */
+static void ring_release(void * r) {
+    __atomic_store_n( & ((alog_ring * ) r) -> owned, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create( & ring_key, ring_release);
+}
+
+/**
+ * give the calling thread a ring, reuse the ring of an exited thread first
+ * @return alog_ring* the ring, NULL if the allocation failed
+ */
+static alog_ring * ring_attach(void) {
+    pthread_once( & ring_once, ring_key_init);
+    alog_ring * r;
+    for (r = __atomic_load_n( & rings, __ATOMIC_ACQUIRE); r != NULL; r = r -> next) {
+        int free_ring = 0;
+        if (__atomic_compare_exchange_n( & r -> owned, & free_ring, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (r == NULL) {
+        r = (alog_ring * ) calloc(1, sizeof(alog_ring));
+        if (r == NULL) {
+            return NULL;
+        }
+        r -> owned = 1;
+        r -> next = __atomic_load_n( & rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n( & rings, & r -> next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(ring_key, r);
+    local_ring = r;
+    return r;
+}
+
+/**
+ * start a record for a new request
+ * @param alog_rec* rec the record
+ * @param struct sockaddr_in* cli the client address
+ */
+void alog_begin(alog_rec * rec, struct sockaddr_in * cli) {
+    if (!alog_enabled) {
+        alog_cur = NULL;
+        return;
+    }
+    memset(rec, 0, sizeof(alog_rec));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, & ts);
+    rec -> wall_us = (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000;
+    rec -> start_ns = alog_clock();
+    if (cli != NULL) {
+        rec -> client_ip = cli -> sin_addr.s_addr;
+        rec -> client_port = ntohs(cli -> sin_port);
+    }
+    alog_cur = rec;
+}
+
+/**
+ * make a record current on this thread
+ * @param alog_rec* rec the record, NULL to detach
+ */
+void alog_attach(alog_rec * rec) {
+    alog_cur = alog_enabled ? rec : NULL;
+}
+
+/**
+ * copy a string into a fixed field, keep the end of long paths
+ * @return int 1 if it was cut, 0 else
+ */
+static int copy_field(char * dst, size_t size, char * src) {
+    size_t n = strlen(src);
+    int cut = n >= size;
+    if (cut) {
+        src += n - (size - 1);
+        n = size - 1;
+    }
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    return cut;
+}
+
+/**
+ * set host and path of the current request
+ * @param char* host the host name
+ * @param char* path the requested path
+ */
+void alog_request(char * host, char * path) {
+    if (alog_cur == NULL) {
+        return;
+    }
+    alog_cur -> truncated = (uint8_t)(copy_field(alog_cur -> host, ALOG_HOST_LEN, host) |
+                                      copy_field(alog_cur -> path, ALOG_PATH_LEN, path));
+}
+
+/**
+ * commit the current record, sample or drop it if the writer is behind
+ */
+void alog_end(void) {
+    alog_rec * rec = alog_cur;
+    if (rec == NULL) {
+        return;
+    }
+    alog_cur = NULL;
+    alog_ring * r = local_ring;
+    if (r == NULL && (r = ring_attach()) == NULL) {
+        return;
+    }
+    uint64_t tail = __atomic_load_n( & r -> tail, __ATOMIC_ACQUIRE);
+    uint64_t used = r -> head - tail;
+    if (used >= ALOG_RING_SIZE) {
+        __atomic_add_fetch( & r -> dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (log_sample > 1 && used > ALOG_RING_SIZE * 3 / 4 && (local_seq++ % (uint64_t) log_sample) != 0) {
+        __atomic_add_fetch( & r -> sampled, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec -> total_us = (uint32_t)((alog_clock() - rec -> start_ns) / 1000);
+    r -> recs[r -> head & (ALOG_RING_SIZE - 1)] = * rec;
+    __atomic_store_n( & r -> head, r -> head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * write the whole buffer to the log or the capture
+ */
+static void flush_out(int fd, char * out, size_t * len) {
+    size_t off = 0;
+    while (off < * len) {
+        ssize_t w = write(fd, out + off, * len - off);
+        if (w <= 0) {
+            break;
+        }
+        off += (size_t) w;
+    }
+    * len = 0;
+}
+
+/**
+ * format one record as a log line
+ * @return int the line length
+ */
+static int format_rec(alog_rec * rec, char * out, size_t size) {
+    char ip[INET_ADDRSTRLEN], when[32];
+    struct in_addr a;
+    a.s_addr = rec -> client_ip;
+    inet_ntop(AF_INET, & a, ip, sizeof(ip));
+    time_t sec = (time_t)(rec -> wall_us / 1000000);
+    struct tm tm;
+    gmtime_r( & sec, & tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", & tm);
+    ///a tunnel also has the bytes of the other direction
+    char up[32] = "";
+    if (rec -> cache == ALOG_TUNNEL) {
+        snprintf(up, sizeof(up), " up=%llu", (unsigned long long) rec -> bytes_up);
+    }
+    return snprintf(out, size, "%s.%06uZ %s:%u %s %s %u %llu %s%s read=%u parse=%u first=%u total=%u\n",
+                    when, (unsigned)(rec -> wall_us % 1000000), ip, rec -> client_port,
+                    rec -> host[0] ? rec -> host : "-", rec -> path[0] ? rec -> path : "-",
+                    rec -> status, (unsigned long long) rec -> bytes, cache_name[rec -> cache], up,
+                    rec -> stage_us[ALOG_READ], rec -> stage_us[ALOG_PARSE], rec -> stage_us[ALOG_FIRST],
+                    rec -> total_us);
+}
+
+/**
+ * append one record to the capture buffer
+ * @return size_t the bytes added
+ */
+static size_t format_cap(alog_rec * rec, char * out) {
+    alog_cap_rec c;
+    memset( & c, 0, sizeof(c));
+    c.start_us = rec -> start_ns > cap_start_ns ? (rec -> start_ns - cap_start_ns) / 1000 : 0;
+    c.bytes = rec -> bytes;
+    c.total_us = rec -> total_us;
+    c.status = rec -> status;
+    c.cache = rec -> cache;
+    c.host_len = (uint8_t) strlen(rec -> host);
+    c.path_len = (uint8_t) strlen(rec -> path);
+    c.flags = rec -> truncated ? ALOG_CAP_TRUNCATED : 0;
+    memcpy(out, & c, sizeof(c));
+    memcpy(out + sizeof(c), rec -> host, c.host_len);
+    memcpy(out + sizeof(c) + c.host_len, rec -> path, c.path_len);
+    return sizeof(c) + c.host_len + c.path_len;
+}
+
+/**
+ * drain every ring into the log file and the capture
+ */
+static void drain(char * out, char * cap) {
+    size_t len = 0, cap_len = 0;
+    uint64_t dropped = 0, sampled = 0;
+    for (alog_ring * r = __atomic_load_n( & rings, __ATOMIC_ACQUIRE); r != NULL; r = r -> next) {
+        uint64_t head = __atomic_load_n( & r -> head, __ATOMIC_ACQUIRE);
+        uint64_t tail = r -> tail;
+        while (tail != head) {
+            alog_rec * rec = & r -> recs[tail & (ALOG_RING_SIZE - 1)];
+            if (log_fd >= 0) {
+                if (OUT_LEN - len < 512) {
+                    flush_out(log_fd, out, & len);
+                }
+                int n = format_rec(rec, out + len, OUT_LEN - len);
+                if (n > 0) {
+                    len += (size_t) n < OUT_LEN - len ? (size_t) n : OUT_LEN - len - 1;
+                }
+            }
+            if (cap_fd >= 0) {
+                if (OUT_LEN - cap_len < sizeof(alog_cap_rec) + ALOG_HOST_LEN + ALOG_PATH_LEN) {
+                    flush_out(cap_fd, cap, & cap_len);
+                }
+                cap_len += format_cap(rec, cap + cap_len);
+                cap_count++;
+            }
+            tail++;
+        }
+        __atomic_store_n( & r -> tail, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_exchange_n( & r -> dropped, 0, __ATOMIC_RELAXED);
+        sampled += __atomic_exchange_n( & r -> sampled, 0, __ATOMIC_RELAXED);
+    }
+    cap_lost += cap_fd >= 0 ? dropped + sampled : 0;
+    if (log_fd >= 0 && (dropped != 0 || sampled != 0)) {
+        len += (size_t) snprintf(out + len, OUT_LEN - len, "# access log overloaded: %llu dropped, %llu sampled out\n",
+                                 (unsigned long long) dropped, (unsigned long long) sampled);
+    }
+    if (len > 0) {
+        flush_out(log_fd, out, & len);
+    }
+    if (cap_len > 0) {
+        flush_out(cap_fd, cap, & cap_len);
+    }
+}
+
+/**
+ * the writer thread function
+ * @param void* arg unused
+ */
+static void * writer_main(void * arg) {
+    (void) arg;
+    char * out = (char * ) malloc(OUT_LEN);
+    char * cap = (char * ) malloc(OUT_LEN);
+    if (out == NULL || cap == NULL) {
+        fprintf(stderr, "malloc:\n");
+        free(out);
+        free(cap);
+        return NULL;
+    }
+    pthread_mutex_lock( & stop_lock);
+    while (!stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, & ts);
+        ts.tv_nsec += ALOG_FLUSH_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait( & stop_cv, & stop_lock, & ts);
+        pthread_mutex_unlock( & stop_lock);
+        drain(out, cap);
+        pthread_mutex_lock( & stop_lock);
+    }
+    pthread_mutex_unlock( & stop_lock);
+    drain(out, cap);
+    free(out);
+    free(cap);
+    return NULL;
+}
+
+/**
+ * close the log and the capture
+ */
+static void close_files(void) {
+    if (log_fd >= 0 && log_fd != STDOUT_FILENO) {
+        close(log_fd);
+    }
+    if (cap_fd >= 0) {
+        close(cap_fd);
+    }
+    log_fd = -1;
+    cap_fd = -1;
+}
+
+/**
+ * open the log and the capture and start the writer
+ * @param char* path the log file, "-" for stdout, NULL for none
+ * @param int sample keep 1 of sample records under overload
+ * @param char* capture the binary capture file, NULL for none
+ * @return int 0 on success, -1 else
+ */
+int alog_init(char * path, int sample, char * capture) {
+    if (path != NULL && strcmp(path, "-") == 0) {
+        log_fd = STDOUT_FILENO;
+    } else if (path != NULL) {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (log_fd < 0) {
+            perror("error: access log\n");
+            return -1;
+        }
+    }
+    ///a capture is a new file: its offsets start with it
+    if (capture != NULL) {
+        cap_fd = open(capture, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, & ts);
+        alog_cap_hdr hdr = {
+                ALOG_CAP_MAGIC,
+                ALOG_CAP_VERSION,
+                (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000
+        };
+        cap_start_ns = alog_clock();
+        if (cap_fd < 0 || write(cap_fd, & hdr, sizeof(hdr)) != (ssize_t) sizeof(hdr)) {
+            perror("error: capture\n");
+            close_files();
+            return -1;
+        }
+    }
+    log_sample = sample > 1 ? sample : 1;
+    if (pthread_create( & writer, NULL, writer_main, NULL) != 0) {
+        perror("pthread_create:\n");
+        close_files();
+        return -1;
+    }
+    alog_enabled = 1;
+    return 0;
+}
+
+/**
+ * flush and stop the writer
+ */
+void alog_close(void) {
+    if (!alog_enabled) {
+        return;
+    }
+    pthread_mutex_lock( & stop_lock);
+    stop = 1;
+    pthread_cond_signal( & stop_cv);
+    pthread_mutex_unlock( & stop_lock);
+    pthread_join(writer, NULL);
+    alog_enabled = 0;
+    if (cap_fd >= 0) {
+        fprintf(stderr, "capture: %llu requests, %llu lost under overload\n", (unsigned long long) cap_count,
+                (unsigned long long) cap_lost);
+    }
+    close_files();
+}
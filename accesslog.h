@@ -0,0 +1,226 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+
+#include <time.h>
+
+#include <netinet/in.h>
+
+/**
+ * accesslog.h
+ *
+ * This file declares the asynchronous access log.
+ * a request fills a fixed-size record while it runs, at the end the record
+ * is copied into a single-producer ring owned by the worker thread. a
+ * background writer drains all rings, formats one line per request and
+ * writes them in large batches, so workers never touch stdio or its lock.
+ * when a ring is more than 3/4 full only one record in --log-sample is
+ * kept, when it is full records are dropped (both are counted).
+ * the writer can also append the records to a binary capture file
+ * (--capture), which tools/replay.c plays back against a proxy.
+ */
+
+// records per thread ring, must be a power of 2
+#define ALOG_RING_SIZE 512
+
+// how often the writer drains the rings (milliseconds)
+#define ALOG_FLUSH_MS 50
+
+#define ALOG_HOST_LEN 64
+#define ALOG_PATH_LEN 128
+
+#define ALOG_CAP_MAGIC 0x50435850       // "PXCP"
+#define ALOG_CAP_VERSION 1
+#define ALOG_CAP_TRUNCATED 1            //alog_cap_rec flags: host or path cut to its last bytes
+
+
+/**
+ * how the response was produced
+ */
+enum alog_cache {
+    ALOG_NONE,      //rejected before the cache lookup
+    ALOG_HIT,       //served from the local filesystem
+    ALOG_MISS,      //fetched from the origin
+    ALOG_STALE,     //stale copy served, refreshed in the background
+    ALOG_REVALIDATED,   //stale copy served after a 304 from the origin
+    ALOG_NEGATIVE,  //failure answered from the negative cache
+    ALOG_PEER,      //fetched from the peer that owns the object
+    ALOG_TUNNEL     //CONNECT tunnel, bytes is the origin to client direction
+};
+
+/**
+ * request stages timed relative to the start of the request
+ */
+enum alog_stage {
+    ALOG_READ,      //request read from the client
+    ALOG_PARSE,     //header parsed, dns and filter done
+    ALOG_FIRST,     //first response byte sent to the client
+    ALOG_STAGES
+};
+
+
+/**
+ * one access log record
+ */
+typedef struct alog_rec {
+    uint64_t wall_us;                   //request start, microseconds since the epoch
+    uint64_t start_ns;                  //request start, monotonic
+    uint64_t bytes;                     //bytes written to the client
+    uint64_t bytes_up;                  //bytes relayed from the client to the origin (tunnels)
+    uint32_t client_ip;                 //network order
+    uint16_t client_port;               //host order
+    uint16_t status;                    //http status sent
+    uint32_t stage_us[ALOG_STAGES];     //time of each stage since start (0 = not reached)
+    uint32_t total_us;                  //time until the record was committed
+    uint8_t cache;                      //enum alog_cache
+    uint8_t truncated;                  //1 if host or path did not fit, their end is kept
+    char host[ALOG_HOST_LEN];
+    char path[ALOG_PATH_LEN];
+} alog_rec;
+
+
+/**
+ * header of a capture file, followed by the records of the requests in the
+ * order the writer drained them (roughly by completion, not by start)
+ */
+typedef struct alog_cap_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t wall_us;                   //capture start, microseconds since the epoch
+} alog_cap_hdr;
+
+/**
+ * one captured request (32 bytes), followed by host_len bytes of host and
+ * path_len bytes of path, without terminators
+ */
+typedef struct alog_cap_rec {
+    uint64_t start_us;                  //request start since the capture start
+    uint64_t bytes;                     //bytes written to the client
+    uint32_t total_us;                  //time until the record was committed
+    uint16_t status;                    //http status sent
+    uint8_t cache;                      //enum alog_cache
+    uint8_t host_len;
+    uint8_t path_len;
+    uint8_t flags;                      //ALOG_CAP_TRUNCATED
+    uint8_t pad[2];
+} alog_cap_rec;
+
+
+/**
+ * per thread ring, written by the owner thread, read by the writer
+ */
+typedef struct alog_ring {
+    struct alog_ring * next;    //next ring in the global list
+    uint64_t head;              //records committed by the owner
+    uint64_t tail;              //records consumed by the writer
+    uint64_t dropped;           //records lost because the ring was full
+    uint64_t sampled;           //records skipped by overload sampling
+    int owned;                  //1 while a live thread writes to the ring
+    alog_rec recs[ALOG_RING_SIZE];
+} alog_ring;
+
+
+extern int alog_enabled;
+extern __thread alog_rec * alog_cur;
+
+/**
+ * @return uint64_t monotonic clock in nanoseconds
+ */
+static inline uint64_t alog_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, & ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * set the status of the current request
+ * @param int status http status
+ */
+static inline void alog_status(int status) {
+    if (alog_cur != NULL) {
+        alog_cur -> status = (uint16_t) status;
+    }
+}
+
+/**
+ * count bytes written to the client
+ * @param long n number of bytes
+ */
+static inline void alog_bytes(long n) {
+    if (alog_cur != NULL && n > 0) {
+        alog_cur -> bytes += (uint64_t) n;
+    }
+}
+
+/**
+ * count bytes relayed from the client to the origin
+ * @param long n number of bytes
+ */
+static inline void alog_bytes_up(long n) {
+    if (alog_cur != NULL && n > 0) {
+        alog_cur -> bytes_up += (uint64_t) n;
+    }
+}
+
+/**
+ * set the cache result of the current request
+ * @param int cache enum alog_cache
+ */
+static inline void alog_cache(int cache) {
+    if (alog_cur != NULL) {
+        alog_cur -> cache = (uint8_t) cache;
+    }
+}
+
+/**
+ * note that the current request reached a stage (first time only)
+ * @param int stage enum alog_stage
+ */
+static inline void alog_mark(int stage) {
+    if (alog_cur != NULL && alog_cur -> stage_us[stage] == 0) {
+        uint64_t us = (alog_clock() - alog_cur -> start_ns) / 1000;
+        alog_cur -> stage_us[stage] = us > 0 ? (uint32_t) us : 1;
+    }
+}
+
+/**
+ * start the writer thread
+ * @param char* path the log file, "-" for stdout, NULL for none
+ * @param int sample keep 1 of sample records under overload (1 = keep all)
+ * @param char* capture the binary capture file, NULL for none
+ * @return int 0 on success, -1 else
+ */
+int alog_init(char * path, int sample, char * capture);
+
+/**
+ * start a record for a new request and make it current on this thread
+ * @param alog_rec* rec the record (owned by the request)
+ * @param struct sockaddr_in* cli the client address
+ */
+void alog_begin(alog_rec * rec, struct sockaddr_in * cli);
+
+/**
+ * make a record current on this thread (the request moved threads)
+ * @param alog_rec* rec the record, NULL to detach
+ */
+void alog_attach(alog_rec * rec);
+
+/**
+ * set host and path of the current request
+ * @param char* host the host name
+ * @param char* path the requested path
+ */
+void alog_request(char * host, char * path);
+
+/**
+ * commit the current record to the ring of this thread
+ */
+void alog_end(void);
+
+/**
+ * stop the writer after a last flush
+ */
+void alog_close(void);
+
+#endif
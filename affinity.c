@@ -0,0 +1,107 @@
+#include "affinity.h"
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+/**
+ * parse a cpu list like "0-3,8,10-11"
+ * @param char* list the list
+ * @param cpu_set_t* set the parsed set
+ * @return int 0 on success, -1 if the list is malformed or empty
+ */
+int cpus_parse(const char * list, cpu_set_t * set) {
+    CPU_ZERO(set);
+    const char * p = list;
+    while (*p != '\0' && *p != '\n') {
+        char * end;
+        long lo = strtol(p, & end, 10), hi;
+        if (end == p || lo < 0) {
+            return -1;
+        }
+        p = end;
+        hi = lo;
+        if (*p == '-') {
+            p++;
+            hi = strtol(p, & end, 10);
+            if (end == p || hi < lo) {
+                return -1;
+            }
+            p = end;
+        }
+        if (hi >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long c = lo; c <= hi; c++) {
+            CPU_SET((int) c, set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return -1;
+        }
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/**
+ * read a cpu list file of sysfs
+ * @param char* path the file
+ * @param cpu_set_t* set the parsed set
+ * @return int 0 on success, -1 else
+ */
+static int read_list(const char * path, cpu_set_t * set) {
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char line[1024];
+    int rc = fgets(line, sizeof(line), fp) != NULL ? cpus_parse(line, set) : -1;
+    fclose(fp);
+    return rc;
+}
+
+/**
+ * @return int number of NUMA nodes online, 1 without NUMA support
+ */
+int numa_node_count(void) {
+    cpu_set_t nodes;
+    if (read_list("/sys/devices/system/node/online", & nodes) != 0) {
+        return 1;
+    }
+    int count = 0;
+    for (int n = 0; n < CPU_SETSIZE; n++) {
+        if (CPU_ISSET(n, & nodes)) {
+            count = n + 1;
+        }
+    }
+    return count > 0 ? count : 1;
+}
+
+/**
+ * read the cpus of a NUMA node
+ * @param int node the node
+ * @param cpu_set_t* set the cpus of the node
+ * @return int 0 on success, -1 else
+ */
+int numa_node_cpus(int node, cpu_set_t * set) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    return read_list(path, set);
+}
+
+/**
+ * restrict a thread to a cpu set
+ * @param pthread_t t the thread
+ * @param cpu_set_t* set the cpus
+ * @return int 0 on success, -1 else
+ */
+int pin_thread(pthread_t t, const cpu_set_t * set) {
+    if (pthread_setaffinity_np(t, sizeof(cpu_set_t), set) != 0) {
+        fprintf(stderr, "error: pthread_setaffinity_np\n");
+        return -1;
+    }
+    return 0;
+}
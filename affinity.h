@@ -0,0 +1,51 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sched.h>
+
+#include <pthread.h>
+
+/**
+ * affinity.h
+ *
+ * This file declares the cpu set and NUMA topology helpers.
+ * the topology is read from sysfs (/sys/devices/system/node), no libnuma
+ * is needed. memory is placed by first touch: a thread pinned to a node
+ * that allocates and touches its own buffers gets them from that node.
+ */
+
+
+/**
+ * parse a cpu list like "0-3,8,10-11" (the sysfs cpulist format)
+ * @param char* list the list
+ * @param cpu_set_t* set the parsed set
+ * @return int 0 on success, -1 if the list is malformed or empty
+ */
+int cpus_parse(const char * list, cpu_set_t * set);
+
+/**
+ * @return int number of NUMA nodes online, 1 without NUMA support
+ */
+int numa_node_count(void);
+
+/**
+ * read the cpus of a NUMA node
+ * @param int node the node
+ * @param cpu_set_t* set the cpus of the node
+ * @return int 0 on success, -1 else
+ */
+int numa_node_cpus(int node, cpu_set_t * set);
+
+/**
+ * restrict a thread to a cpu set
+ * @param pthread_t t the thread
+ * @param cpu_set_t* set the cpus
+ * @return int 0 on success, -1 else
+ */
+int pin_thread(pthread_t t, const cpu_set_t * set);
+
+#endif
@@ -0,0 +1,218 @@
+#include "arena.h"
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include <stdio.h>
+
+#include <stdarg.h>
+
+static __thread arena * pool = NULL;     //reset arenas of this thread
+static __thread int pool_size = 0;
+static pthread_key_t pool_key;          //frees the pool when its thread exits
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static arena * shared = NULL;           //reset arenas released by threads with a full pool
+static int shared_size = 0;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * thread exit: free the arenas pooled by the thread
+ * @param void* p the first pooled arena
+ */
+static void pool_free(void * p) {
+    arena * a = (arena * ) p;
+    while (a != NULL) {
+        arena * next = a -> next;
+        free(a -> head);
+        free(a);
+        a = next;
+    }
+}
+
+static void pool_key_init(void) {
+    pthread_key_create( & pool_key, pool_free);
+}
+
+/**
+ * round n up to the allocation alignment
+ */
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+}
+
+/**
+ * allocate a chunk with at least n bytes of data
+ * @param size_t n the data size
+ * @return arena_chunk* the chunk, NULL if out of memory
+ */
+static arena_chunk * chunk_new(size_t n) {
+    arena_chunk * c = (arena_chunk * ) malloc(sizeof(arena_chunk) + n);
+    if (c == NULL) {
+        return NULL;
+    }
+    c -> next = NULL;
+    c -> size = n;
+    c -> used = 0;
+    return c;
+}
+
+/**
+ * take an arena from the pool, the shared pool or create a new one
+ * @return arena* the arena, NULL if out of memory
+ */
+arena * arena_acquire(void) {
+    arena * a = pool;
+    if (a != NULL) {
+        pool = a -> next;
+        pool_size--;
+        a -> next = NULL;
+        pthread_setspecific(pool_key, pool);
+        return a;
+    }
+    ///the arenas of the requests this thread handed over come back through the shared pool
+    if (__atomic_load_n( & shared, __ATOMIC_RELAXED) != NULL) {
+        pthread_mutex_lock( & shared_lock);
+        a = shared;
+        if (a != NULL) {
+            shared = a -> next;
+            shared_size--;
+        }
+        pthread_mutex_unlock( & shared_lock);
+        if (a != NULL) {
+            a -> next = NULL;
+            return a;
+        }
+    }
+    a = (arena * ) malloc(sizeof(arena));
+    if (a == NULL) {
+        return NULL;
+    }
+    a -> head = chunk_new(ARENA_CHUNK);
+    if (a -> head == NULL) {
+        free(a);
+        return NULL;
+    }
+    a -> last = NULL;
+    a -> next = NULL;
+    return a;
+}
+
+/**
+ * reset the arena: keep only its first chunk, then pool it, in the shared
+ * pool if the pool of the thread is full
+ * @param arena* a the arena
+ */
+void arena_release(arena * a) {
+    if (a == NULL) {
+        return;
+    }
+    while (a -> head -> next != NULL) {
+        arena_chunk * c = a -> head;
+        a -> head = c -> next;
+        free(c);
+    }
+    a -> head -> used = 0;
+    a -> last = NULL;
+    if (pool_size >= ARENA_POOL_MAX) {
+        pthread_mutex_lock( & shared_lock);
+        int kept = shared_size < ARENA_SHARED_MAX;
+        if (kept) {
+            a -> next = shared;
+            shared = a;
+            shared_size++;
+        }
+        pthread_mutex_unlock( & shared_lock);
+        if (!kept) {
+            free(a -> head);
+            free(a);
+        }
+        return;
+    }
+    a -> next = pool;
+    pool = a;
+    pool_size++;
+    pthread_once( & pool_once, pool_key_init);
+    pthread_setspecific(pool_key, pool);
+}
+
+/**
+ * bump allocate n bytes, add a chunk when the current one is full
+ */
+void * arena_alloc(arena * a, size_t n) {
+    n = align_up(n ? n : 1);
+    arena_chunk * c = a -> head;
+    if (c -> size - c -> used < n) {
+        c = chunk_new(n > ARENA_CHUNK ? n : ARENA_CHUNK);
+        if (c == NULL) {
+            return NULL;
+        }
+        c -> next = a -> head;
+        a -> head = c;
+    }
+    char * p = c -> data + c -> used;
+    c -> used += n;
+    a -> last = p;
+    return p;
+}
+
+void * arena_calloc(arena * a, size_t n) {
+    void * p = arena_alloc(a, n);
+    if (p != NULL) {
+        memset(p, 0, n);
+    }
+    return p;
+}
+
+/**
+ * grow the last allocation in place, copy otherwise
+ */
+void * arena_realloc(arena * a, void * p, size_t old, size_t n) {
+    if (p == NULL) {
+        return arena_alloc(a, n);
+    }
+    if (n <= old) {
+        return p;
+    }
+    arena_chunk * c = a -> head;
+    if (p == a -> last) {
+        size_t start = (size_t)((char * ) p - c -> data);
+        if (c -> size - start >= align_up(n)) {
+            c -> used = start + align_up(n);
+            return p;
+        }
+    }
+    void * q = arena_alloc(a, n);
+    if (q == NULL) {
+        return NULL;
+    }
+    memcpy(q, p, old);
+    return q;
+}
+
+char * arena_strdup(arena * a, const char * s) {
+    size_t n = strlen(s) + 1;
+    char * p = (char * ) arena_alloc(a, n);
+    if (p != NULL) {
+        memcpy(p, s, n);
+    }
+    return p;
+}
+
+char * arena_sprintf(arena * a, const char * fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char * p = n >= 0 ? (char * ) arena_alloc(a, (size_t) n + 1) : NULL;
+    if (p != NULL) {
+        va_start(ap, fmt);
+        vsnprintf(p, (size_t) n + 1, fmt, ap);
+        va_end(ap);
+    }
+    return p;
+}
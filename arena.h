@@ -0,0 +1,100 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * arena.h
+ *
+ * This file declares the per-request bump allocator.
+ * every allocation of a request comes from its arena and is never freed
+ * on its own, the whole arena is reset when the request ends. reset
+ * arenas are kept in a small per-thread pool, so a steady stream of
+ * requests makes no malloc/free calls at all. a request handed to another
+ * thread (the miss lane) is released there: what that thread's pool has
+ * no room for goes to a shared pool, where the threads that run out of
+ * arenas take them back from.
+ */
+
+// size of the first chunk of an arena, enough for a typical request
+#define ARENA_CHUNK (16 * 1024)
+
+// arenas cached per thread
+#define ARENA_POOL_MAX 4
+
+// arenas cached for all the threads, released by a thread whose pool is full
+#define ARENA_SHARED_MAX 256
+
+// alignment of every allocation
+#define ARENA_ALIGN 16
+
+
+/**
+ * a block of memory, allocations are carved from its end
+ */
+typedef struct arena_chunk {
+    struct arena_chunk * next;   //previous (full) chunk
+    size_t size;                 //bytes in data
+    size_t used;                 //bytes handed out
+    char data[];
+} arena_chunk;
+
+
+/**
+ * the arena
+ */
+typedef struct arena {
+    arena_chunk * head;     //current chunk, the first chunk is last in the list
+    char * last;            //last allocation, can grow in place
+    struct arena * next;    //next arena in the thread pool or the shared pool
+} arena;
+
+
+/**
+ * take an arena from the thread pool, the shared pool, or create one
+ * @return arena* the arena, NULL if out of memory
+ */
+arena * arena_acquire(void);
+
+/**
+ * reset an arena and give it back to the pool of the calling thread,
+ * the shared pool if it is full
+ * @param arena* a the arena (may be NULL)
+ */
+void arena_release(arena * a);
+
+/**
+ * allocate n bytes
+ * @param arena* a the arena
+ * @param size_t n number of bytes
+ * @return void* the memory, NULL if out of memory
+ */
+void * arena_alloc(arena * a, size_t n);
+
+/**
+ * allocate n zeroed bytes
+ */
+void * arena_calloc(arena * a, size_t n);
+
+/**
+ * grow an allocation, in place if it is the last one and the chunk has room
+ * @param arena* a the arena
+ * @param void* p the allocation (NULL to allocate)
+ * @param size_t old its size
+ * @param size_t n the new size
+ * @return void* the memory, NULL if out of memory (p stays valid)
+ */
+void * arena_realloc(arena * a, void * p, size_t old, size_t n);
+
+/**
+ * copy a string into the arena
+ */
+char * arena_strdup(arena * a, const char * s);
+
+/**
+ * format a string into the arena (printf format)
+ * @return char* the string, NULL if out of memory
+ */
+char * arena_sprintf(arena * a, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,176 @@
+#include "bufpool.h"
+
+#include <stdlib.h>
+
+#include <stdint.h>
+
+/**
+ * a free buffer, the link is stored in the buffer itself
+ */
+typedef struct buf_free {
+    struct buf_free * next;
+} buf_free;
+
+typedef struct buf_class {
+    pthread_mutex_t lock;
+    buf_free * head;
+    size_t count;
+} buf_class;
+
+static buf_class classes[BUF_CLASSES] = {
+        [0 ... BUF_CLASSES - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL, 0}
+};
+
+static __thread buf_free * local[BUF_CLASSES];     //buffers cached by this thread
+static __thread int local_count[BUF_CLASSES];
+static __thread int local_registered = 0;
+static pthread_key_t local_key;         //gives the cached buffers back when the thread exits
+static pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+/**
+ * the size class of a size
+ * @return int the class, -1 if the size is above the largest class
+ */
+static int class_of(size_t size) {
+    int c = 0;
+    while (((size_t) 1 << (BUF_MIN_SHIFT + c)) < size) {
+        if (++c == BUF_CLASSES) {
+            return -1;
+        }
+    }
+    return c;
+}
+
+/**
+ * put a buffer on the global list of its class, or free it if the list is full
+ */
+static void global_put(buf_free * b, int c) {
+    buf_class * k = & classes[c];
+    pthread_mutex_lock( & k -> lock);
+    if (k -> count < (size_t)(BUF_POOL_BYTES >> (BUF_MIN_SHIFT + c))) {
+        b -> next = k -> head;
+        k -> head = b;
+        k -> count++;
+        b = NULL;
+    }
+    pthread_mutex_unlock( & k -> lock);
+    free(b);
+}
+
+/**
+ * thread exit: the buffers cached by the thread go to the global lists
+ */
+static void local_release(void * unused) {
+    (void) unused;
+    for (int c = 0; c < BUF_CLASSES; c++) {
+        while (local[c] != NULL) {
+            buf_free * b = local[c];
+            local[c] = b -> next;
+            global_put(b, c);
+        }
+        local_count[c] = 0;
+    }
+}
+
+static void local_key_init(void) {
+    pthread_key_create( & local_key, local_release);
+}
+
+/**
+ * take a buffer
+ * @param size_t size the bytes needed, at most 256 KB
+ * @param size_t* cap set to the size of the buffer
+ * @return void* the page-aligned buffer, NULL if out of memory
+ */
+void * buf_get(size_t size, size_t * cap) {
+    int c = class_of(size);
+    if (c < 0) {
+        return NULL;
+    }
+    * cap = (size_t) 1 << (BUF_MIN_SHIFT + c);
+    buf_free * b = local[c];
+    if (b != NULL) {
+        local[c] = b -> next;
+        local_count[c]--;
+        return b;
+    }
+    buf_class * k = & classes[c];
+    pthread_mutex_lock( & k -> lock);
+    if ((b = k -> head) != NULL) {
+        k -> head = b -> next;
+        k -> count--;
+    }
+    pthread_mutex_unlock( & k -> lock);
+    if (b != NULL) {
+        return b;
+    }
+    void * p;
+    return posix_memalign( & p, (size_t) 1 << BUF_MIN_SHIFT, * cap) == 0 ? p : NULL;
+}
+
+/**
+ * give a buffer back
+ * @param void* p the buffer, NULL is ignored
+ * @param size_t cap its size
+ */
+void buf_put(void * p, size_t cap) {
+    if (p == NULL) {
+        return;
+    }
+    int c = class_of(cap);
+    buf_free * b = (buf_free * ) p;
+    if (local_count[c] < BUF_LOCAL) {
+        if (!local_registered) {
+            pthread_once( & local_once, local_key_init);
+            pthread_setspecific(local_key, & local_registered);
+            local_registered = 1;
+        }
+        b -> next = local[c];
+        local[c] = b;
+        local_count[c]++;
+        return;
+    }
+    global_put(b, c);
+}
+
+/**
+ * take the first buffer of a relay
+ * @param buf_relay* r the relay
+ * @param size_t size the bytes needed at first
+ * @return int 0 on success, -1 if out of memory
+ */
+int buf_relay_init(buf_relay * r, size_t size) {
+    r -> full = 0;
+    r -> data = (char * ) buf_get(size, & r -> cap);
+    return r -> data != NULL ? 0 : -1;
+}
+
+/**
+ * account a read into the empty buffer, once its data was used
+ * @param buf_relay* r the relay
+ * @param size_t n the bytes the read returned
+ */
+void buf_relay_adapt(buf_relay * r, size_t n) {
+    ///a read that fills the buffer means more data was waiting: fewer, larger reads
+    r -> full = n == r -> cap ? r -> full + 1 : 0;
+    if (r -> full < BUF_GROW_FULL || r -> cap >= ((size_t) 1 << BUF_MAX_SHIFT)) {
+        return;
+    }
+    size_t cap;
+    char * bigger = (char * ) buf_get(r -> cap * 2, & cap);
+    if (bigger != NULL) {
+        buf_put(r -> data, r -> cap);
+        r -> data = bigger;
+        r -> cap = cap;
+    }
+    r -> full = 0;
+}
+
+/**
+ * give the buffer of a relay back
+ * @param buf_relay* r the relay
+ */
+void buf_relay_free(buf_relay * r) {
+    buf_put(r -> data, r -> cap);
+    r -> data = NULL;
+}
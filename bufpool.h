@@ -0,0 +1,75 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+#include <pthread.h>
+
+/**
+ * bufpool.h
+ *
+ * This file declares the shared pool of relay buffers.
+ * buffers are page-aligned, in power of 2 size classes from 4 KB to 256 KB.
+ * every thread keeps a couple of buffers per class without locking, the
+ * rest go to a global list per class, bounded so an idle server gives the
+ * memory back. a relay starts with a small buffer and doubles it while the
+ * reads keep filling it, so a large object moves in few large syscalls and
+ * a small one does not hold 256 KB.
+ */
+
+#define BUF_MIN_SHIFT 12            //4 KB
+#define BUF_MAX_SHIFT 18            //256 KB
+#define BUF_CLASSES (BUF_MAX_SHIFT - BUF_MIN_SHIFT + 1)
+#define BUF_LOCAL 2                 //buffers per class cached by each thread
+#define BUF_POOL_BYTES (4 << 20)    //bytes per class kept in the global list
+#define BUF_GROW_FULL 2             //full reads in a row before a relay buffer doubles
+
+
+/**
+ * the buffer of a relay loop
+ */
+typedef struct buf_relay {
+    char * data;
+    size_t cap;         //its size
+    int full;           //reads in a row that filled it
+} buf_relay;
+
+
+/**
+ * take a buffer
+ * @param size_t size the bytes needed, at most 256 KB
+ * @param size_t* cap set to the size of the buffer (the size class)
+ * @return void* the page-aligned buffer, NULL if out of memory
+ */
+void * buf_get(size_t size, size_t * cap);
+
+/**
+ * give a buffer back
+ * @param void* p the buffer, NULL is ignored
+ * @param size_t cap its size
+ */
+void buf_put(void * p, size_t cap);
+
+/**
+ * take the first buffer of a relay
+ * @param buf_relay* r the relay
+ * @param size_t size the bytes needed at first
+ * @return int 0 on success, -1 if out of memory
+ */
+int buf_relay_init(buf_relay * r, size_t size);
+
+/**
+ * account a read into the empty buffer, once its data was used: after
+ * BUF_GROW_FULL full reads in a row the buffer is swapped for one twice as large
+ * @param buf_relay* r the relay
+ * @param size_t n the bytes the read returned
+ */
+void buf_relay_adapt(buf_relay * r, size_t n);
+
+/**
+ * give the buffer of a relay back
+ * @param buf_relay* r the relay
+ */
+void buf_relay_free(buf_relay * r);
+
+#endif
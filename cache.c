@@ -0,0 +1,299 @@
+#include "cache.h"
+
+#include "shm.h"
+
+#include <stdio.h>
+
+#include <string.h>
+
+#include <ctype.h>
+
+#include <errno.h>
+
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include <dirent.h>
+
+#include <fcntl.h>
+
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+static char cache_root[CACHE_PATH_LEN - 32] = ".";
+static uint8_t * bloom = NULL;      //counters, saturate at 255 (then never decremented)
+static uint64_t bloom_mask = 0;     //number of counters - 1
+static uint64_t * refreshing = NULL;    //keys refreshed in the background, 0 = free
+
+/**
+ * create a directory unless it exists
+ * @return int 0 on success, -1 else
+ */
+static int make_dir(const char * path) {
+    if (mkdir(path, 0700) == 0 || errno == EEXIST) {
+        return 0;
+    }
+    perror(path);
+    return -1;
+}
+
+/**
+ * the i-th counter of a key (double hashing on the two halves of the key)
+ */
+static uint8_t * counter(uint64_t key, int i) {
+    uint64_t h2 = (key >> 32) | 1;
+    return & bloom[(key + (uint64_t) i * h2 * 0x9E3779B97F4A7C15ull) & bloom_mask];
+}
+
+/**
+ * add a step to the counters of a key
+ * @param int step 1 or -1
+ */
+static void bloom_update(uint64_t key, int step) {
+    for (int i = 0; i < CACHE_BLOOM_HASHES; i++) {
+        uint8_t * c = counter(key, i);
+        uint8_t v = __atomic_load_n(c, __ATOMIC_RELAXED);
+        while (v != 255 && (step > 0 || v != 0)) {
+            if (__atomic_compare_exchange_n(c, & v, (uint8_t)(v + step), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * add the objects of one fan-out directory to the filter, remove the
+ * temporary files a crash left behind
+ * @return long the number of objects
+ */
+static long scan_dir(const char * path) {
+    DIR * d = opendir(path);
+    if (d == NULL) {
+        return 0;
+    }
+    long n = 0;
+    struct dirent * e;
+    while ((e = readdir(d)) != NULL) {
+        char * end;
+        if (e -> d_name[0] == '.') {
+            continue;
+        }
+        uint64_t key = strtoull(e -> d_name, & end, 16);
+        if (end - e -> d_name != 16) {
+            continue;
+        }
+        if ( * end == '\0') {
+            bloom_update(key, 1);
+            n++;
+        } else if (strstr(end, ".part") != NULL) {
+            unlinkat(dirfd(d), e -> d_name, 0);
+        }
+    }
+    closedir(d);
+    return n;
+}
+
+/**
+ * create the root and the fan-out directories that do not exist yet and
+ * fill the presence filter with the objects already stored
+ * @param char* root the cache directory
+ * @param long objects the number of objects the filter is sized for
+ * @return long the number of objects found, -1 on error
+ */
+long cache_init(const char * root, long objects) {
+    if (strlen(root) >= sizeof(cache_root)) {
+        fprintf(stderr, "cache directory name too long\n");
+        return -1;
+    }
+    strcpy(cache_root, root);
+    uint64_t size = 1024;
+    while (size < (uint64_t) objects * CACHE_BLOOM_PER_KEY) {
+        size *= 2;
+    }
+    bloom = (uint8_t * ) shm_calloc(size, 1);
+    refreshing = (uint64_t * ) shm_calloc(CACHE_REFRESH_SLOTS, sizeof(uint64_t));
+    if (bloom == NULL || refreshing == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    bloom_mask = size - 1;
+    if (make_dir(root) != 0) {
+        return -1;
+    }
+    long found = 0;
+    char path[CACHE_PATH_LEN];
+    for (int i = 0; i < CACHE_FANOUT; i++) {
+        snprintf(path, sizeof(path), "%s/%02x", root, i);
+        if (make_dir(path) != 0) {
+            return -1;
+        }
+        for (int j = 0; j < CACHE_FANOUT; j++) {
+            snprintf(path, sizeof(path), "%s/%02x/%02x", root, i, j);
+            if (make_dir(path) != 0) {
+                return -1;
+            }
+            found += scan_dir(path);
+        }
+    }
+    return found;
+}
+
+/**
+ * FNV-1a 64 of the canonical URL: the host is case insensitive and
+ * "host:80" is "host"
+ * @param char* url host[:port]/path of the object
+ * @return uint64_t the key of the object
+ */
+uint64_t cache_key(const char * url) {
+    uint64_t h = 14695981039346656037ull;
+    const char * path = strchr(url, '/');
+    size_t host = path != NULL ? (size_t)(path - url) : strlen(url);
+    if (host > 3 && strncmp(url + host - 3, ":80", 3) == 0) {
+        host -= 3;
+    }
+    for (size_t i = 0; i < host; i++) {
+        h = (h ^ (unsigned char) tolower((unsigned char) url[i])) * 1099511628211ull;
+    }
+    for (const unsigned char * p = (const unsigned char * )(path != NULL ? path : "/"); * p != '\0'; p++) {
+        h = (h ^ * p) * 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * the file of an object
+ * @param uint64_t key the key of the object
+ * @param char* out the path, CACHE_PATH_LEN bytes
+ */
+void cache_path(uint64_t key, char * out) {
+    snprintf(out, CACHE_PATH_LEN, "%s/%02x/%02x/%016llx", cache_root, (unsigned)(key >> 58),
+             (unsigned)(key >> 52) & (CACHE_FANOUT - 1), (unsigned long long) key);
+}
+
+/**
+ * @param uint64_t key the key of an object
+ * @return int 0 if the object is definitely not stored, 1 if it may be
+ */
+int cache_maybe(uint64_t key) {
+    if (bloom == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < CACHE_BLOOM_HASHES; i++) {
+        if (__atomic_load_n(counter(key, i), __ATOMIC_RELAXED) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * count a new object in the presence filter, after its file was created
+ * @param uint64_t key the key of the object
+ */
+void cache_add(uint64_t key) {
+    if (bloom != NULL) {
+        bloom_update(key, 1);
+    }
+}
+
+/**
+ * read the metadata of an object
+ * @param char* file the cache file of the object
+ * @param cache_meta* m the metadata
+ * @return int 0 on success, -1 if there is none
+ */
+int cache_meta_read(const char * file, cache_meta * m) {
+    char path[CACHE_PATH_LEN + 8];
+    snprintf(path, sizeof(path), "%s.meta", file);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, m, sizeof(cache_meta));
+    close(fd);
+    if (n != (ssize_t) sizeof(cache_meta) || m -> magic != CACHE_META_MAGIC) {
+        return -1;
+    }
+    m -> etag[sizeof(m -> etag) - 1] = '\0';
+    m -> last_modified[sizeof(m -> last_modified) - 1] = '\0';
+    return 0;
+}
+
+/**
+ * replace the metadata of an object (written aside and renamed)
+ * @param char* file the cache file of the object
+ * @param cache_meta* m the metadata
+ * @return int 0 on success, -1 else
+ */
+int cache_meta_write(const char * file, const cache_meta * m) {
+    char path[CACHE_PATH_LEN + 8], tmp[CACHE_PATH_LEN + 48];
+    snprintf(path, sizeof(path), "%s.meta", file);
+    ///forked workers share the thread ids, not the pid
+    snprintf(tmp, sizeof(tmp), "%s.part%d.%lx", path, (int) getpid(), (unsigned long) pthread_self());
+    int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, m, sizeof(cache_meta));
+    close(fd);
+    if (n != (ssize_t) sizeof(cache_meta) || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * claim the background refresh of an object. a slot of the table is
+ * shared by the keys that map to it, a busy slot skips the refresh (the
+ * next stale hit tries again)
+ * @param uint64_t key the key of the object
+ * @return int 0 if the caller refreshes it, -1 if a refresh is in flight
+ */
+int cache_refresh_claim(uint64_t key) {
+    uint64_t free_slot = 0;
+    ///the slot comes from the whole key, the tag stored in it is never 0 (free)
+    return __atomic_compare_exchange_n( & refreshing[key & (CACHE_REFRESH_SLOTS - 1)], & free_slot, key | 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+/**
+ * end a refresh claimed by cache_refresh_claim
+ * @param uint64_t key the key of the object
+ */
+void cache_refresh_done(uint64_t key) {
+    __atomic_store_n( & refreshing[key & (CACHE_REFRESH_SLOTS - 1)], 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * drop every refresh claim, after a worker died: its claims would never
+ * end. a refresh in flight in another worker may run twice
+ */
+void cache_refresh_reset(void) {
+    for (int i = 0; i < CACHE_REFRESH_SLOTS; i++) {
+        __atomic_store_n( & refreshing[i], 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * remove an object (and its variants) from the disk and the filter
+ * @param uint64_t key the key of the object
+ * @return int 0 if it was stored, -1 else
+ */
+int cache_remove(uint64_t key) {
+    char file[CACHE_PATH_LEN], other[CACHE_PATH_LEN + 8];
+    cache_path(key, file);
+    if (unlink(file) != 0) {
+        return -1;
+    }
+    snprintf(other, sizeof(other), "%s.gz", file);
+    unlink(other);
+    snprintf(other, sizeof(other), "%s.meta", file);
+    unlink(other);
+    if (bloom != NULL) {
+        bloom_update(key, -1);
+    }
+    return 0;
+}
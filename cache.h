@@ -0,0 +1,127 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#include <stdint.h>
+
+/**
+ * cache.h
+ *
+ * This file declares the layout of the disk cache.
+ * an object is stored under a 64-bit FNV-1a hash of its canonical URL
+ * (lower case host without the default port, then the path), in a fixed
+ * two-level fan-out of directories created once at startup:
+ *   <root>/<hash bits 63-58>/<hash bits 57-52>/<16 hex digits of the hash>
+ * a miss opens one file, no directory is walked or created per request,
+ * and no directory grows much beyond objects / CACHE_DIRS entries.
+ *
+ * a counting Bloom filter of the stored keys, built from a scan of the
+ * directories at startup and updated when an object is added or removed,
+ * tells definite misses apart without touching the filesystem. with
+ * --workers the filter and the refresh claims are shared by the worker
+ * processes (shm.h), both are updated with atomics.
+ *
+ * <file>.meta holds the freshness of the object computed from the origin
+ * headers and its validators (ETag, Last-Modified) for revalidation.
+ */
+
+#define CACHE_FANOUT 64                             //directories per level
+#define CACHE_DIRS (CACHE_FANOUT * CACHE_FANOUT)
+#define CACHE_PATH_LEN 512                          //longest root is CACHE_PATH_LEN - 32
+#define CACHE_BLOOM_PER_KEY 16                      //counters per expected object
+#define CACHE_BLOOM_HASHES 6                        //counters of a key (~0.1% false positives)
+#define CACHE_META_MAGIC 0x4154454du                 //"META"
+#define CACHE_REFRESH_SLOTS 1024                    //background refreshes in flight (power of 2)
+
+
+/**
+ * freshness and validators of a cached object
+ */
+typedef struct cache_meta {
+    uint32_t magic;
+    uint32_t swr;               //seconds a stale object is served while it is refreshed
+    int64_t stored;             //wall clock second the origin generated the response
+    int64_t expires;            //wall clock second the object becomes stale
+    char etag[128];             //empty if none
+    char last_modified[40];     //empty if none
+} cache_meta;
+
+
+/**
+ * create the root and the fan-out directories that do not exist yet and
+ * fill the presence filter with the objects already stored
+ * @param char* root the cache directory
+ * @param long objects the number of objects the filter is sized for
+ * @return int the number of objects found, -1 on error
+ */
+long cache_init(const char * root, long objects);
+
+/**
+ * @param char* url host[:port]/path of the object
+ * @return uint64_t the key of the object
+ */
+uint64_t cache_key(const char * url);
+
+/**
+ * the file of an object
+ * @param uint64_t key the key of the object
+ * @param char* out the path, CACHE_PATH_LEN bytes
+ */
+void cache_path(uint64_t key, char * out);
+
+/**
+ * @param uint64_t key the key of an object
+ * @return int 0 if the object is definitely not stored, 1 if it may be
+ */
+int cache_maybe(uint64_t key);
+
+/**
+ * count a new object in the presence filter, after its file was created
+ * @param uint64_t key the key of the object
+ */
+void cache_add(uint64_t key);
+
+/**
+ * read the metadata of an object
+ * @param char* file the cache file of the object
+ * @param cache_meta* m the metadata
+ * @return int 0 on success, -1 if there is none
+ */
+int cache_meta_read(const char * file, cache_meta * m);
+
+/**
+ * replace the metadata of an object (written aside and renamed)
+ * @param char* file the cache file of the object
+ * @param cache_meta* m the metadata
+ * @return int 0 on success, -1 else
+ */
+int cache_meta_write(const char * file, const cache_meta * m);
+
+/**
+ * claim the background refresh of an object
+ * @param uint64_t key the key of the object
+ * @return int 0 if the caller refreshes it, -1 if a refresh is in flight
+ */
+int cache_refresh_claim(uint64_t key);
+
+/**
+ * end a refresh claimed by cache_refresh_claim
+ * @param uint64_t key the key of the object
+ */
+void cache_refresh_done(uint64_t key);
+
+/**
+ * drop every refresh claim, after a worker died: its claims would never
+ * end. a refresh in flight in another worker may run twice
+ */
+void cache_refresh_reset(void);
+
+/**
+ * remove an object (and its variants) from the disk and the filter
+ * @param uint64_t key the key of the object
+ * @return int 0 if it was stored, -1 else
+ */
+int cache_remove(uint64_t key);
+
+#endif
@@ -0,0 +1,313 @@
+#include "diskq.h"
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <unistd.h>
+
+#include <limits.h>
+
+#include <sys/uio.h>
+
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t q_done = PTHREAD_COND_INITIALIZER;   //the queue drained, a thread exited
+static diskq_op * qhead = NULL, * qtail = NULL;
+static size_t queued = 0;           //bytes in the queue and being written
+static size_t max_queued = 0;
+static int io_threads = 0;          //I/O threads started, 0 = write-through
+static int nthreads = 0;            //I/O threads alive
+static int stopping = 0;
+static int sync_policy = DISKQ_SYNC_NONE;
+static diskq_stats stats;
+
+/**
+ * drop a reference of a file, the last one closes and commits it
+ * @param diskq_file* f the file
+ */
+static void file_release(diskq_file * f) {
+    if (__atomic_sub_fetch( & f -> refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    int ok = f -> complete && !__atomic_load_n( & f -> failed, __ATOMIC_ACQUIRE);
+    if (ok && sync_policy == DISKQ_SYNC_COMMIT && fdatasync(f -> fd) != 0) {
+        __atomic_add_fetch( & stats.errors, 1, __ATOMIC_RELAXED);
+        ok = 0;
+    }
+    close(f -> fd);
+    if (ok) {
+        __atomic_add_fetch( & stats.files, 1, __ATOMIC_RELAXED);
+    }
+    f -> commit(f -> arg, ok);
+    free(f);
+}
+
+/**
+ * write a whole block at an offset
+ * @return int 0 on success, -1 on error
+ */
+static int pwrite_all(int fd, const char * data, size_t n, off_t off) {
+    while (n > 0) {
+        ssize_t w = pwrite(fd, data, n, off);
+        if (w <= 0) {
+            return -1;
+        }
+        data += w;
+        off += w;
+        n -= (size_t) w;
+    }
+    return 0;
+}
+
+/**
+ * write contiguous blocks of one file
+ * @param diskq_op** ops the blocks
+ * @param int n how many
+ */
+static void write_run(diskq_op ** ops, int n) {
+    diskq_file * f = ops[0] -> f;
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += ops[i] -> len;
+    }
+    if (!__atomic_load_n( & f -> failed, __ATOMIC_ACQUIRE)) {
+        struct iovec iov[DISKQ_BATCH];
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = ops[i] -> data;
+            iov[i].iov_len = ops[i] -> len;
+        }
+        ssize_t w = pwritev(f -> fd, iov, n, ops[0] -> off);
+        ///a short write is finished block by block
+        size_t done = w > 0 ? (size_t) w : 0;
+        for (int i = 0; w >= 0 && done < total && i < n; i++) {
+            size_t start = (size_t)(ops[i] -> off - ops[0] -> off);
+            size_t skip = done > start ? done - start : 0;
+            if (skip < ops[i] -> len &&
+                pwrite_all(f -> fd, ops[i] -> data + skip, ops[i] -> len - skip, ops[i] -> off + (off_t) skip) != 0) {
+                w = -1;
+            }
+        }
+        if (w < 0) {
+            __atomic_store_n( & f -> failed, 1, __ATOMIC_RELEASE);
+            __atomic_add_fetch( & stats.errors, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch( & stats.bytes, (long long) total, __ATOMIC_RELAXED);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        free(ops[i]);
+        file_release(f);
+    }
+    pthread_mutex_lock( & qlock);
+    queued -= total;
+    pthread_mutex_unlock( & qlock);
+}
+
+/**
+ * run a batch taken from the queue: the blocks of a file that follow
+ * each other are written together, a close releases its file
+ */
+static void run_batch(diskq_op ** ops, int n) {
+    int start = 0;
+    for (int i = 0; i < n; i++) {
+        diskq_op * op = ops[i];
+        int last = i + 1 == n || ops[i + 1] -> f != op -> f || ops[i + 1] -> len == 0 ||
+                   ops[i + 1] -> off != op -> off + (off_t) op -> len;
+        if (op -> len == 0) {
+            diskq_file * f = op -> f;
+            free(op);
+            file_release(f);
+            start = i + 1;
+        } else if (last) {
+            write_run(ops + start, i + 1 - start);
+            start = i + 1;
+        }
+    }
+}
+
+/**
+ * the I/O thread
+ */
+static void * io_thread(void * arg) {
+    (void) arg;
+    diskq_op * ops[DISKQ_BATCH];
+    pthread_mutex_lock( & qlock);
+    while (1) {
+        while (qhead == NULL && !stopping) {
+            pthread_cond_wait( & q_not_empty, & qlock);
+        }
+        if (qhead == NULL) {
+            break;
+        }
+        int n = 0;
+        while (qhead != NULL && n < DISKQ_BATCH) {
+            ops[n++] = qhead;
+            qhead = qhead -> next;
+        }
+        if (qhead == NULL) {
+            qtail = NULL;
+        }
+        pthread_mutex_unlock( & qlock);
+        run_batch(ops, n);
+        pthread_mutex_lock( & qlock);
+    }
+    nthreads--;
+    pthread_cond_broadcast( & q_done);
+    pthread_mutex_unlock( & qlock);
+    return NULL;
+}
+
+/**
+ * start the I/O threads
+ * @param int threads number of I/O threads, 0 writes on the calling threads
+ * @param size_t max_bytes queued bytes beyond which files are dropped
+ * @param int sync enum diskq_sync
+ * @return int 0 on success, -1 else
+ */
+int diskq_init(int threads, size_t max_bytes, int sync) {
+    max_queued = max_bytes;
+    sync_policy = sync;
+    for (int i = 0; i < threads; i++) {
+        pthread_t t;
+        if (pthread_create( & t, NULL, io_thread, NULL) != 0) {
+            return -1;
+        }
+        pthread_detach(t);
+        pthread_mutex_lock( & qlock);
+        nthreads++;
+        pthread_mutex_unlock( & qlock);
+        io_threads++;
+    }
+    return 0;
+}
+
+/**
+ * start writing a file
+ * @param int fd the open file, closed by the stage
+ * @param commit called once everything is written
+ * @param void* arg argument of commit
+ * @return diskq_file* the file, NULL if out of memory
+ */
+diskq_file * diskq_open(int fd, void (*commit)(void * arg, int ok), void * arg) {
+    diskq_file * f = (diskq_file * ) calloc(1, sizeof(diskq_file));
+    if (f == NULL) {
+        close(fd);
+        return NULL;
+    }
+    f -> fd = fd;
+    f -> refs = 1;
+    f -> commit = commit;
+    f -> arg = arg;
+    return f;
+}
+
+/**
+ * put an operation at the tail of the queue
+ * @param diskq_op* op the operation
+ * @param int bounded 1 if the queue bound applies
+ * @return int 0 on success, -1 if the queue is full
+ */
+static int enqueue(diskq_op * op, int bounded) {
+    pthread_mutex_lock( & qlock);
+    if (bounded && queued + op -> len > max_queued) {
+        pthread_mutex_unlock( & qlock);
+        return -1;
+    }
+    queued += op -> len;
+    op -> next = NULL;
+    if (qtail != NULL) {
+        qtail -> next = op;
+    } else {
+        qhead = op;
+    }
+    qtail = op;
+    pthread_cond_signal( & q_not_empty);
+    pthread_mutex_unlock( & qlock);
+    return 0;
+}
+
+/**
+ * queue a copy of a block at the end of the file
+ * @param diskq_file* f the file
+ * @param char* data the block
+ * @param size_t n its size
+ * @return int 0 if it was queued (or written), -1 if the file is abandoned
+ */
+int diskq_write(diskq_file * f, const char * data, size_t n) {
+    if (__atomic_load_n( & f -> failed, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    off_t off = f -> off;
+    f -> off += (off_t) n;
+    if (io_threads == 0) {
+        if (pwrite_all(f -> fd, data, n, off) != 0) {
+            f -> failed = 1;
+            __atomic_add_fetch( & stats.errors, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        __atomic_add_fetch( & stats.bytes, (long long) n, __ATOMIC_RELAXED);
+        return 0;
+    }
+    diskq_op * op = (diskq_op * ) malloc(sizeof(diskq_op) + n);
+    if (op != NULL) {
+        op -> f = f;
+        op -> off = off;
+        op -> len = n;
+        memcpy(op -> data, data, n);
+        __atomic_add_fetch( & f -> refs, 1, __ATOMIC_ACQ_REL);
+        if (enqueue(op, 1) == 0) {
+            return 0;
+        }
+        __atomic_sub_fetch( & f -> refs, 1, __ATOMIC_ACQ_REL);
+        free(op);
+    }
+    ///full: drop the object rather than wait for the disk
+    __atomic_store_n( & f -> failed, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch( & stats.dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+/**
+ * no more blocks: the file is committed after the queued ones
+ * @param diskq_file* f the file, not to be used after this call
+ * @param int complete 0 if the data is incomplete
+ */
+void diskq_close(diskq_file * f, int complete) {
+    f -> complete = complete;
+    diskq_op * op = io_threads > 0 ? (diskq_op * ) malloc(sizeof(diskq_op)) : NULL;
+    if (op == NULL) {
+        file_release(f);
+        return;
+    }
+    op -> f = f;
+    op -> off = f -> off;
+    op -> len = 0;
+    enqueue(op, 0);
+}
+
+/**
+ * copy the counters of the stage
+ */
+void diskq_get_stats(diskq_stats * out) {
+    out -> files = __atomic_load_n( & stats.files, __ATOMIC_RELAXED);
+    out -> dropped = __atomic_load_n( & stats.dropped, __ATOMIC_RELAXED);
+    out -> errors = __atomic_load_n( & stats.errors, __ATOMIC_RELAXED);
+    out -> bytes = __atomic_load_n( & stats.bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * write everything queued, commit it and stop the I/O threads
+ */
+void diskq_shutdown(void) {
+    pthread_mutex_lock( & qlock);
+    stopping = 1;
+    pthread_cond_broadcast( & q_not_empty);
+    while (nthreads > 0) {
+        pthread_cond_wait( & q_done, & qlock);
+    }
+    pthread_mutex_unlock( & qlock);
+}
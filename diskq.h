@@ -0,0 +1,113 @@
+#ifndef DISKQ_H
+#define DISKQ_H
+
+#include <stddef.h>
+
+#include <pthread.h>
+
+#include <sys/types.h>
+
+/**
+ * diskq.h
+ *
+ * This file declares the write-behind stage of the disk cache.
+ * the relay copies each body block into a bounded queue and goes on with
+ * the client, dedicated I/O threads write the blocks (contiguous blocks of
+ * a file in one pwritev), apply the sync policy and commit the file when
+ * its last block is written. if the queue is full the file is abandoned
+ * (the object is not cached) instead of blocking the relay.
+ * with 0 threads every call does its I/O on the calling thread.
+ */
+
+#define DISKQ_BATCH 64          //blocks taken from the queue at once
+
+/**
+ * when the data of a committed file reaches the disk
+ */
+enum diskq_sync {
+    DISKQ_SYNC_NONE,        //whenever the kernel writes it back
+    DISKQ_SYNC_COMMIT       //fdatasync before the commit
+};
+
+
+/**
+ * a file written behind
+ */
+typedef struct diskq_file {
+    int fd;
+    off_t off;              //offset of the next block (written by the owner only)
+    int refs;               //blocks in flight + 1 until diskq_close
+    int failed;             //a block was dropped or could not be written
+    int complete;           //set by diskq_close
+    void (*commit)(void * arg, int ok);  //called on an I/O thread once everything is written
+    void * arg;
+} diskq_file;
+
+/**
+ * a block (or the close) of a file in the queue
+ */
+typedef struct diskq_op {
+    diskq_file * f;
+    off_t off;
+    size_t len;             //0 for the close
+    struct diskq_op * next;
+    char data[];
+} diskq_op;
+
+/**
+ * counters of the stage
+ */
+typedef struct diskq_stats {
+    long files;             //files committed
+    long dropped;           //files abandoned because the queue was full
+    long errors;            //files abandoned because of a write error
+    long long bytes;        //bytes written
+} diskq_stats;
+
+
+/**
+ * start the I/O threads
+ * @param int threads number of I/O threads, 0 writes on the calling threads
+ * @param size_t max_bytes queued bytes beyond which files are dropped
+ * @param int sync enum diskq_sync
+ * @return int 0 on success, -1 else
+ */
+int diskq_init(int threads, size_t max_bytes, int sync);
+
+/**
+ * start writing a file
+ * @param int fd the open file, closed by the stage
+ * @param commit called with ok = 1 if every block was written and the
+ *        file was closed complete, 0 else (the file is closed already)
+ * @param void* arg argument of commit
+ * @return diskq_file* the file, NULL if out of memory (fd is closed, commit not called)
+ */
+diskq_file * diskq_open(int fd, void (*commit)(void * arg, int ok), void * arg);
+
+/**
+ * queue a copy of a block at the end of the file
+ * @param diskq_file* f the file
+ * @param char* data the block
+ * @param size_t n its size
+ * @return int 0 if it was queued (or written), -1 if the file is abandoned
+ */
+int diskq_write(diskq_file * f, const char * data, size_t n);
+
+/**
+ * no more blocks: the file is committed after the queued ones
+ * @param diskq_file* f the file, not to be used after this call
+ * @param int complete 0 if the data is incomplete (the commit gets ok = 0)
+ */
+void diskq_close(diskq_file * f, int complete);
+
+/**
+ * copy the counters of the stage
+ */
+void diskq_get_stats(diskq_stats * out);
+
+/**
+ * write everything queued, commit it and stop the I/O threads
+ */
+void diskq_shutdown(void);
+
+#endif
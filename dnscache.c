@@ -0,0 +1,200 @@
+#include "dnscache.h"
+
+#include "shm.h"
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <time.h>
+
+static dns_set * table = NULL;      //NULL while the cache is disabled
+static uint32_t ttl_s = 0;
+
+/**
+ * @return uint32_t monotonic clock in seconds
+ */
+static uint32_t now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, & ts);
+    return (uint32_t) ts.tv_sec;
+}
+
+/**
+ * FNV-1a of a name, picks its set
+ */
+static dns_set * set_of(const char * name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char * p = (const unsigned char * ) name; * p != '\0'; p++) {
+        h = (h ^ * p) * 16777619u;
+    }
+    return & table[h & (DNS_SETS - 1)];
+}
+
+/**
+ * lock a set. a worker that died holding the lock may have left a name
+ * half written: the set is emptied
+ */
+static void lock_set(dns_set * s) {
+    if (shm_mutex_lock( & s -> lock) != 0) {
+        memset(s -> e, 0, sizeof(s -> e));
+    }
+}
+
+/**
+ * enable the cache
+ * @param int ttl seconds an entry is valid, 0 leaves the cache disabled
+ * @return int 0 on success, -1 else
+ */
+int dns_cache_init(int ttl) {
+    if (ttl <= 0) {
+        return 0;
+    }
+    dns_set * t = (dns_set * ) shm_calloc(DNS_SETS, sizeof(dns_set));
+    if (t == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < DNS_SETS; i++) {
+        shm_mutex_init( & t[i].lock);
+    }
+    ttl_s = (uint32_t) ttl;
+    table = t;
+    return 0;
+}
+
+/**
+ * look a name up
+ * @param char* name the host name
+ * @param struct in_addr* addr the cached address
+ * @return int 0 on a hit, -1 on a miss
+ */
+int dns_cache_get(const char * name, struct in_addr * addr) {
+    if (table == NULL || strlen(name) >= DNS_NAME_LEN) {
+        return -1;
+    }
+    dns_set * s = set_of(name);
+    uint32_t now = now_s();
+    int rc = -1;
+    lock_set(s);
+    for (int i = 0; i < DNS_WAYS; i++) {
+        dns_entry * e = & s -> e[i];
+        if (e -> name[0] != '\0' && strcmp(e -> name, name) == 0) {
+            if ((int32_t)(e -> expires - now) > 0) {
+                addr -> s_addr = e -> addr;
+                e -> used = now;
+                rc = 0;
+            } else {
+                e -> name[0] = '\0';
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock( & s -> lock);
+    return rc;
+}
+
+/**
+ * store a name with a given lifetime
+ */
+static void put(const char * name, uint32_t addr, uint32_t ttl) {
+    size_t n = strlen(name);
+    if (table == NULL || n >= DNS_NAME_LEN || ttl == 0) {
+        return;
+    }
+    dns_set * s = set_of(name);
+    uint32_t now = now_s();
+    lock_set(s);
+    ///same name, else a free or expired slot, else the least recently used one
+    dns_entry * victim = NULL, * lru = & s -> e[0];
+    for (int i = 0; i < DNS_WAYS && victim == NULL; i++) {
+        if (s -> e[i].name[0] != '\0' && strcmp(s -> e[i].name, name) == 0) {
+            victim = & s -> e[i];
+        }
+    }
+    for (int i = 0; i < DNS_WAYS && victim == NULL; i++) {
+        dns_entry * e = & s -> e[i];
+        if (e -> name[0] == '\0' || (int32_t)(e -> expires - now) <= 0) {
+            victim = e;
+        } else if (e -> used < lru -> used) {
+            lru = e;
+        }
+    }
+    if (victim == NULL) {
+        victim = lru;
+    }
+    memcpy(victim -> name, name, n + 1);
+    victim -> addr = addr;
+    victim -> expires = now + ttl;
+    victim -> used = now;
+    pthread_mutex_unlock( & s -> lock);
+}
+
+/**
+ * store a resolved name
+ * @param char* name the host name
+ * @param struct in_addr addr its address
+ */
+void dns_cache_put(const char * name, struct in_addr addr) {
+    put(name, addr.s_addr, ttl_s);
+}
+
+/**
+ * serialize the live entries
+ * @param char* buf the output
+ * @param size_t size size of buf
+ * @return size_t bytes written
+ */
+size_t dns_cache_snapshot(char * buf, size_t size) {
+    size_t off = 0;
+    if (table == NULL) {
+        return 0;
+    }
+    uint32_t now = now_s();
+    for (int i = 0; i < DNS_SETS; i++) {
+        dns_set * s = & table[i];
+        lock_set(s);
+        for (int w = 0; w < DNS_WAYS; w++) {
+            dns_entry * e = & s -> e[w];
+            int32_t left = (int32_t)(e -> expires - now);
+            size_t n = strlen(e -> name);
+            if (n == 0 || left <= 0 || off + 1 + n + 8 > size) {
+                continue;
+            }
+            buf[off++] = (char) n;
+            memcpy(buf + off, e -> name, n);
+            off += n;
+            memcpy(buf + off, & e -> addr, 4);
+            memcpy(buf + off + 4, & left, 4);
+            off += 8;
+        }
+        pthread_mutex_unlock( & s -> lock);
+    }
+    return off;
+}
+
+/**
+ * load entries written by dns_cache_snapshot
+ * @param char* buf the snapshot
+ * @param size_t len its size
+ * @return int number of entries loaded
+ */
+int dns_cache_restore(const char * buf, size_t len) {
+    size_t off = 0;
+    int count = 0;
+    while (off < len) {
+        size_t n = (unsigned char) buf[off++];
+        if (n == 0 || n >= DNS_NAME_LEN || off + n + 8 > len) {
+            break;
+        }
+        char name[DNS_NAME_LEN];
+        uint32_t addr, left;
+        memcpy(name, buf + off, n);
+        name[n] = '\0';
+        memcpy( & addr, buf + off + n, 4);
+        memcpy( & left, buf + off + n + 4, 4);
+        off += n + 8;
+        put(name, addr, left < ttl_s ? left : ttl_s);
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,84 @@
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include <stddef.h>
+
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include <netinet/in.h>
+
+/**
+ * dnscache.h
+ *
+ * This file declares the resolver cache.
+ * a fixed-size set-associative table of name -> IPv4 address, every set
+ * has its own lock so lookups of different names do not contend. entries
+ * live --dns-ttl seconds, a full set evicts its least recently used entry.
+ * the table holds no pointers, it can be copied to another process as a
+ * snapshot (hot restart). with --workers the table is shared by the
+ * worker processes (shm.h).
+ */
+
+#define DNS_SETS 256            //must be a power of 2
+#define DNS_WAYS 4
+#define DNS_NAME_LEN 64         //longer names are not cached
+
+
+/**
+ * one cached name
+ */
+typedef struct dns_entry {
+    char name[DNS_NAME_LEN];    //empty if the slot is free
+    uint32_t addr;              //network order
+    uint32_t expires;           //monotonic second the entry expires
+    uint32_t used;              //monotonic second of the last hit (LRU)
+} dns_entry;
+
+typedef struct dns_set {
+    pthread_mutex_t lock;
+    dns_entry e[DNS_WAYS];
+} dns_set;
+
+
+/**
+ * enable the cache
+ * @param int ttl seconds an entry is valid, 0 leaves the cache disabled
+ * @return int 0 on success, -1 else
+ */
+int dns_cache_init(int ttl);
+
+/**
+ * look a name up
+ * @param char* name the host name
+ * @param struct in_addr* addr the cached address
+ * @return int 0 on a hit, -1 on a miss (or if the cache is disabled)
+ */
+int dns_cache_get(const char * name, struct in_addr * addr);
+
+/**
+ * store a resolved name
+ * @param char* name the host name
+ * @param struct in_addr addr its address
+ */
+void dns_cache_put(const char * name, struct in_addr addr);
+
+/**
+ * serialize the live entries as (u8 name length, name, u32 address,
+ * u32 seconds left) records
+ * @param char* buf the output
+ * @param size_t size size of buf
+ * @return size_t bytes written
+ */
+size_t dns_cache_snapshot(char * buf, size_t size);
+
+/**
+ * load entries written by dns_cache_snapshot
+ * @param char* buf the snapshot
+ * @param size_t len its size
+ * @return int number of entries loaded
+ */
+int dns_cache_restore(const char * buf, size_t len);
+
+#endif
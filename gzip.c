@@ -0,0 +1,173 @@
+#include "gzip.h"
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <strings.h>
+
+#include <time.h>
+
+#include <fcntl.h>
+
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include <zlib.h>
+
+static int gz_level = 0;        //0 while the variants are disabled
+static long gz_min = 0;
+static long gz_cpu_ns = 0;
+
+/**
+ * @return long cpu time of the calling thread in nanoseconds
+ */
+static long cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, & ts);
+    return (long) ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * enable the variants
+ * @param int level zlib compression level 1-9, 0 leaves compression disabled
+ * @param long min_size smaller objects are not compressed
+ * @param int cpu_ms cpu time budget of compressing one object
+ */
+void gzip_init(int level, long min_size, int cpu_ms) {
+    gz_level = level < 0 ? 0 : level > 9 ? 9 : level;
+    gz_min = min_size;
+    gz_cpu_ns = (long) cpu_ms * 1000000L;
+}
+
+/**
+ * @return int 1 if variants are enabled, 0 else
+ */
+int gzip_enabled(void) {
+    return gz_level != 0;
+}
+
+/**
+ * @param char* type mime type of the object, NULL if unknown
+ * @return int 1 for text types, 0 else
+ */
+int gzip_compressible(const char * type) {
+    return type != NULL && strncmp(type, "text/", 5) == 0;
+}
+
+/**
+ * check an Accept-Encoding header, e.g. "br;q=1.0, gzip;q=0.8, *;q=0.1"
+ * @param char* value the header value, NULL if the request had none
+ * @return int 1 if the client accepts gzip (q > 0), 0 else
+ */
+int gzip_accepted(const char * value) {
+    if (value == NULL) {
+        return 0;
+    }
+    int star = 0;
+    const char * p = value;
+    while ( * p != '\0') {
+        while ( * p == ' ' || * p == '\t' || * p == ',') {
+            p++;
+        }
+        const char * name = p;
+        while ( * p != '\0' && * p != ',' && * p != ';' && * p != ' ' && * p != '\t') {
+            p++;
+        }
+        size_t len = (size_t)(p - name);
+        ///a q of 0 means "not acceptable"
+        double q = 1;
+        const char * e = strchr(p, ',');
+        const char * qv = strstr(p, "q=");
+        if (qv != NULL && (e == NULL || qv < e)) {
+            q = strtod(qv + 2, NULL);
+        }
+        if ((len == 4 && strncasecmp(name, "gzip", 4) == 0) || (len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+            return q > 0;
+        }
+        if (len == 1 && * name == '*') {
+            star = q > 0;
+        }
+        p = e != NULL ? e : p + strlen(p);
+    }
+    return star;
+}
+
+/**
+ * compress a cached file into its variant
+ * @param char* src the identity file
+ * @param char* dst the variant
+ * @param off_t size size of src
+ * @return int 0 if the variant was stored, -1 else
+ */
+int gzip_store(const char * src, const char * dst, off_t size) {
+    if (gz_level == 0 || size < gz_min) {
+        unlink(dst);
+        return -1;
+    }
+    char tmp[4096];
+    ///forked workers share the thread ids, not the pid
+    if (snprintf(tmp, sizeof(tmp), "%s.part%d.%lx", dst, (int) getpid(), (unsigned long) pthread_self()) >=
+        (int) sizeof(tmp)) {
+        return -1;
+    }
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    int out = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    unsigned char * ibuf = (unsigned char * ) malloc(2 * GZIP_CHUNK);
+    z_stream z;
+    memset( & z, 0, sizeof(z));
+    ///window bits 15 + 16: a gzip header and trailer instead of zlib's
+    if (out < 0 || ibuf == NULL || deflateInit2( & z, gz_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(ibuf);
+        if (out >= 0) {
+            close(out);
+            unlink(tmp);
+        }
+        close(in);
+        return -1;
+    }
+    unsigned char * obuf = ibuf + GZIP_CHUNK;
+    long start = cpu_ns();
+    long long written = 0, limit = (long long) size * GZIP_MAX_RATIO / 100;
+    int rc = 0, flush = Z_NO_FLUSH;
+    while (rc == 0 && flush != Z_FINISH) {
+        ssize_t n = read(in, ibuf, GZIP_CHUNK);
+        if (n < 0) {
+            rc = -1;
+            break;
+        }
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = ibuf;
+        z.avail_in = (uInt) n;
+        do {
+            z.next_out = obuf;
+            z.avail_out = GZIP_CHUNK;
+            deflate( & z, flush);
+            size_t have = GZIP_CHUNK - z.avail_out;
+            written += (long long) have;
+            if (have > 0 && write(out, obuf, have) != (ssize_t) have) {
+                rc = -1;
+            }
+        } while (rc == 0 && z.avail_out == 0);
+        ///give up on objects that compress badly or take too long
+        if (written > limit || (gz_cpu_ns > 0 && cpu_ns() - start > gz_cpu_ns)) {
+            rc = -1;
+        }
+    }
+    deflateEnd( & z);
+    free(ibuf);
+    close(in);
+    close(out);
+    if (rc == 0 && rename(tmp, dst) == 0) {
+        return 0;
+    }
+    unlink(tmp);
+    unlink(dst);
+    return -1;
+}
@@ -0,0 +1,61 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+
+#include <sys/types.h>
+
+/**
+ * gzip.h
+ *
+ * This file declares the gzip variants of the disk cache.
+ * when a compressible object is admitted to the cache a gzip copy is
+ * written next to it (<file>.gz), so a hit of a client that accepts gzip
+ * is served without compressing anything. an object is compressed only
+ * if it is at least --gzip-min bytes, the compression does not use more
+ * than --gzip-cpu milliseconds of cpu time and saves at least
+ * 100 - GZIP_MAX_RATIO percent.
+ */
+
+#define GZIP_MAX_RATIO 90       //the variant is kept if at most this % of the identity
+#define GZIP_CHUNK 65536        //compression input/output block
+
+
+/**
+ * enable the variants
+ * @param int level zlib compression level 1-9, 0 leaves compression disabled
+ * @param long min_size smaller objects are not compressed
+ * @param int cpu_ms cpu time budget of compressing one object
+ */
+void gzip_init(int level, long min_size, int cpu_ms);
+
+/**
+ * @return int 1 if variants are enabled, 0 else
+ */
+int gzip_enabled(void);
+
+/**
+ * @param char* type mime type of the object, NULL if unknown
+ * @return int 1 if objects of the type are worth compressing, 0 else
+ */
+int gzip_compressible(const char * type);
+
+/**
+ * check an Accept-Encoding header
+ * @param char* value the header value, NULL if the request had none
+ * @return int 1 if the client accepts gzip (q > 0), 0 else
+ */
+int gzip_accepted(const char * value);
+
+/**
+ * compress a cached file into its variant. the variant is written under
+ * a temporary name and renamed, an old variant is removed if the new
+ * one is not worth keeping
+ * @param char* src the identity file
+ * @param char* dst the variant
+ * @param off_t size size of src
+ * @return int 0 if the variant was stored, -1 else
+ */
+int gzip_store(const char * src, const char * dst, off_t size);
+
+#endif
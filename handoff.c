@@ -0,0 +1,212 @@
+#include "handoff.h"
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <sys/un.h>
+
+/**
+ * fill a unix socket address
+ * @return int 0 on success, -1 if the path is too long
+ */
+static int unix_addr(const char * path, struct sockaddr_un * addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr -> sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr -> sun_path)) {
+        fprintf(stderr, "error: control socket path too long\n");
+        return -1;
+    }
+    strcpy(addr -> sun_path, path);
+    return 0;
+}
+
+/**
+ * write a whole buffer
+ * @return int 0 on success, -1 else
+ */
+static int write_all(int fd, const char * buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w <= 0) {
+            return -1;
+        }
+        buf += w;
+        n -= (size_t) w;
+    }
+    return 0;
+}
+
+/**
+ * read a whole buffer
+ * @return int 0 on success, -1 else
+ */
+static int read_all(int fd, char * buf, size_t n) {
+    while (n > 0) {
+        ssize_t r = read(fd, buf, n);
+        if (r <= 0) {
+            return -1;
+        }
+        buf += r;
+        n -= (size_t) r;
+    }
+    return 0;
+}
+
+/**
+ * create the control socket of a running server
+ * @param char* path the socket path (replaced if it exists)
+ * @return int the listening socket, -1 on failure
+ */
+int handoff_listen(const char * path) {
+    struct sockaddr_un addr;
+    if (unix_addr(path, & addr) != 0) {
+        return -1;
+    }
+    int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd < 0) {
+        perror("error: socket\n");
+        return -1;
+    }
+    unlink(path);
+    if (bind(sd, (struct sockaddr * ) & addr, sizeof(addr)) < 0 || listen(sd, 1) < 0) {
+        perror("error: control socket\n");
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+/**
+ * send the listening sockets and the snapshot, then wait for the ack
+ * @return int 0 if the new server took over, -1 else
+ */
+int handoff_send(int conn, int * fds, int nfds, const char * snap, size_t snap_len) {
+    if (nfds < 1 || nfds > HANDOFF_MAX_FDS || snap_len > HANDOFF_MAX_SNAPSHOT) {
+        return -1;
+    }
+    handoff_hdr hdr = {
+            HANDOFF_MAGIC, HANDOFF_VERSION, (uint32_t) nfds, (uint32_t) snap_len
+    };
+    struct iovec iov = {
+            & hdr, sizeof(hdr)
+    };
+    char ctl[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    memset(ctl, 0, sizeof(ctl));
+    struct msghdr msg;
+    memset( & msg, 0, sizeof(msg));
+    msg.msg_iov = & iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t) nfds);
+    struct cmsghdr * cm = CMSG_FIRSTHDR( & msg);
+    cm -> cmsg_level = SOL_SOCKET;
+    cm -> cmsg_type = SCM_RIGHTS;
+    cm -> cmsg_len = CMSG_LEN(sizeof(int) * (size_t) nfds);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * (size_t) nfds);
+    if (sendmsg(conn, & msg, 0) != (ssize_t) sizeof(hdr) || write_all(conn, snap, snap_len) != 0) {
+        perror("error: handoff\n");
+        return -1;
+    }
+    char ack;
+    if (read(conn, & ack, 1) != 1) {
+        fprintf(stderr, "handoff: the new server did not take over\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * take over from the server listening on a control socket
+ * @return int the connection to ack on, -1 on failure
+ */
+int handoff_recv(const char * path, int * fds, int * nfds, char ** snap, size_t * snap_len) {
+    struct sockaddr_un addr;
+    if (unix_addr(path, & addr) != 0) {
+        return -1;
+    }
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0) {
+        perror("error: socket\n");
+        return -1;
+    }
+    if (connect(conn, (struct sockaddr * ) & addr, sizeof(addr)) < 0) {
+        perror("error: takeover connect\n");
+        close(conn);
+        return -1;
+    }
+    handoff_hdr hdr;
+    struct iovec iov = {
+            & hdr, sizeof(hdr)
+    };
+    char ctl[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct msghdr msg;
+    memset( & msg, 0, sizeof(msg));
+    msg.msg_iov = & iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    ssize_t r = recvmsg(conn, & msg, MSG_WAITALL);
+    struct cmsghdr * cm = CMSG_FIRSTHDR( & msg);
+    if (r != (ssize_t) sizeof(hdr) || hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION ||
+        cm == NULL || cm -> cmsg_type != SCM_RIGHTS || hdr.nfds < 1 || hdr.nfds > HANDOFF_MAX_FDS ||
+        cm -> cmsg_len != CMSG_LEN(sizeof(int) * hdr.nfds) || hdr.snap_len > HANDOFF_MAX_SNAPSHOT) {
+        fprintf(stderr, "error: bad handoff message\n");
+        close(conn);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(int) * hdr.nfds);
+    * nfds = (int) hdr.nfds;
+    * snap_len = hdr.snap_len;
+    * snap = (char * ) malloc(hdr.snap_len + 1);
+    if ( * snap == NULL || read_all(conn, * snap, hdr.snap_len) != 0) {
+        fprintf(stderr, "error: handoff snapshot\n");
+        free( * snap);
+        for (int i = 0; i < * nfds; i++) {
+            close(fds[i]);
+        }
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+/**
+ * tell the old server the sockets are served
+ * @param int conn the connection returned by handoff_recv (closed)
+ */
+void handoff_ack(int conn) {
+    char ack = 1;
+    if (write(conn, & ack, 1) != 1) {
+        perror("error: handoff ack\n");
+    }
+    close(conn);
+}
+
+/**
+ * find a section of a snapshot
+ * @return char* the section data, NULL if missing
+ */
+const char * handoff_section(const char * snap, size_t len, uint32_t type, size_t * sec_len) {
+    size_t off = 0;
+    while (off + sizeof(handoff_sec) <= len) {
+        handoff_sec sec;
+        memcpy( & sec, snap + off, sizeof(sec));
+        off += sizeof(sec);
+        if (sec.len > len - off) {
+            return NULL;
+        }
+        if (sec.type == type) {
+            * sec_len = sec.len;
+            return snap + off;
+        }
+        off += sec.len;
+    }
+    return NULL;
+}
@@ -0,0 +1,97 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+
+#include <stdint.h>
+
+/**
+ * handoff.h
+ *
+ * This file declares the hot restart handoff.
+ * the running server listens on a unix socket (--control). a new server
+ * started with --takeover connects to it and receives the listening
+ * sockets (SCM_RIGHTS) and a snapshot of the warm state. once the new
+ * server accepts on the sockets it acks, the old one stops accepting,
+ * drains its requests and exits. no connection is refused meanwhile: both
+ * processes accept from the same sockets during the switch.
+ *
+ * the snapshot is a sequence of sections: (u32 type, u32 length, data).
+ */
+
+#define HANDOFF_MAGIC 0x4f485850        //"PXHO"
+#define HANDOFF_VERSION 1
+#define HANDOFF_MAX_FDS 64
+#define HANDOFF_MAX_SNAPSHOT (4 * 1024 * 1024)
+
+/**
+ * snapshot section types
+ */
+enum handoff_section {
+    SNAP_DNS = 1        //dns_cache_snapshot records
+};
+
+
+/**
+ * first message, carries the listening sockets
+ */
+typedef struct handoff_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nfds;          //sockets attached to the message
+    uint32_t snap_len;      //snapshot bytes that follow
+} handoff_hdr;
+
+typedef struct handoff_sec {
+    uint32_t type;          //enum handoff_section
+    uint32_t len;           //data bytes that follow
+} handoff_sec;
+
+
+/**
+ * create the control socket of a running server
+ * @param char* path the socket path (replaced if it exists)
+ * @return int the listening socket, -1 on failure
+ */
+int handoff_listen(const char * path);
+
+/**
+ * send the listening sockets and the snapshot to a new server, then wait
+ * for its ack
+ * @param int conn a connection accepted on the control socket
+ * @param int* fds the listening sockets
+ * @param int nfds number of sockets
+ * @param char* snap the snapshot
+ * @param size_t snap_len its size
+ * @return int 0 if the new server took over, -1 else
+ */
+int handoff_send(int conn, int * fds, int nfds, const char * snap, size_t snap_len);
+
+/**
+ * take over from the server listening on a control socket
+ * @param char* path the control socket of the running server
+ * @param int* fds the received listening sockets
+ * @param int* nfds number of sockets received
+ * @param char** snap the snapshot (malloc'ed, free it)
+ * @param size_t* snap_len its size
+ * @return int the connection to ack on with handoff_ack, -1 on failure
+ */
+int handoff_recv(const char * path, int * fds, int * nfds, char ** snap, size_t * snap_len);
+
+/**
+ * tell the old server the sockets are served, it starts to drain
+ * @param int conn the connection returned by handoff_recv (closed)
+ */
+void handoff_ack(int conn);
+
+/**
+ * find a section of a snapshot
+ * @param char* snap the snapshot
+ * @param size_t len its size
+ * @param uint32_t type the section type
+ * @param size_t* sec_len size of the section data
+ * @return char* the section data, NULL if missing
+ */
+const char * handoff_section(const char * snap, size_t len, uint32_t type, size_t * sec_len);
+
+#endif
@@ -0,0 +1,132 @@
+#include "negcache.h"
+
+#include "shm.h"
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <time.h>
+
+static neg_set * table = NULL;      //NULL while the cache is disabled
+static uint32_t ttl_s = 0;
+
+/**
+ * @return uint32_t monotonic clock in seconds
+ */
+static uint32_t now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, & ts);
+    return (uint32_t) ts.tv_sec;
+}
+
+/**
+ * FNV-1a 64 of the kind and the name, never 0
+ */
+static uint64_t key_of(int kind, const char * name) {
+    uint64_t h = 14695981039346656037ull;
+    h = (h ^ (unsigned char) kind) * 1099511628211ull;
+    for (const unsigned char * p = (const unsigned char * ) name; * p != '\0'; p++) {
+        h = (h ^ * p) * 1099511628211ull;
+    }
+    return h != 0 ? h : 1;
+}
+
+/**
+ * lock a set. a worker that died holding the lock may have left an entry
+ * half written: the set is emptied
+ */
+static void lock_set(neg_set * s) {
+    if (shm_mutex_lock( & s -> lock) != 0) {
+        memset(s -> e, 0, sizeof(s -> e));
+    }
+}
+
+/**
+ * enable the cache
+ * @param int ttl seconds a failure is remembered, 0 leaves the cache disabled
+ * @return int 0 on success, -1 else
+ */
+int neg_cache_init(int ttl) {
+    if (ttl <= 0) {
+        return 0;
+    }
+    neg_set * t = (neg_set * ) shm_calloc(NEG_SETS, sizeof(neg_set));
+    if (t == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < NEG_SETS; i++) {
+        shm_mutex_init( & t[i].lock);
+    }
+    ttl_s = (uint32_t) ttl;
+    table = t;
+    return 0;
+}
+
+/**
+ * look a failure up
+ * @param int kind enum neg_kind
+ * @param char* name the host, origin or URL
+ * @return int the status to answer, 0 if there is no live entry
+ */
+int neg_cache_get(int kind, const char * name) {
+    if (table == NULL) {
+        return 0;
+    }
+    uint64_t key = key_of(kind, name);
+    neg_set * s = & table[key & (NEG_SETS - 1)];
+    uint32_t now = now_s();
+    int status = 0;
+    lock_set(s);
+    for (int i = 0; i < NEG_WAYS; i++) {
+        neg_entry * e = & s -> e[i];
+        if (e -> key == key) {
+            if ((int32_t)(e -> expires - now) > 0) {
+                status = e -> status;
+            } else {
+                e -> key = 0;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock( & s -> lock);
+    return status;
+}
+
+/**
+ * remember a failure
+ * @param int kind enum neg_kind
+ * @param char* name the host, origin or URL
+ * @param int status the status to answer
+ */
+void neg_cache_put(int kind, const char * name, int status) {
+    if (table == NULL) {
+        return;
+    }
+    uint64_t key = key_of(kind, name);
+    neg_set * s = & table[key & (NEG_SETS - 1)];
+    uint32_t now = now_s();
+    lock_set(s);
+    ///same key, else a free or expired slot, else the one that expires first
+    neg_entry * victim = NULL, * first = & s -> e[0];
+    for (int i = 0; i < NEG_WAYS && victim == NULL; i++) {
+        if (s -> e[i].key == key) {
+            victim = & s -> e[i];
+        }
+    }
+    for (int i = 0; i < NEG_WAYS && victim == NULL; i++) {
+        neg_entry * e = & s -> e[i];
+        if (e -> key == 0 || (int32_t)(e -> expires - now) <= 0) {
+            victim = e;
+        } else if ((int32_t)(e -> expires - first -> expires) < 0) {
+            first = e;
+        }
+    }
+    if (victim == NULL) {
+        victim = first;
+    }
+    victim -> key = key;
+    victim -> expires = now + ttl_s;
+    victim -> status = (uint16_t) status;
+    pthread_mutex_unlock( & s -> lock);
+}
@@ -0,0 +1,72 @@
+#ifndef NEGCACHE_H
+#define NEGCACHE_H
+
+#include <stdint.h>
+
+#include <pthread.h>
+
+/**
+ * negcache.h
+ *
+ * This file declares the negative cache.
+ * failures are remembered for --neg-ttl seconds, so a client repeating a
+ * request that fails does not repeat the work behind the failure: host
+ * names that do not resolve or are blocked by the filter, origins that
+ * refuse connections and URLs the origin answers with an error.
+ * a fixed-size set-associative table keyed by a 64-bit hash of the kind
+ * and the name, every set has its own lock. with --workers the table is
+ * shared by the worker processes (shm.h).
+ */
+
+#define NEG_SETS 1024           //must be a power of 2
+#define NEG_WAYS 4
+
+/**
+ * kinds of names
+ */
+enum neg_kind {
+    NEG_HOST = 'h',     //host name: dns failure (404) or filtered (403)
+    NEG_ORIGIN = 'o',   //host:port of an origin that could not be connected (500)
+    NEG_URL = 'u'       //host/path the origin answered with an error status
+};
+
+
+/**
+ * one remembered failure
+ */
+typedef struct neg_entry {
+    uint64_t key;       //0 if the slot is free
+    uint32_t expires;   //monotonic second the entry expires
+    uint16_t status;    //the status to answer
+} neg_entry;
+
+typedef struct neg_set {
+    pthread_mutex_t lock;
+    neg_entry e[NEG_WAYS];
+} neg_set;
+
+
+/**
+ * enable the cache
+ * @param int ttl seconds a failure is remembered, 0 leaves the cache disabled
+ * @return int 0 on success, -1 else
+ */
+int neg_cache_init(int ttl);
+
+/**
+ * look a failure up
+ * @param int kind enum neg_kind
+ * @param char* name the host, origin or URL
+ * @return int the status to answer, 0 if there is no live entry
+ */
+int neg_cache_get(int kind, const char * name);
+
+/**
+ * remember a failure
+ * @param int kind enum neg_kind
+ * @param char* name the host, origin or URL
+ * @param int status the status to answer
+ */
+void neg_cache_put(int kind, const char * name, int status);
+
+#endif
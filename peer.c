@@ -0,0 +1,394 @@
+#include "peer.h"
+
+#include "sockopt.h"
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <unistd.h>
+
+#include <netdb.h>
+
+#include <time.h>
+
+#include <sys/socket.h>
+
+static peer peers[PEER_MAX];
+static int npeers = 0;                  //0 = cluster disabled
+static int check_interval = 1000;
+static pthread_t checker;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static int stopping = 0;
+
+static char token[PEER_TOKEN_LEN];              //cluster token, empty for none
+static char token_header[PEER_TOKEN_LEN + 32];  //its header line, empty for none
+static char ping[PEER_TOKEN_LEN + 64];          //the health check request
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, & ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/**
+ * FNV-1a of a string
+ */
+static uint64_t name_hash(const char * s) {
+    uint64_t h = 1469598103934665603ULL;
+    while ( * s != '\0') {
+        h ^= (unsigned char) * s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * the score of a node for a key: a 64-bit finalizer of both hashes
+ */
+static uint64_t score(uint64_t key, uint64_t node) {
+    uint64_t x = key ^ node;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * open a connection to a peer, with the connect bounded by PEER_TIMEOUT_MS
+ * @param peer* p the peer
+ * @return int the socket, -1 on failure
+ */
+static int dial(peer * p) {
+    int sd = socket(PF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+        return -1;
+    }
+    struct timeval tv = {
+            PEER_TIMEOUT_MS / 1000, (PEER_TIMEOUT_MS % 1000) * 1000
+    };
+    ///connect honours the send timeout
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, & tv, sizeof(tv));
+    sock_apply(SOCK_PEER, sd);
+    if (connect(sd, (struct sockaddr * ) & p -> addr, sizeof(p -> addr)) < 0) {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+/**
+ * health check of a peer: it answers a ping with a 200 within PEER_TIMEOUT_MS
+ * @param peer* p the peer
+ * @return int 1 if it is healthy, 0 else
+ */
+static int check(peer * p) {
+    int sd = dial(p);
+    if (sd < 0) {
+        return 0;
+    }
+    struct timeval tv = {
+            PEER_TIMEOUT_MS / 1000, (PEER_TIMEOUT_MS % 1000) * 1000
+    };
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, & tv, sizeof(tv));
+    char buf[64];
+    ssize_t n = -1;
+    if (write(sd, ping, strlen(ping)) == (ssize_t) strlen(ping)) {
+        n = read(sd, buf, sizeof(buf) - 1);
+    }
+    close(sd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    return strncmp(buf, "HTTP/1.", 7) == 0 && strncmp(buf + 8, " 200", 4) == 0;
+}
+
+/**
+ * close the idle connections of a peer older than PEER_IDLE_MS (all of them if all is 1)
+ */
+static void prune(peer * p, int all) {
+    uint64_t now = now_ms();
+    pthread_mutex_lock( & p -> lock);
+    int kept = 0;
+    for (int i = 0; i < p -> nidle; i++) {
+        if (all || now - p -> idle_since[i] > PEER_IDLE_MS) {
+            close(p -> idle[i]);
+        } else {
+            p -> idle[kept] = p -> idle[i];
+            p -> idle_since[kept++] = p -> idle_since[i];
+        }
+    }
+    p -> nidle = kept;
+    pthread_mutex_unlock( & p -> lock);
+}
+
+/**
+ * the health check thread: checks every peer each interval
+ */
+static void * check_loop(void * arg) {
+    (void) arg;
+    ///the peers start as up: the nodes of a cluster start at about the same time
+    pthread_mutex_lock( & stop_lock);
+    while (!stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, & until);
+        until.tv_sec += check_interval / 1000;
+        until.tv_nsec += (long)(check_interval % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait( & stop_cond, & stop_lock, & until);
+        if (stopping) {
+            break;
+        }
+        pthread_mutex_unlock( & stop_lock);
+        for (int i = 0; i < npeers; i++) {
+            if (peers[i].self) {
+                continue;
+            }
+            int up = check( & peers[i]);
+            int was = __atomic_exchange_n( & peers[i].up, up, __ATOMIC_RELAXED);
+            if (up != was) {
+                fprintf(stderr, "peer %s is %s\n", peers[i].name, up ? "up" : "down");
+            }
+            prune( & peers[i], !up);
+        }
+        pthread_mutex_lock( & stop_lock);
+    }
+    pthread_mutex_unlock( & stop_lock);
+    return NULL;
+}
+
+/**
+ * parse the node list and start the health checks
+ * @param char* list host:port,host:port,... NULL leaves the cluster disabled
+ * @param char* self the entry of this node in the list
+ * @param int check_ms interval of the health checks
+ * @param char* token_in the cluster token sent with and required from the peer requests, NULL for none
+ * @return int 0 on success, -1 else
+ */
+int peer_init(const char * list, const char * self, int check_ms, const char * token_in) {
+    if (list == NULL) {
+        return 0;
+    }
+    check_interval = check_ms;
+    ///the token goes into header lines
+    if (token_in != NULL && (strlen(token_in) >= PEER_TOKEN_LEN || strpbrk(token_in, "\r\n") != NULL)) {
+        fprintf(stderr, "peers: bad token\n");
+        return -1;
+    }
+    if (token_in != NULL && token_in[0] != '\0') {
+        snprintf(token, sizeof(token), "%s", token_in);
+        snprintf(token_header, sizeof(token_header), "X-Peer-Token: %s\r\n", token);
+    }
+    snprintf(ping, sizeof(ping), "GET / HTTP/1.0\r\nX-Peer: ping\r\n%s\r\n", token_header);
+    char * copy = strdup(list), * save;
+    if (copy == NULL) {
+        return -1;
+    }
+    int n = 0, found = 0;
+    for (char * name = strtok_r(copy, ",", & save); name != NULL; name = strtok_r(NULL, ",", & save)) {
+        char * colon = strrchr(name, ':');
+        if (n == PEER_MAX || colon == NULL || strlen(name) >= PEER_NAME_LEN) {
+            fprintf(stderr, "peers: bad entry %s\n", name);
+            free(copy);
+            return -1;
+        }
+        peer * p = & peers[n];
+        memset(p, 0, sizeof(peer));
+        snprintf(p -> name, PEER_NAME_LEN, "%s", name);
+        p -> hash = name_hash(name);
+        p -> self = self != NULL && strcmp(name, self) == 0;
+        p -> up = 1;
+        found |= p -> self;
+        pthread_mutex_init( & p -> lock, NULL);
+        * colon = '\0';
+        struct addrinfo hints, * res;
+        memset( & hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(name, colon + 1, & hints, & res) != 0) {
+            fprintf(stderr, "peers: cannot resolve %s\n", p -> name);
+            free(copy);
+            return -1;
+        }
+        memcpy( & p -> addr, res -> ai_addr, sizeof(p -> addr));
+        freeaddrinfo(res);
+        n++;
+    }
+    free(copy);
+    if (!found) {
+        fprintf(stderr, "peers: %s is not in the list\n", self != NULL ? self : "--peer-self");
+        return -1;
+    }
+    npeers = n;
+    if (pthread_create( & checker, NULL, check_loop, NULL) != 0) {
+        npeers = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * the node that owns a key
+ * @param uint64_t key the cache key
+ * @return int index of the peer to fetch from, -1 if the key is local
+ */
+int peer_owner(uint64_t key) {
+    int best = -1;
+    uint64_t top = 0;
+    ///the highest score among the nodes that are up: a node that is down passes its keys on
+    for (int i = 0; i < npeers; i++) {
+        uint64_t s = score(key, peers[i].hash);
+        if ((best < 0 || s > top) && (peers[i].self || __atomic_load_n( & peers[i].up, __ATOMIC_RELAXED))) {
+            best = i;
+            top = s;
+        }
+    }
+    return best >= 0 && !peers[best].self ? best : -1;
+}
+
+/**
+ * compare a token with the cluster token in a time that does not depend on
+ * where they differ
+ * @param char* given the token received, NULL if none
+ * @return int 1 if it is the cluster token, 0 else
+ */
+static int token_ok(const char * given) {
+    if (given == NULL) {
+        return 0;
+    }
+    size_t n = strlen(token);
+    unsigned char diff = strlen(given) != n;
+    for (size_t i = 0; i < n && given[i] != '\0'; i++) {
+        diff |= (unsigned char)(given[i] ^ token[i]);
+    }
+    return diff == 0;
+}
+
+/**
+ * tell the other nodes from the clients: only they may send X-Peer requests
+ * @param struct in_addr* addr the address of a client
+ * @param char* given its X-Peer-Token header, NULL if none
+ * @return int 1 if it is the address of another node with the cluster token, 0 else
+ */
+int peer_trusted(const struct in_addr * addr, const char * given) {
+    if (token[0] != '\0' && !token_ok(given)) {
+        return 0;
+    }
+    for (int i = 0; i < npeers; i++) {
+        if (!peers[i].self && peers[i].addr.sin_addr.s_addr == addr -> s_addr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return char* the X-Peer-Token header line of the peer requests, "" without a cluster token
+ */
+const char * peer_token_header(void) {
+    return token_header;
+}
+
+/**
+ * a connection to a peer, kept alive from a previous fetch if possible
+ * @param int idx the peer
+ * @param int* reused set to 1 if the connection was idle
+ * @return int the socket, -1 if the peer cannot be reached
+ */
+int peer_connect(int idx, int * reused) {
+    peer * p = & peers[idx];
+    uint64_t now = now_ms();
+    pthread_mutex_lock( & p -> lock);
+    ///the most recent idle connection is the least likely to be timed out by the peer
+    while (p -> nidle > 0) {
+        int sd = p -> idle[--p -> nidle];
+        if (now - p -> idle_since[p -> nidle] <= PEER_IDLE_MS) {
+            pthread_mutex_unlock( & p -> lock);
+            * reused = 1;
+            return sd;
+        }
+        close(sd);
+    }
+    pthread_mutex_unlock( & p -> lock);
+    * reused = 0;
+    return dial(p);
+}
+
+/**
+ * give back a connection after a fetch
+ * @param int idx the peer
+ * @param int sd the socket
+ * @param int keep 1 if the connection can serve another request
+ */
+void peer_release(int idx, int sd, int keep) {
+    peer * p = & peers[idx];
+    if (keep) {
+        pthread_mutex_lock( & p -> lock);
+        if (p -> nidle < PEER_IDLE_MAX) {
+            p -> idle[p -> nidle] = sd;
+            p -> idle_since[p -> nidle++] = now_ms();
+            sd = -1;
+        }
+        pthread_mutex_unlock( & p -> lock);
+    }
+    if (sd >= 0) {
+        close(sd);
+    }
+}
+
+/**
+ * a fetch from a peer failed: skip it until a health check passes
+ * @param int idx the peer
+ */
+void peer_down(int idx) {
+    __atomic_add_fetch( & peers[idx].failed, 1, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n( & peers[idx].up, 0, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "peer %s is down\n", peers[idx].name);
+    }
+}
+
+/**
+ * count a fetch served by a peer
+ * @param int idx the peer
+ */
+void peer_fetched(int idx) {
+    __atomic_add_fetch( & peers[idx].fetched, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * print the per peer counters to stderr
+ */
+void peer_print_stats(void) {
+    for (int i = 0; i < npeers; i++) {
+        if (!peers[i].self) {
+            fprintf(stderr, "peer %s: %ld fetched, %ld failed over\n", peers[i].name, peers[i].fetched,
+                    peers[i].failed);
+        }
+    }
+}
+
+/**
+ * stop the health checks and close the idle connections
+ */
+void peer_shutdown(void) {
+    if (npeers == 0) {
+        return;
+    }
+    pthread_mutex_lock( & stop_lock);
+    stopping = 1;
+    pthread_cond_signal( & stop_cond);
+    pthread_mutex_unlock( & stop_lock);
+    pthread_join(checker, NULL);
+    for (int i = 0; i < npeers; i++) {
+        prune( & peers[i], 1);
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include <netinet/in.h>
+
+/**
+ * peer.h
+ *
+ * This file declares the peer cache cluster.
+ * every node gets the same --peers list and owns the cache keys it wins by
+ * rendezvous hashing (highest hash of key and node name), so adding or
+ * removing a node moves only the keys of that node. a node fetches the
+ * objects it does not own from their owner over kept-alive connections and
+ * keeps no copy of them. a peer that fails a fetch or a health check is
+ * skipped (its keys go to the next node by score, or the origin) until a
+ * check succeeds again.
+ * a request with X-Peer is a peer request only from the address of another
+ * node and, with a cluster token, only with the token in X-Peer-Token: the
+ * nodes of one host share an address, the token tells them from its clients.
+ */
+
+#define PEER_MAX 64
+#define PEER_NAME_LEN 64
+#define PEER_IDLE_MAX 4             //idle connections kept per peer
+#define PEER_IDLE_MS 2000           //an idle connection is closed after this
+#define PEER_KEEPALIVE_MS 5000      //the owner waits this long for the next request
+#define PEER_TIMEOUT_MS 1000        //connect and health check timeout
+#define PEER_TOKEN_LEN 64           //longest --peer-token
+
+
+/**
+ * one node of the cluster
+ */
+typedef struct peer {
+    char name[PEER_NAME_LEN];       //host:port as given
+    struct sockaddr_in addr;
+    uint64_t hash;                  //hash of the name, mixed with the keys
+    int self;                       //1 for this node
+    int up;                         //0 after a failure, until a health check passes
+    pthread_mutex_t lock;           //protects the idle connections
+    int nidle;
+    int idle[PEER_IDLE_MAX];
+    uint64_t idle_since[PEER_IDLE_MAX];     //monotonic ms
+    long fetched;                   //objects fetched from the peer
+    long failed;                    //fetches that failed over to the origin
+} peer;
+
+
+/**
+ * parse the node list and start the health checks
+ * @param char* list host:port,host:port,... NULL leaves the cluster disabled
+ * @param char* self the entry of this node in the list
+ * @param int check_ms interval of the health checks
+ * @param char* token_in the cluster token sent with and required from the peer requests, NULL for none
+ * @return int 0 on success, -1 else
+ */
+int peer_init(const char * list, const char * self, int check_ms, const char * token_in);
+
+/**
+ * the node that owns a key
+ * @param uint64_t key the cache key
+ * @return int index of the peer to fetch from, -1 if the key is local
+ *         (this node owns it, the cluster is disabled or no owner is up)
+ */
+int peer_owner(uint64_t key);
+
+/**
+ * tell the other nodes from the clients: only they may send X-Peer requests
+ * @param struct in_addr* addr the address of a client
+ * @param char* given its X-Peer-Token header, NULL if none
+ * @return int 1 if it is the address of another node with the cluster token, 0 else
+ */
+int peer_trusted(const struct in_addr * addr, const char * given);
+
+/**
+ * @return char* the X-Peer-Token header line of the peer requests, "" without a cluster token
+ */
+const char * peer_token_header(void);
+
+/**
+ * a connection to a peer, kept alive from a previous fetch if possible
+ * @param int idx the peer
+ * @param int* reused set to 1 if the connection was idle (it may have been closed by the peer)
+ * @return int the socket, -1 if the peer cannot be reached
+ */
+int peer_connect(int idx, int * reused);
+
+/**
+ * give back a connection after a fetch
+ * @param int idx the peer
+ * @param int sd the socket
+ * @param int keep 1 if the response was read to its end and the peer keeps the connection
+ */
+void peer_release(int idx, int sd, int keep);
+
+/**
+ * a fetch from a peer failed: skip it until a health check passes
+ * @param int idx the peer
+ */
+void peer_down(int idx);
+
+/**
+ * count a fetch served by a peer
+ * @param int idx the peer
+ */
+void peer_fetched(int idx);
+
+/**
+ * print the per peer counters to stderr
+ */
+void peer_print_stats(void);
+
+/**
+ * stop the health checks and close the idle connections
+ */
+void peer_shutdown(void);
+
+#endif
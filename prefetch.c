@@ -0,0 +1,627 @@
+#define _GNU_SOURCE
+
+#include "prefetch.h"
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <strings.h>
+
+#include <ctype.h>
+
+#include <time.h>
+
+/**
+ * states of the tokenizer
+ */
+enum scan_state {
+    S_TEXT,             //between tags
+    S_OPEN,             //after '<'
+    S_BANG,             //after "<!"
+    S_BANG_DASH,        //after "<!-"
+    S_COMMENT,          //in <!-- -->
+    S_SKIP,             //in a tag that is not looked at (end tag, doctype), until '>'
+    S_CLOSE_RAW,        //after "</" in the text of a script or style
+    S_TAG,              //in the tag name
+    S_ATTRS,            //between the attributes
+    S_ATTR,             //in an attribute name
+    S_AFTER_ATTR,       //after an attribute name, before '=' or the next attribute
+    S_BEFORE_VALUE,     //after '='
+    S_VALUE             //in an attribute value
+};
+
+static prefetch_set * table = NULL;     //NULL until prefetch_init
+static int max_conns = 1;
+static int64_t rate_bps = 0;
+static prefetch_stats stats;
+
+/**
+ * @return uint64_t monotonic clock in milliseconds
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, & ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/**
+ * set the budgets of the origins
+ * @param int conns prefetches of one origin at once
+ * @param long rate bytes per second an origin gets prefetches for
+ * @return int 0 on success, -1 else
+ */
+int prefetch_init(int conns, long rate) {
+    if (conns < 1 || rate < 1) {
+        return -1;
+    }
+    prefetch_set * t = (prefetch_set * ) calloc(PREFETCH_SETS, sizeof(prefetch_set));
+    if (t == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < PREFETCH_SETS; i++) {
+        pthread_mutex_init( & t[i].lock, NULL);
+    }
+    max_conns = conns;
+    rate_bps = rate;
+    table = t;
+    return 0;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+/**
+ * append a char to a tag or attribute name, lower case
+ * @param char* name the name
+ * @param int* len its length, -1 once too long
+ */
+static void name_add(char * name, int * len, char c) {
+    if ( * len < 0) {
+        return;
+    }
+    if ( * len >= PREFETCH_TAG_LEN - 1) {
+        * len = -1;
+        return;
+    }
+    name[( * len)++] = (char) tolower((unsigned char) c);
+    name[ * len] = '\0';
+}
+
+/**
+ * pass a reference on: trimmed, with &amp; decoded
+ */
+static void emit(prefetch_scanner * s, const char * v) {
+    char ref[PREFETCH_URL_LEN];
+    size_t n = 0;
+    while (is_space( * v)) {
+        v++;
+    }
+    while ( * v != '\0' && n < sizeof(ref) - 1) {
+        if (strncmp(v, "&amp;", 5) == 0) {
+            ref[n++] = '&';
+            v += 5;
+        } else {
+            ref[n++] = * v++;
+        }
+    }
+    while (n > 0 && is_space(ref[n - 1])) {
+        n--;
+    }
+    ref[n] = '\0';
+    if (n > 0) {
+        s -> found(s -> arg, ref);
+    }
+}
+
+/**
+ * @return int 1 if the value of the current attribute is needed
+ */
+static int wanted(const prefetch_scanner * s) {
+    if (s -> tag_len <= 0 || s -> attr_len <= 0) {
+        return 0;
+    }
+    if (strcmp(s -> attr, "src") == 0) {
+        return strcmp(s -> tag, "img") == 0 || strcmp(s -> tag, "script") == 0 || strcmp(s -> tag, "source") == 0;
+    }
+    return strcmp(s -> tag, "link") == 0 && (strcmp(s -> attr, "href") == 0 || strcmp(s -> attr, "rel") == 0);
+}
+
+/**
+ * the value of an attribute is complete
+ */
+static void end_value(prefetch_scanner * s) {
+    if (s -> value_len < 0) {
+        return;
+    }
+    s -> value[s -> value_len] = '\0';
+    if (strcmp(s -> attr, "src") == 0) {
+        emit(s, s -> value);
+    } else if (strcmp(s -> attr, "href") == 0) {
+        memcpy(s -> href, s -> value, (size_t) s -> value_len + 1);
+    } else {
+        ///the links a browser loads with the page, not the ones it only follows
+        s -> rel_ok = strcasestr(s -> value, "stylesheet") != NULL || strcasestr(s -> value, "icon") != NULL ||
+                      strcasestr(s -> value, "preload") != NULL;
+    }
+}
+
+/**
+ * the '>' of a start tag
+ */
+static void end_tag(prefetch_scanner * s) {
+    s -> state = S_TEXT;
+    if (s -> tag_len <= 0) {
+        return;
+    }
+    if (strcmp(s -> tag, "link") == 0 && s -> rel_ok && s -> href[0] != '\0') {
+        emit(s, s -> href);
+    }
+    ///the text of a script or style is not markup, up to its end tag
+    if (strcmp(s -> tag, "script") == 0 || strcmp(s -> tag, "style") == 0) {
+        s -> raw = 1;
+    }
+}
+
+/**
+ * start scanning a page
+ * @param prefetch_scanner* s the tokenizer
+ * @param prefetch_found_fn found called for each reference
+ * @param void* arg its argument
+ */
+void prefetch_scan_init(prefetch_scanner * s, prefetch_found_fn found, void * arg) {
+    memset(s, 0, sizeof(prefetch_scanner));
+    s -> state = S_TEXT;
+    s -> found = found;
+    s -> arg = arg;
+}
+
+/**
+ * scan the next block of a page
+ * @param prefetch_scanner* s the tokenizer
+ * @param char* data the block
+ * @param size_t len its size
+ */
+void prefetch_scan(prefetch_scanner * s, const char * data, size_t len) {
+    const char * p = data, * end = data + len;
+    while (p < end) {
+        ///the text between the tags and the quoted values are skipped or copied with memchr
+        if (s -> state == S_TEXT) {
+            const char * lt = memchr(p, '<', (size_t)(end - p));
+            if (lt == NULL) {
+                return;
+            }
+            p = lt + 1;
+            s -> state = S_OPEN;
+            continue;
+        }
+        if (s -> state == S_SKIP) {
+            const char * gt = memchr(p, '>', (size_t)(end - p));
+            if (gt == NULL) {
+                return;
+            }
+            p = gt + 1;
+            s -> state = S_TEXT;
+            continue;
+        }
+        if (s -> state == S_VALUE && s -> quote != 0) {
+            const char * q = memchr(p, s -> quote, (size_t)(end - p));
+            size_t n = (size_t)((q != NULL ? q : end) - p);
+            if (s -> value_len >= 0) {
+                if ((size_t) s -> value_len + n < sizeof(s -> value)) {
+                    memcpy(s -> value + s -> value_len, p, n);
+                    s -> value_len += (int) n;
+                } else {
+                    s -> value_len = -1;
+                }
+            }
+            if (q == NULL) {
+                return;
+            }
+            end_value(s);
+            s -> state = S_ATTRS;
+            p = q + 1;
+            continue;
+        }
+        char c = * p++;
+        switch (s -> state) {
+            case S_OPEN:
+                if (s -> raw) {
+                    s -> state = c == '/' ? S_CLOSE_RAW : S_TEXT;
+                    s -> match = 0;
+                } else if (c == '!') {
+                    s -> state = S_BANG;
+                } else if (c == '/') {
+                    s -> state = S_SKIP;
+                } else if (isalpha((unsigned char) c)) {
+                    s -> tag_len = 0;
+                    s -> href[0] = '\0';
+                    s -> rel_ok = 0;
+                    name_add(s -> tag, & s -> tag_len, c);
+                    s -> state = S_TAG;
+                } else if (c != '<') {
+                    s -> state = S_TEXT;
+                }
+                break;
+            case S_BANG:
+                s -> state = c == '-' ? S_BANG_DASH : c == '>' ? S_TEXT : S_SKIP;
+                break;
+            case S_BANG_DASH:
+                s -> state = c == '-' ? S_COMMENT : S_SKIP;
+                s -> dashes = 0;
+                break;
+            case S_COMMENT:
+                if (c == '-') {
+                    s -> dashes++;
+                } else if (c == '>' && s -> dashes >= 2) {
+                    s -> state = S_TEXT;
+                } else {
+                    s -> dashes = 0;
+                }
+                break;
+            case S_CLOSE_RAW:
+                if (s -> tag[s -> match] == '\0') {
+                    if (c == '>' || is_space(c) || c == '/') {
+                        s -> raw = 0;
+                        s -> state = c == '>' ? S_TEXT : S_SKIP;
+                    } else {
+                        s -> state = S_TEXT;
+                    }
+                } else if (tolower((unsigned char) c) == s -> tag[s -> match]) {
+                    s -> match++;
+                } else {
+                    s -> state = S_TEXT;
+                }
+                break;
+            case S_TAG:
+                if (c == '>') {
+                    end_tag(s);
+                } else if (is_space(c) || c == '/') {
+                    s -> state = S_ATTRS;
+                } else {
+                    name_add(s -> tag, & s -> tag_len, c);
+                }
+                break;
+            case S_ATTRS:
+            case S_AFTER_ATTR:
+                if (c == '>') {
+                    end_tag(s);
+                } else if (c == '=' && s -> state == S_AFTER_ATTR) {
+                    s -> state = S_BEFORE_VALUE;
+                } else if (!is_space(c) && c != '/') {
+                    s -> attr_len = 0;
+                    name_add(s -> attr, & s -> attr_len, c);
+                    s -> state = S_ATTR;
+                }
+                break;
+            case S_ATTR:
+                if (c == '=') {
+                    s -> state = S_BEFORE_VALUE;
+                } else if (c == '>') {
+                    end_tag(s);
+                } else if (is_space(c)) {
+                    s -> state = S_AFTER_ATTR;
+                } else if (c == '/') {
+                    s -> state = S_ATTRS;
+                } else {
+                    name_add(s -> attr, & s -> attr_len, c);
+                }
+                break;
+            case S_BEFORE_VALUE:
+                if (c == '>') {
+                    end_tag(s);
+                } else if (!is_space(c)) {
+                    ///only the values of the wanted attributes are copied
+                    s -> value_len = wanted(s) ? 0 : -1;
+                    s -> quote = c == '"' || c == '\'' ? c : 0;
+                    s -> state = S_VALUE;
+                    if (s -> quote == 0 && s -> value_len >= 0) {
+                        s -> value[s -> value_len++] = c;
+                    }
+                }
+                break;
+            case S_VALUE:   //unquoted
+                if (is_space(c) || c == '>') {
+                    end_value(s);
+                    if (c == '>') {
+                        end_tag(s);
+                    } else {
+                        s -> state = S_ATTRS;
+                    }
+                } else if (s -> value_len >= 0) {
+                    if (s -> value_len < (int) sizeof(s -> value) - 1) {
+                        s -> value[s -> value_len++] = c;
+                    } else {
+                        s -> value_len = -1;
+                    }
+                }
+                break;
+            default:
+                s -> state = S_TEXT;
+        }
+    }
+}
+
+/**
+ * remove the . and .. segments of a path, the query is kept as is
+ * @param char* path the path, starts with '/'
+ */
+static void remove_dots(char * path) {
+    char out[PREFETCH_URL_LEN * 2];
+    const char * q = strchr(path, '?');
+    size_t end = q != NULL ? (size_t)(q - path) : strlen(path), w = 0, i = 0;
+    while (i < end) {
+        size_t j = i + 1;
+        while (j < end && path[j] != '/') {
+            j++;
+        }
+        size_t n = j - i - 1;
+        int last = j >= end;
+        if (n == 1 && path[i + 1] == '.') {
+            if (last) {
+                out[w++] = '/';
+            }
+        } else if (n == 2 && path[i + 1] == '.' && path[i + 2] == '.') {
+            ///drop the last segment written, the root stays
+            while (w > 0 && out[--w] != '/') {}
+            if (last) {
+                out[w++] = '/';
+            }
+        } else {
+            memcpy(out + w, path + i, j - i);
+            w += j - i;
+        }
+        i = j;
+    }
+    if (w == 0) {
+        out[w++] = '/';
+    }
+    strcpy(out + w, path + end);
+    strcpy(path, out);
+}
+
+/**
+ * resolve a reference of a page to an object of the same origin
+ * @param char* page host[:port]/path of the page
+ * @param char* ref the reference
+ * @param char* out host[:port]/path of the resource, dot segments and fragment removed
+ * @param size_t size size of out
+ * @return int 0 on success, -1 if it is not an http object of the same origin
+ */
+int prefetch_resolve(const char * page, const char * ref, char * out, size_t size) {
+    const char * slash = strchr(page, '/');
+    size_t host_len = slash != NULL ? (size_t)(slash - page) : 0;
+    char path[PREFETCH_URL_LEN * 2];
+    if (host_len == 0 || strlen(ref) >= PREFETCH_URL_LEN) {
+        return -1;
+    }
+    if (strncasecmp(ref, "http://", 7) == 0) {
+        ref += 5;
+    }
+    if (ref[0] == '/' && ref[1] == '/') {
+        ///absolute: the same host (and port) only
+        ref += 2;
+        size_t n = strcspn(ref, "/?#");
+        if (n != host_len || strncasecmp(ref, page, n) != 0) {
+            return -1;
+        }
+        ref += n;
+        snprintf(path, sizeof(path), "%s%s", ref[0] == '/' ? "" : "/", ref);
+    } else if (ref[0] == '/') {
+        snprintf(path, sizeof(path), "%s", ref);
+    } else {
+        ///another scheme (https:, data:, javascript:) or a fragment of the page itself
+        size_t n = strcspn(ref, ":/?#");
+        if (ref[n] == ':' || ref[0] == '#' || ref[0] == '?') {
+            return -1;
+        }
+        ///relative to the directory of the page
+        size_t dir = strcspn(slash, "?");
+        while (dir > 0 && slash[dir - 1] != '/') {
+            dir--;
+        }
+        snprintf(path, sizeof(path), "%.*s%s", (int) dir, slash, ref);
+    }
+    path[strcspn(path, "#")] = '\0';
+    ///the path goes into a request line
+    for (const char * c = path; * c != '\0'; c++) {
+        if ((unsigned char) * c <= ' ' || * c == 0x7f) {
+            return -1;
+        }
+    }
+    remove_dots(path);
+    if (host_len + strlen(path) >= size || host_len + strlen(path) >= PREFETCH_URL_LEN) {
+        return -1;
+    }
+    memcpy(out, page, host_len);
+    strcpy(out + host_len, path);
+    return 0;
+}
+
+/**
+ * @param char* url host[:port]/path
+ * @return prefetch_req* a prefetch of it (malloc'ed), NULL if out of memory
+ */
+prefetch_req * prefetch_new(const char * url) {
+    size_t n = strlen(url) + 1;
+    prefetch_req * r = (prefetch_req * ) malloc(sizeof(prefetch_req) + n);
+    if (r != NULL) {
+        r -> next = NULL;
+        memcpy(r -> url, url, n);
+    }
+    return r;
+}
+
+/**
+ * the budget of the origin of a url, a free or idle slot is taken for a new
+ * one. an idle origin still paying for its last fetches is kept
+ * @param prefetch_set* s the set of the origin, locked
+ * @param char* url the url
+ * @param size_t n length of its origin name
+ * @param uint64_t now monotonic ms
+ * @return prefetch_origin* NULL if the set has no room
+ */
+static prefetch_origin * find(prefetch_set * s, const char * url, size_t n, uint64_t now) {
+    prefetch_origin * victim = NULL;
+    for (int i = 0; i < PREFETCH_WAYS; i++) {
+        prefetch_origin * o = & s -> o[i];
+        if (strncmp(o -> name, url, n) == 0 && o -> name[n] == '\0') {
+            return o;
+        }
+        if (victim == NULL &&
+            (o -> name[0] == '\0' || (o -> busy == 0 && o -> nparked == 0 && o -> tokens >= rate_bps))) {
+            victim = o;
+        }
+    }
+    if (victim != NULL) {
+        memcpy(victim -> name, url, n);
+        victim -> name[n] = '\0';
+        victim -> busy = 0;
+        victim -> tokens = rate_bps;
+        victim -> refilled = now;
+    }
+    return victim;
+}
+
+/**
+ * the set of the origin of a url
+ * @param size_t* n set to the length of the origin name
+ */
+static prefetch_set * set_of(const char * url, size_t * n) {
+    uint32_t h = 2166136261u;
+    * n = strcspn(url, "/");
+    for (size_t i = 0; i < * n; i++) {
+        h = (h ^ (unsigned char) url[i]) * 16777619u;
+    }
+    return & table[h & (PREFETCH_SETS - 1)];
+}
+
+/**
+ * add the bytes of the time passed to the bucket, up to one second of them
+ */
+static void refill(prefetch_origin * o, uint64_t now) {
+    int64_t add = rate_bps * (int64_t)(now - o -> refilled) / 1000;
+    if (add > 0) {
+        o -> tokens = o -> tokens + add < rate_bps ? o -> tokens + add : rate_bps;
+        o -> refilled = now;
+    }
+}
+
+/**
+ * take a prefetch slot of the origin of a request
+ * @param prefetch_req* r the request
+ * @return int 0 if it is fetched now, 1 if it waits for a slot (prefetch_done hands
+ *         it back), -1 if it is dropped (the caller frees it)
+ */
+int prefetch_admit(prefetch_req * r) {
+    size_t n;
+    if (table == NULL) {
+        return -1;
+    }
+    prefetch_set * s = set_of(r -> url, & n);
+    if (n >= PREFETCH_NAME_LEN) {
+        return -1;
+    }
+    uint64_t now = now_ms();
+    int rc = -1;
+    pthread_mutex_lock( & s -> lock);
+    prefetch_origin * o = find(s, r -> url, n, now);
+    if (o != NULL) {
+        refill(o, now);
+        if (o -> tokens <= 0) {
+            rc = -1;
+        } else if (o -> busy < max_conns) {
+            o -> busy++;
+            rc = 0;
+        } else if (o -> nparked < PREFETCH_PARKED_MAX) {
+            r -> next = NULL;
+            if (o -> tail != NULL) {
+                o -> tail -> next = r;
+            } else {
+                o -> head = r;
+            }
+            o -> tail = r;
+            o -> nparked++;
+            rc = 1;
+        }
+    }
+    pthread_mutex_unlock( & s -> lock);
+    if (rc < 0) {
+        __atomic_add_fetch( & stats.over_budget, 1, __ATOMIC_RELAXED);
+    }
+    return rc;
+}
+
+/**
+ * end a prefetch: charge its bytes to its origin and free it
+ * @param prefetch_req* r the request admitted
+ * @param long long bytes bytes fetched, -1 if it was not fetched
+ * @return prefetch_req* a waiting request of the origin that takes over the slot, NULL if none
+ */
+prefetch_req * prefetch_done(prefetch_req * r, long long bytes) {
+    size_t n;
+    prefetch_set * s = set_of(r -> url, & n);
+    prefetch_req * next = NULL, * dropped = NULL;
+    int ndropped = 0;
+    if (bytes >= 0) {
+        __atomic_add_fetch( & stats.fetched, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch( & stats.bytes, bytes, __ATOMIC_RELAXED);
+    }
+    uint64_t now = now_ms();
+    pthread_mutex_lock( & s -> lock);
+    ///an origin with a prefetch running is never replaced
+    prefetch_origin * o = find(s, r -> url, n, now);
+    if (o != NULL) {
+        o -> tokens -= bytes > 0 ? bytes : 0;
+        refill(o, now);
+        if (o -> head != NULL && o -> tokens > 0) {
+            next = o -> head;
+            o -> head = next -> next;
+            o -> tail = o -> head != NULL ? o -> tail : NULL;
+            o -> nparked--;
+        } else {
+            ///the budget is spent: the waiting ones are dropped, not delayed
+            dropped = o -> head;
+            ndropped = o -> nparked;
+            o -> head = o -> tail = NULL;
+            o -> nparked = 0;
+            o -> busy--;
+        }
+    }
+    pthread_mutex_unlock( & s -> lock);
+    while (dropped != NULL) {
+        prefetch_req * d = dropped;
+        dropped = d -> next;
+        free(d);
+    }
+    if (ndropped > 0) {
+        __atomic_add_fetch( & stats.over_budget, ndropped, __ATOMIC_RELAXED);
+    }
+    free(r);
+    return next;
+}
+
+/**
+ * count an event
+ * @param int event enum prefetch_event
+ */
+void prefetch_note(int event) {
+    long * c = event == PREFETCH_QUEUED ? & stats.queued : event == PREFETCH_SHED ? & stats.shed : & stats.skipped;
+    __atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * copy the counters
+ * @param prefetch_stats* out the counters
+ */
+void prefetch_get_stats(prefetch_stats * out) {
+    out -> queued = __atomic_load_n( & stats.queued, __ATOMIC_RELAXED);
+    out -> shed = __atomic_load_n( & stats.shed, __ATOMIC_RELAXED);
+    out -> skipped = __atomic_load_n( & stats.skipped, __ATOMIC_RELAXED);
+    out -> fetched = __atomic_load_n( & stats.fetched, __ATOMIC_RELAXED);
+    out -> over_budget = __atomic_load_n( & stats.over_budget, __ATOMIC_RELAXED);
+    out -> bytes = __atomic_load_n( & stats.bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,180 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+
+#include <stdint.h>
+
+#include <pthread.h>
+
+/**
+ * prefetch.h
+ *
+ * This file declares the prefetch of the resources of HTML pages.
+ * a page fetched from the origin for a client goes through a streaming
+ * tokenizer block by block as it is relayed: the src of img, script and
+ * source tags and the href of stylesheet, icon and preload links of the
+ * same origin are queued right away to low priority prefetch threads,
+ * which fetch them into the cache while the browser is still reading the
+ * page. no copy of the page is kept, a reference cut between two blocks
+ * is completed with the next one.
+ * every origin gets --prefetch-conns prefetches at once (the others wait
+ * in a list of the origin) and --prefetch-rate kilobytes per second (a token
+ * bucket holding one second of it, the size of a fetch is charged when it
+ * ends): an origin over its budget gets no prefetch until the bucket
+ * refills. with --workers the budgets are per worker.
+ */
+
+#define PREFETCH_URL_LEN 256            //longer references are skipped
+#define PREFETCH_NAME_LEN 64            //longer origin names get no prefetch
+#define PREFETCH_TAG_LEN 8              //tag and attribute names kept by the tokenizer
+#define PREFETCH_MAX_REFS 64            //references queued per page
+#define PREFETCH_SETS 64                //origin table, must be a power of 2
+#define PREFETCH_WAYS 4
+#define PREFETCH_PARKED_MAX 256         //prefetches waiting per origin, more are dropped
+#define PREFETCH_QUEUE 1024             //prefetches waiting for a thread, more are dropped
+#define PREFETCH_NICE 10                //nice value of the prefetch threads
+
+/**
+ * called by the tokenizer for each reference found
+ * @param void* arg the argument given to prefetch_scan_init
+ * @param char* ref the reference as written in the page (trimmed)
+ */
+typedef void (*prefetch_found_fn)(void * arg, const char * ref);
+
+/**
+ * the state of the tokenizer between two blocks of a page
+ */
+typedef struct prefetch_scanner {
+    int state;
+    char quote;                         //quote of the value being read, 0 if unquoted
+    int dashes;                         //'-' in a row, for the end of a comment
+    int raw;                            //1 in the text of a script or style tag
+    int match;                          //chars of its closing tag matched
+    int tag_len, attr_len, value_len;   //-1 once too long
+    char tag[PREFETCH_TAG_LEN];
+    char attr[PREFETCH_TAG_LEN];
+    char value[PREFETCH_URL_LEN];
+    char href[PREFETCH_URL_LEN];        //href of a link tag, queued at its end if rel fits
+    int rel_ok;                         //1 if the rel of the link tag is fetched by browsers
+    prefetch_found_fn found;
+    void * arg;
+} prefetch_scanner;
+
+/**
+ * a resource to prefetch
+ */
+typedef struct prefetch_req {
+    struct prefetch_req * next;         //in the waiting list of its origin
+    char url[];                         //host[:port]/path
+} prefetch_req;
+
+/**
+ * the budget of one origin
+ */
+typedef struct prefetch_origin {
+    char name[PREFETCH_NAME_LEN];       //host[:port], empty if the slot is free
+    int busy;                           //prefetches running
+    int nparked;                        //prefetches waiting for a slot
+    prefetch_req * head;                //the waiting ones, oldest first
+    prefetch_req * tail;
+    int64_t tokens;                     //bytes left in the bucket, negative after a big fetch
+    uint64_t refilled;                  //monotonic ms of the last refill
+} prefetch_origin;
+
+typedef struct prefetch_set {
+    pthread_mutex_t lock;
+    prefetch_origin o[PREFETCH_WAYS];
+} prefetch_set;
+
+/**
+ * counters of the prefetch stage
+ */
+typedef struct prefetch_stats {
+    long queued;            //references queued
+    long shed;              //references the prefetch queue had no room for
+    long skipped;           //cached, failing, owned by a peer or fetched already when their turn came
+    long fetched;           //fetched from the origin
+    long over_budget;       //dropped: byte budget of the origin spent or too many waiting
+    long long bytes;        //bytes fetched
+} prefetch_stats;
+
+/**
+ * events counted by prefetch_note
+ */
+enum prefetch_event {
+    PREFETCH_QUEUED,
+    PREFETCH_SHED,
+    PREFETCH_SKIPPED
+};
+
+
+/**
+ * set the budgets of the origins
+ * @param int conns prefetches of one origin at once
+ * @param long rate bytes per second an origin gets prefetches for
+ * @return int 0 on success, -1 else
+ */
+int prefetch_init(int conns, long rate);
+
+/**
+ * start scanning a page
+ * @param prefetch_scanner* s the tokenizer
+ * @param prefetch_found_fn found called for each reference
+ * @param void* arg its argument
+ */
+void prefetch_scan_init(prefetch_scanner * s, prefetch_found_fn found, void * arg);
+
+/**
+ * scan the next block of a page
+ * @param prefetch_scanner* s the tokenizer
+ * @param char* data the block
+ * @param size_t len its size
+ */
+void prefetch_scan(prefetch_scanner * s, const char * data, size_t len);
+
+/**
+ * resolve a reference of a page to an object of the same origin
+ * @param char* page host[:port]/path of the page
+ * @param char* ref the reference
+ * @param char* out host[:port]/path of the resource, dot segments and fragment removed
+ * @param size_t size size of out
+ * @return int 0 on success, -1 if it is not an http object of the same origin
+ */
+int prefetch_resolve(const char * page, const char * ref, char * out, size_t size);
+
+/**
+ * @param char* url host[:port]/path
+ * @return prefetch_req* a prefetch of it (malloc'ed), NULL if out of memory
+ */
+prefetch_req * prefetch_new(const char * url);
+
+/**
+ * take a prefetch slot of the origin of a request
+ * @param prefetch_req* r the request
+ * @return int 0 if it is fetched now, 1 if it waits for a slot (prefetch_done hands
+ *         it back), -1 if it is dropped (the caller frees it)
+ */
+int prefetch_admit(prefetch_req * r);
+
+/**
+ * end a prefetch: charge its bytes to its origin and free it
+ * @param prefetch_req* r the request admitted
+ * @param long long bytes bytes fetched, -1 if it was not fetched
+ * @return prefetch_req* a waiting request of the origin that takes over the slot, NULL if none
+ */
+prefetch_req * prefetch_done(prefetch_req * r, long long bytes);
+
+/**
+ * count an event
+ * @param int event enum prefetch_event
+ */
+void prefetch_note(int event);
+
+/**
+ * copy the counters
+ * @param prefetch_stats* out the counters
+ */
+void prefetch_get_stats(prefetch_stats * out);
+
+#endif
@@ -12,27 +12,96 @@
 
 #include <netinet/in.h>
 
+#include <netinet/tcp.h>
+
 #include <netdb.h>
 
 #include <sys/socket.h>
 
 #include <sys/stat.h>
 
+#include <sys/sendfile.h>
+
 #include <fcntl.h>
 
 #include <ctype.h>
 
+#include <strings.h>
+
+#include <getopt.h>
+
+#include <signal.h>
+
+#include <errno.h>
+
+#include <poll.h>
+
+#include <time.h>
+
+#include <limits.h>
+
+#include <sys/wait.h>
+
+#include <sys/resource.h>
+
 #define TRUE 0
 #define FALSE - 1
+#define Not_Modified 304
 #define Bad_Request 400
 #define Forbidden 403
 #define Not_Found 404
+#define Request_Timeout 408
+#define Gone 410
+#define Range_Not_Satisfiable 416
 #define Server_Error 500
 #define Not_Supported 501
+#define Bad_Gateway 502
+#define Service_Unavailable 503
+#define Gateway_Timeout 504
 #define LEN 1024
+#define RELAY_LEN 16384         //first origin read buffer, the response header must fit in it
+#define MAX_RANGES 16           //a Range header with more ranges is ignored
+#define RANGE_BOUNDARY "PROXY_BYTERANGES_7d3f9a"
+#define FRESH 0                 //cache_state: serve the cached copy
+#define STALE_SERVE 1           //serve it and revalidate in the background
+#define STALE 2                 //revalidate before serving
+#define KEEP_ALIVE 1            //serve_client: the connection waits for another request
+#define TUNNEL_CHUNK 65536      //bytes moved by one splice (the default pipe capacity)
 
 #include "threadpool.h"
 
+#include "trace.h"
+
+#include "accesslog.h"
+
+#include "arena.h"
+
+#include "affinity.h"
+
+#include "dnscache.h"
+
+#include "handoff.h"
+
+#include "gzip.h"
+
+#include "cache.h"
+
+#include "negcache.h"
+
+#include "diskq.h"
+
+#include "peer.h"
+
+#include "bufpool.h"
+
+#include "timerwheel.h"
+
+#include "sockopt.h"
+
+#include "shm.h"
+
+#include "prefetch.h"
+
 /************ LINKED LIST ************/
 typedef struct Node {
     char * address;
@@ -53,9 +122,114 @@ typedef struct params {
     LinkList * ips;
     int filter;
     int sd;
+    struct sockaddr_in cli;     //address of the client
+    threadpool * miss_pool;     //lane of the origin fetches, NULL to fetch in place
+    threadpool * tunnel_pool;   //lane of the CONNECT tunnels
 }
         params;
 
+/**
+ * an inclusive byte range of an object
+ */
+typedef struct byte_range {
+    off_t first;
+    off_t last;
+}
+        byte_range;
+
+/**
+ * a cache miss handed from the request thread to the miss lane,
+ * allocated in the arena of the request
+ */
+typedef struct miss_ctx {
+    arena * a;              //the arena of the request, released by the miss lane
+    char * request;         //request to send to the origin
+    char * full_path;       //host/path of the object
+    char * file;            //its cache file
+    char * range;           //Range header of the request, NULL if none
+    int gzip;               //1 if the client accepts gzip
+    cache_meta * old;       //stale cached copy to revalidate, NULL for a miss
+    int sd;                 //the client socket
+    int owner;              //the peer to fetch from, -1 for the origin
+    uint32_t trace_req;     //trace id of the request
+    alog_rec rec;           //access log record, continued by the miss lane
+}
+        miss_ctx;
+
+/**
+ * a CONNECT request handed from the request thread to the tunnel lane,
+ * allocated in the arena of the request
+ */
+typedef struct tunnel_ctx {
+    arena * a;              //the arena of the request, released by the tunnel lane
+    char * request;         //the request
+    ssize_t is_read;        //its bytes, the client may have sent data after the header
+    params p;               //the client
+    uint32_t trace_req;     //trace id of the request
+    alog_rec rec;           //access log record, continued by the tunnel lane
+}
+        tunnel_ctx;
+
+/**
+ * server options given on the command line
+ */
+typedef struct server_conf {
+    int pool_max;       //elastic pool upper bound (pool-size for a fixed pool)
+    int pool_idle;      //idle milliseconds before an extra thread exits
+    int max_queue;      //requests waiting for a thread, 0 = unbounded
+    int shed_target;    //CoDel target queue time in milliseconds, 0 = off
+    int shed_interval;  //CoDel interval in milliseconds
+    int backlog;        //listen backlog
+    int miss_pool;      //threads of the miss lane, 0 = misses run on the request thread
+    int tunnel_pool;    //threads of the tunnel lane, one per open tunnel
+    int shards;         //listening sockets (SO_REUSEPORT), each with its own acceptor and pools
+    int pin_workers;    //1 if the workers run on worker_cpus only
+    cpu_set_t worker_cpus;
+    int pin_acceptor;   //1 if the acceptors run on acceptor_cpus only
+    cpu_set_t acceptor_cpus;
+    int workers;        //worker processes (--workers), 0 = this process serves
+    char * control;     //control socket of the hot restart, NULL for none
+    int takeover;       //connection to the old server, -1 if started cold
+    int nfds;           //listening sockets received from the old server (or opened by prefork)
+    int fds[HANDOFF_MAX_FDS];
+}
+        server_conf;
+
+/**
+ * a listening socket with its own acceptor and threadpools. with several
+ * shards the kernel spreads the connections over them and the threads of
+ * a shard run on one NUMA node
+ */
+typedef struct shard {
+    int sd;                     //listening socket
+    threadpool * pool;          //request lane
+    threadpool * miss_pool;     //miss lane, NULL without --miss-pool
+    threadpool * tunnel_pool;   //tunnel lane
+    int pin_workers;            //1 if the workers run on worker_cpus
+    cpu_set_t worker_cpus;
+    int pin_acceptor;           //1 if the acceptor runs on acceptor_cpus
+    cpu_set_t acceptor_cpus;
+    pthread_t acceptor;
+    struct server * srv;
+}
+        shard;
+
+/**
+ * state shared by the shards
+ */
+typedef struct server {
+    server_conf * conf;
+    int filter;
+    LinkList * hosts;
+    LinkList * ips;
+    int max_req;            //0 = until SIGTERM or a hot restart
+    struct shard * shards;
+    int nshards;
+    int control_sd;         //control socket, -1 without --control
+    int handed_off;         //1 if a new server took the listening sockets
+}
+        server;
+
 /**
  * Add data to new node at the end of the given link list.
  * @param link_list Link list to add data to
@@ -140,10 +314,11 @@ void calc_byte(char * b, int mask) {
  * @return int m the mask as int
  */
 void base_ip(char * ip, int mask) {
-    char * b1 = strtok(ip, ".");
-    char * b2 = strtok(NULL, ".");
-    char * b3 = strtok(NULL, ".");
-    char * b4 = strtok(NULL, " ");
+    char * save;
+    char * b1 = strtok_r(ip, ".", & save);
+    char * b2 = strtok_r(NULL, ".", & save);
+    char * b3 = strtok_r(NULL, ".", & save);
+    char * b4 = strtok_r(NULL, " ", & save);
     double place = (double) mask / 8;
     if (0 <= place && place <= 1) {
         calc_byte(b1, mask);
@@ -224,6 +399,34 @@ void fill_lists(FILE * fp, LinkList * hosts, LinkList * ips) {
     free(line);
 }
 
+/**
+ * resolve a host name, or check that an ip address has a host (thread safe)
+ * @param char* name the host name or the ip address
+ * @param struct in_addr* addr to contain the address
+ * @return int TRUE if resolved, FALSE if not
+ */
+int lookup_host(char * name, struct in_addr * addr) {
+    if (dns_cache_get(name, addr) == 0) {
+        return TRUE;
+    }
+    struct hostent he, * hp = NULL;
+    char buf[2048];
+    int err;
+    if (!isdigit(name[0])) {
+        gethostbyname_r(name, & he, buf, sizeof(buf), & hp, & err);
+    } else {
+        struct in_addr a;
+        inet_aton(name, & a);
+        gethostbyaddr_r( & a, sizeof(a), AF_INET, & he, buf, sizeof(buf), & hp, & err);
+    }
+    if (hp == NULL || hp -> h_addr_list[0] == NULL) {
+        return FALSE;
+    }
+    * addr = * ((struct in_addr * ) hp -> h_addr_list[0]);
+    dns_cache_put(name, * addr);
+    return TRUE;
+}
+
 /**
  * convert a host name to ip address
  * @param char* hostname the host name
@@ -231,13 +434,12 @@ void fill_lists(FILE * fp, LinkList * hosts, LinkList * ips) {
  * @return int true if validate, false if not
  */
 int hostname_to_ip(char * hostname, char * ip) {
-    struct hostent * hp;
-    hp = gethostbyname(hostname);
-    if (hp == NULL) {
-        herror("gethostbyname");
+    struct in_addr a;
+    if (lookup_host(hostname, & a) == FALSE) {
+        fprintf(stderr, "gethostbyname: %s not found\n", hostname);
         return FALSE;
     }
-    sprintf(ip, "%s", inet_ntoa( * ((struct in_addr * ) hp -> h_addr_list[0])));
+    inet_ntop(AF_INET, & a, ip, 17);
     return TRUE;
 }
 /**
@@ -249,43 +451,29 @@ int hostname_to_ip(char * hostname, char * ip) {
  */
 int search_in_filter(char * addr, LinkList * hosts, LinkList * ips) {
     Node * temp;
-    char * ip = (char * ) malloc(sizeof(char) * 17);
-    if(ip == NULL){
-        return 10;
-    }
+    char ip[17], t[17];
     memset(ip, '\0', 17);
     if (!isdigit(addr[0])) {
         temp = hosts -> first;
         while (temp != NULL) {
             if (strcmp(addr, temp -> address) == 0) {
-                free(ip);
                 return FALSE;
             }
             temp = temp -> next;
         }
         hostname_to_ip(addr, ip);
     } else {
-        strcpy(ip, addr);
+        snprintf(ip, sizeof(ip), "%s", addr);
     }
     temp = ips -> first;
-    char * t = (char * ) malloc(sizeof(char) * 17);
-    if(t == NULL){
-        free(ip);
-        return 10;
-    }
     while (temp != NULL) {
-        memset(t, '\0', 17);
-        strcpy(t, ip);
+        memcpy(t, ip, sizeof(t));
         base_ip(t, temp -> mask);
         if (strcmp(t, temp -> address) == 0) {
-            free(t);
-            free(ip);
             return FALSE;
         }
         temp = temp -> next;
     }
-    free(t);
-    free(ip);
     return TRUE;
 }
 
@@ -322,10 +510,46 @@ void error_handle(char * msg, int err) {
         strcpy(content, "Method is not supported");
 
     }
+    if (err == Gone) {
+        strcpy(type, "410 Gone");
+        strcpy(content, "File is gone");
+    }
+    if (err == Bad_Gateway) {
+        strcpy(type, "502 Bad Gateway");
+        strcpy(content, "Origin server error");
+    }
+    if (err == Gateway_Timeout) {
+        strcpy(type, "504 Gateway Timeout");
+        strcpy(content, "Origin server timeout");
+    }
+    char * extra = "";
+    if (err == Service_Unavailable) {
+        strcpy(type, "503 Service Unavailable");
+        strcpy(content, "Server overloaded");
+        extra = "Retry-After: 1\r\n";
+    }
     int size = ((int) strlen(type) * 2) + (int) strlen(body) + (int) strlen(content);
     sprintf(msg,
-            "HTTP/1.0 %s\r\nContent-Type: text/html\nContent-Length: %d\nConnection: close\r\n\r\n<HTML><HEAD><TITLE>%s</TITLE></HEAD>\r\n<BODY><H4>%s</H4>\r\n%s.\r\n</BODY></HTML>\r\n",
-            type, size, type, type, content);
+            "HTTP/1.0 %s\r\nContent-Type: text/html\nContent-Length: %d\nConnection: close\r\n%s\r\n<HTML><HEAD><TITLE>%s</TITLE></HEAD>\r\n<BODY><H4>%s</H4>\r\n%s.\r\n</BODY></HTML>\r\n",
+            type, size, extra, type, type, content);
+}
+
+static const int error_codes[] = {
+        Bad_Request, Forbidden, Not_Found, Gone, Server_Error, Not_Supported, Bad_Gateway, Service_Unavailable,
+        Gateway_Timeout
+};
+#define ERROR_CODES (int)(sizeof(error_codes) / sizeof(error_codes[0]))
+static char error_msgs[ERROR_CODES][400];  //pre-rendered responses, empty until init_error_msgs
+static int error_lens[ERROR_CODES];
+
+/**
+ * render every error response once, so sending one is a single write
+ */
+void init_error_msgs(void) {
+    for (int i = 0; i < ERROR_CODES; i++) {
+        error_handle(error_msgs[i], error_codes[i]);
+        error_lens[i] = (int) strlen(error_msgs[i]);
+    }
 }
 
 /**
@@ -377,13 +601,22 @@ int validate_args(char * argv[], int * port, int * pool_size, int * max_requests
  * @param int port port number to the server
  * @return int sd of the server, FALSE in case of function failure
  * */
-int init_server(int port) {
+int init_server(int port, int backlog, int reuseport) {
     int sd;
     struct sockaddr_in srv;
     if ((sd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
         perror("error: socket\n");
         return FALSE;
     }
+    ///shards bind the same port, the kernel balances the connections
+    int on = 1;
+    if (reuseport && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, & on, sizeof(on)) < 0) {
+        perror("error: setsockopt\n");
+        close(sd);
+        return FALSE;
+    }
+    ///before listen: the buffer sizes set the window scale of the accepted connections
+    sock_apply(SOCK_LISTEN, sd);
     srv.sin_family = AF_INET;
     srv.sin_port = htons(port);
     srv.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -392,11 +625,13 @@ int init_server(int port) {
         close(sd);
         return FALSE;
     }
-    if (listen(sd, 5) < 0) {
+    if (listen(sd, backlog) < 0) {
         perror("error: listen\n");
         close(sd);
         return FALSE;
     }
+    ///the acceptors poll, a connection taken by another acceptor must not block
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
     return sd;
 }
 
@@ -406,108 +641,167 @@ int init_server(int port) {
  * @param int err the error type
  * */
 void send_error_msg(int sd, int err) {
+    alog_status(err);
+    for (int i = 0; i < ERROR_CODES; i++) {
+        if (error_codes[i] == err && error_lens[i] != 0) {
+            alog_bytes(write(sd, error_msgs[i], (size_t) error_lens[i]));
+            return;
+        }
+    }
     char msg[400];
     error_handle(msg, err);
-    write(sd, msg, strlen(msg));
+    alog_bytes(write(sd, msg, strlen(msg)));
+}
+
+/**
+ * answer a 503 on a client socket and close it
+ * @param int sd the client socket
+ * @param struct sockaddr_in* cli the client address
+ * @return int FALSE
+ */
+int shed_client_sd(int sd, struct sockaddr_in * cli) {
+    alog_rec rec;
+    alog_begin( & rec, cli);
+    send_error_msg(sd, Service_Unavailable);
+    close(sd);
+    alog_end();
+    return FALSE;
+}
+
+/**
+ * answer a request the server has no capacity for with a 503 and close it.
+ * called by the accept loop when the queue is full and by the pool for
+ * jobs shed by the CoDel policy
+ * @param void* param struct of parameters of the client (freed)
+ * @return int FALSE
+ */
+int shed_client(void * param) {
+    params * p = (params * ) param;
+    shed_client_sd(p -> sd, & p -> cli);
+    free(p);
+    return FALSE;
+}
+
+/**
+ * check the host of a request: recent failures, name resolution and the filter
+ * @param char* pass the host name, may end with :port
+ * @param int filter a flag that indicate if filter is exist
+ * @param linkList* hosts list of all host name
+ * @param linkList* hosts list of all ip
+ * @param int sd the socket of the client
+ * @return int TRUE if the host may be used, FALSE else (the client got the error)
+ */
+int check_host(char * pass, int filter, LinkList * hosts, LinkList * ips, int sd) {
+    ///the port (if any) is not part of the name to resolve and filter
+    char * port = strchr(pass, ':');
+    if (port != NULL) {
+        * port = '\0';
+    }
+    ///a host that failed recently fails again without a lookup or a filter walk
+    int failed = neg_cache_get(NEG_HOST, pass);
+    if (failed != 0) {
+        alog_cache(ALOG_NEGATIVE);
+        send_error_msg(sd, failed);
+        return FALSE;
+    }
+    struct in_addr addr;
+    if (lookup_host(pass, & addr) == FALSE) {
+        neg_cache_put(NEG_HOST, pass, Not_Found);
+        send_error_msg(sd, Not_Found);
+        return FALSE;
+    }
+    if (filter == TRUE) {
+        if (search_in_filter(pass, hosts, ips) == FALSE) {
+            neg_cache_put(NEG_HOST, pass, Forbidden);
+            send_error_msg(sd, Forbidden);
+            return FALSE;
+        }
+    }
+    if (port != NULL) {
+        * port = ':';
+    }
+    return TRUE;
 }
 
 /**
  * parsing the header for check errors
- * @param char* buf the request
+ * @param arena* a the arena of the request
+ * @param char* buf the request, replaced by the request to send to the origin
  * @param ssize_t is_read the size of the buffer
  * @param int filter a flag that indicate if filter is exist
  * @param linkList* hosts list of all host name
  * @param linkList* hosts list of all ip
- * @return full path of the file if all checks where good, NULL else
+ * @return host/path of the requested object (the cache key) if all checks where good, NULL else
  * */
-char * parse_header(char ** buf, ssize_t is_read, int filter, LinkList * hosts, LinkList * ips, int sd) {
-    char * temp = calloc(is_read + 1, sizeof(char));
+char * parse_header(arena * a, char ** buf, ssize_t is_read, int filter, LinkList * hosts, LinkList * ips, int sd) {
+    char * temp = arena_alloc(a, is_read + 1);
 
     if (temp == NULL) {
         send_error_msg(sd, Server_Error);
         return NULL;
     }
-    memset(temp, '\0', is_read + 1);
-    strcpy(temp, * buf);
-    char * first_line = strtok(temp, "\r\n");
-    char * host_name = strtok(NULL, "\r\n\r\n");
-    char * method = strtok(first_line, " ");
-    char * path = strtok(NULL, " ");
-    char * protocol = strtok(NULL, " \r\n");
-    host_name = strcasestr(host_name, "Host:");
+    memcpy(temp, * buf, is_read);
+    temp[is_read] = '\0';
+    char * save, * save_line;
+    char * first_line = strtok_r(temp, "\r\n", & save);
+    char * host_name = strtok_r(NULL, "\r\n\r\n", & save);
+    char * method = strtok_r(first_line, " ", & save_line);
+    char * path = strtok_r(NULL, " ", & save_line);
+    char * protocol = strtok_r(NULL, " \r\n", & save_line);
+    host_name = host_name != NULL ? strcasestr(host_name, "Host:") : NULL;
     if ((method == NULL) || (path == NULL) || (protocol == NULL) || (host_name == NULL)) {
-        free(temp);
         send_error_msg(sd, Bad_Request);
         return NULL;
     }
     protocol = strcasestr(protocol, "HTTP/");
     if (protocol == NULL) {
-        free(temp);
         send_error_msg(sd, Bad_Request);
         return NULL;
     }
     protocol = strstr(protocol, "/");
     if ((strcmp(protocol, "/1.0") != 0) && (strcmp(protocol, "/1.1") != 0)) {
-        free(temp);
         send_error_msg(sd, Bad_Request);
         return NULL;
     }
     if (strcmp(method, "GET") != 0) {
-        free(temp);
         send_error_msg(sd, Not_Supported);
         return NULL;
     }
     char * pass = strchr(host_name, ' ');
     if (pass != NULL) {
-        pass = strtok(host_name, " ");
-        pass = strtok(NULL, "\r\n");
+        pass = strtok_r(host_name, " ", & save);
+        pass = strtok_r(NULL, "\r\n", & save);
     } else {
-        pass = strtok(host_name, ":");
-        pass = strtok(NULL, "\r\n");
+        pass = strtok_r(host_name, ":", & save);
+        pass = strtok_r(NULL, "\r\n", & save);
     }
-    struct hostent * hp;
-    if (!isdigit(pass[0])) {
-        hp = gethostbyname(pass);
-        if (hp == NULL) {
-            free(temp);
-            send_error_msg(sd, Not_Found);
-            return NULL;
-        }
-    } else {
-        struct in_addr a;
-        inet_aton(pass, & a);
-        hp = gethostbyaddr( & a, sizeof(a), AF_INET);
-        if (hp == NULL) {
-            free(temp);
-            send_error_msg(sd, Not_Found);
-            return NULL;
-        }
+    if (pass == NULL) {
+        send_error_msg(sd, Bad_Request);
+        return NULL;
     }
-    if (filter == TRUE) {
-        if (search_in_filter(pass, hosts, ips) == FALSE) {
-            free(temp);
-            send_error_msg(sd, Forbidden);
-            return NULL;
-        }
+    alog_request(pass, path);
+    if (check_host(pass, filter, hosts, ips, sd) == FALSE) {
+        return NULL;
     }
     char is_index[15];
     memset(is_index, '\0', 15);
     if (strcmp(path, "/") == 0 || path[strlen(path)-1] == '/') {
         sprintf(is_index, "%s", "index.html");
     }
-    char * full_path = calloc(strlen(path) + strlen(pass) + strlen(is_index) + 1, sizeof(char));
+    char * full_path = arena_alloc(a, strlen(path) + strlen(pass) + strlen(is_index) + 1);
     if (full_path == NULL) {
         send_error_msg(sd, Server_Error);
-        free(temp);
         return NULL;
     }
     sprintf(full_path, "%s%s%s", pass, path, is_index);
 
     char * new_req = "GET  HTTP\r\nHost: \r\nConnection: close\r\n\r\n";
-    * buf = realloc(( * buf), strlen(new_req) + strlen(path) + strlen(protocol) + strlen(pass) + 1);
+    * buf = arena_alloc(a, strlen(new_req) + strlen(path) + strlen(protocol) + strlen(pass) + 1);
+    if ( * buf == NULL) {
+        send_error_msg(sd, Server_Error);
+        return NULL;
+    }
     sprintf( * buf, "GET %s HTTP%s\r\nHost: %s\r\nConnection: close\r\n\r\n", path, protocol, pass);
-
-    free(temp);
     return full_path;
 }
 
@@ -533,470 +827,2680 @@ char * get_mime_type(char * name) {
 }
 
 /**
- * bring file from local system and sent to the client
- * @param char* full_path the path of the file
- * @param int sd the socket of the client
+ * find a header of a request or a response
+ * @param arena* a the arena of the request
+ * @param char* msg the message, its header ends at the first empty line
+ * @param char* name the header name (case insensitive)
+ * @return char* a copy of the value without surrounding spaces, NULL if missing
  */
-void file_from_local_sys(char * full_path, int sd) {
-    FILE * fp = fopen(full_path, "r");
-    if (fp == NULL) {
-        send_error_msg(sd, Server_Error);
-        return;
-    }
-    struct stat st = {
-            0
-    };
-    stat(full_path, & st);
-    char size[20] = {
-            0
-    };
-    sprintf(size, "%d", (int) st.st_size);
-    char * path = strchr(full_path, '/');
-    char * ext = get_mime_type(path);
-    int ext_size;
-    char temp[100];
-    memset(temp, '\0', 100);
-    if (ext != NULL) {
-        strcpy(temp, "HTTP/1.0 200 OK\r\nContent-Length: \r\nContent-type: \r\nconnection: Close\r\n\r\n");
-        ext_size = (int) strlen(ext);
-    } else {
-        strcpy(temp, "HTTP/1.0 200 OK\r\nContent-Length: \r\nConnection: Close\r\n\r\n");
-        ext_size = 0;
+char * header_value(arena * a, const char * msg, const char * name) {
+    size_t nlen = strlen(name);
+    const char * end = strstr(msg, "\r\n\r\n");
+    if (end == NULL) {
+        end = msg + strlen(msg);
+    }
+    ///the first line is the request or status line
+    const char * line = strstr(msg, "\r\n");
+    while (line != NULL && line < end) {
+        line += 2;
+        if (strncasecmp(line, name, nlen) == 0 && line[nlen] == ':') {
+            const char * v = line + nlen + 1;
+            while ( * v == ' ' || * v == '\t') {
+                v++;
+            }
+            const char * e = strstr(v, "\r\n");
+            if (e == NULL || e > end) {
+                e = end;
+            }
+            while (e > v && (e[-1] == ' ' || e[-1] == '\t')) {
+                e--;
+            }
+            char * out = arena_alloc(a, (size_t)(e - v) + 1);
+            if (out != NULL) {
+                memcpy(out, v, (size_t)(e - v));
+                out[e - v] = '\0';
+            }
+            return out;
+        }
+        line = strstr(line, "\r\n");
     }
+    return NULL;
+}
 
-    char * response = malloc((int) strlen(temp) + ext_size + (int) strlen(size) + 1);
-    if (response == NULL) {
-        send_error_msg(sd, Server_Error);
-        return;
-    }
-    memset(response, '\0', (int) strlen(temp) + ext_size + (int) strlen(size) + 1);
-    strcat(response, "HTTP/1.0 200 OK\r\nContent-Length: ");
-    strcat(response, size);
-    strcat(response, "\r\n");
-    if (ext_size != 0) {
-        strcat(response, "Content-type: ");
-        strcat(response, ext);
-        strcat(response, "\r\n");
-    }
-
-    strcat(response, "Connection: close\r\n\r\n");
-
-    write(sd, response, (int) strlen(response));
-    int total = (int) strlen(response);
-    free(response);
-    unsigned char buf[LEN];
-    int n, read = 0;
-    while (read != (int) st.st_size) {
-        memset(buf, '\0', LEN);
-        n = (int) fread(buf, sizeof(unsigned char), LEN, fp);
-        if (ferror(fp)) {
-            send_error_msg(sd, Server_Error);
-            return;
+/**
+ * parse the value of a Range header against the size of the object
+ * @param char* value the header value, e.g. "bytes=0-99,200-,-50"
+ * @param off_t size the size of the object
+ * @param byte_range* r filled with the satisfiable ranges, in request order
+ * @param int max the room in r
+ * @return int the number of satisfiable ranges, 0 if none is (416),
+ *         -1 if the header is ignored (bad syntax or more than max ranges)
+ */
+int parse_range(const char * value, off_t size, byte_range * r, int max) {
+    if (strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
+    const char * p = value + 6;
+    int n = 0;
+    while (1) {
+        while ( * p == ' ' || * p == '\t') {
+            p++;
         }
-        read += n;
-        if (write(sd, buf, n) < 0) {
-            send_error_msg(sd, Server_Error);
-            return;
+        long long first = -1, last = -1;
+        char * e;
+        if (isdigit((unsigned char) * p)) {
+            first = strtoll(p, & e, 10);
+            p = e;
+        }
+        if ( * p != '-') {
+            return -1;
+        }
+        p++;
+        if (isdigit((unsigned char) * p)) {
+            last = strtoll(p, & e, 10);
+            p = e;
         }
+        if (first < 0 && last < 0) {
+            return -1;
+        }
+        if (first >= 0 && last >= 0 && last < first) {
+            return -1;
+        }
+        ///a suffix range is the last bytes, a range starting past the end is skipped
+        if (first < 0) {
+            if (last > 0 && size > 0) {
+                if (n == max) {
+                    return -1;
+                }
+                r[n].first = last < size ? size - last : 0;
+                r[n].last = size - 1;
+                n++;
+            }
+        } else if (first < size) {
+            if (n == max) {
+                return -1;
+            }
+            r[n].first = first;
+            r[n].last = last < 0 || last >= size ? size - 1 : last;
+            n++;
+        }
+        while ( * p == ' ' || * p == '\t') {
+            p++;
+        }
+        if ( * p == '\0') {
+            return n;
+        }
+        if ( * p != ',') {
+            return -1;
+        }
+        p++;
     }
+}
 
-    total += (int) strlen(size);
-    total += read;
-    printf("File is given from local filesystem\n");
-    printf("\n Total response bytes: %d\n", total);
-    fclose(fp);
+/**
+ * the waits of a request on a socket, each one has its own timeout
+ */
+enum req_wait {
+    WAIT_HEADER,        //the request header of the client
+    WAIT_CONNECT,       //the connect to the origin
+    WAIT_FIRST_BYTE,    //the response header of the origin or the peer
+    WAIT_IDLE,          //a transfer that stopped moving
+    WAIT_TUNNEL,        //a CONNECT tunnel without traffic
+    WAIT_KEEPALIVE,     //the next request of a peer on a kept connection
+    WAIT_KINDS
+};
+
+static int wait_ms[WAIT_KINDS] = {  //0 = no timeout
+        10000, 5000, 30000, 60000, 60000, PEER_KEEPALIVE_MS
+};
+
+/**
+ * counters of the server, shared by the worker processes with --workers
+ */
+typedef struct server_stats {
+    int accepted;                   //connections accepted by all acceptors
+    long expired[WAIT_KINDS];       //timeouts that fired, per wait
+    long crashes;                   //workers that died and were forked again
 }
+        server_stats;
+
+static server_stats local_stats;
+static server_stats * stats = & local_stats;    //shm_calloc'ed with --workers
+static __thread tw_timer * req_timer = NULL;    //the timeout of the request running on this thread
+static __thread int req_wait_kind = WAIT_IDLE;  //what req_timer bounds now
+static __thread long long origin_body = -1;     //body bytes of the last origin response of this thread
+static threadpool * prefetch_pool = NULL;       //NULL without --prefetch
+static volatile int prefetch_stop = 0;          //1 once the queued prefetches are dropped
+
 /**
- * create directories path to the requested file
- * @param char* full_path the path of the file (include the file name)
- * @param int sd socket of the client
- * @return int TRUE in success, FALSE else
+ * bound the next wait of the request running on this thread: if it lasts longer
+ * the sockets are shut down, which ends the blocking call of the wait. the wait
+ * before is counted if it expired
+ * @param int kind enum req_wait
+ * @param int fd the socket waited on, -1 (and fd2 -1) disarms the timeout
+ * @param int fd2 a second socket shut down with it (the other side of a relay), -1 for none
  */
-int creat_directories(char * full_path, int sd) {
-    char * path = (char * ) malloc(strlen(full_path) + 1);
-    if (path == NULL) {
-        send_error_msg(sd, Server_Error);
-        return FALSE;
+static void req_wait(int kind, int fd, int fd2) {
+    if (req_timer == NULL) {
+        return;
     }
-    strcpy(path, full_path);
-    int counter = 0, i, size = 0;
-    for (i = 0; i < (int)strlen(path) - 1; i++) {
-        if (path[i] == '/') {
-            counter++;
-        }
+    if (tw_fired(req_timer)) {
+        __atomic_add_fetch( & stats -> expired[req_wait_kind], 1, __ATOMIC_RELAXED);
     }
+    req_wait_kind = kind;
+    tw_arm(req_timer, fd, fd2, fd >= 0 || fd2 >= 0 ? wait_ms[kind] : 0);
+}
+
+/**
+ * give the requests of this thread a timeout
+ * @param tw_timer* t the timer, lives until req_timer_detach
+ */
+static void req_timer_attach(tw_timer * t) {
+    tw_clear(t);
+    req_timer = t;
+}
+
+/**
+ * disarm the timeout of this thread, the timer may go away
+ */
+static void req_timer_detach(void) {
+    req_wait(WAIT_IDLE, -1, -1);
+    req_timer = NULL;
+}
 
-    i = 0;
-    for (; size < (int)strlen(path) - 1; size++) {
-        if (path[size] == '/') {
-            i++;
+/**
+ * close the socket of the client, its timeout first: a timer never shuts down a reused descriptor
+ * @param int sd the socket
+ */
+static void close_client(int sd) {
+    req_wait(WAIT_IDLE, -1, -1);
+    close(sd);
+}
+
+/**
+ * close the socket of the origin or the peer, the timeout goes back to the client
+ * @param int csd the socket
+ * @param int sd the socket of the client, -1 if there is none
+ */
+static void close_upstream(int csd, int sd) {
+    req_wait(WAIT_IDLE, sd, -1);
+    close(csd);
+}
+
+/**
+ * write a whole buffer to a socket or a file
+ * @param int fd where to write
+ * @param char* buf the data
+ * @param size_t n the size of the data
+ * @return int TRUE if everything was written, FALSE else
+ */
+int write_all(int fd, const char * buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
         }
-        if (i == counter) {
-            break;
+        if (w <= 0) {
+            return FALSE;
         }
+        tw_touch(req_timer);
+        buf += w;
+        n -= (size_t) w;
     }
-    char * directories = (char * ) calloc(size + 1, sizeof(char));
-    if (directories == NULL) {
-        send_error_msg(sd, Server_Error);
-        return FALSE;
+    return TRUE;
+}
+
+/**
+ * answer a range request no range of can be satisfied
+ * @param int sd the socket of the client
+ * @param off_t size the size of the object
+ */
+void send_unsatisfiable(int sd, off_t size) {
+    char msg[160];
+    int len = snprintf(msg, sizeof(msg),
+                       "HTTP/1.0 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                       (long long) size);
+    alog_status(Range_Not_Satisfiable);
+    alog_bytes(write(sd, msg, (size_t) len));
+}
+
+/**
+ * write a part of a file to a socket without copying it to user space
+ * @param int sd the socket
+ * @param int fd the file
+ * @param off_t off where the part starts
+ * @param off_t len the size of the part
+ * @return off_t the bytes written, -1 on error
+ */
+off_t send_file_part(int sd, int fd, off_t off, off_t len) {
+    off_t sent = 0;
+    while (sent < len) {
+        ssize_t n = sendfile(sd, fd, & off, (size_t)(len - sent));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        tw_touch(req_timer);
+        sent += n;
     }
+    return sent;
+}
+
+/**
+ * bring file from local system and sent to the client. a Range request
+ * is answered 206 with the requested part, several ranges as
+ * multipart/byteranges, the parts are sent from the file with sendfile
+ * @param arena* a the arena of the request
+ * @param char* full_path host/path of the object
+ * @param char* file the cache file of the object
+ * @param int fd the cache file, open, closed here
+ * @param int sd the socket of the client
+ * @param char* range the Range header of the request, NULL if none
+ * @param int gzip 1 if the client accepts gzip: the gzip variant is sent if there is one
+ * @param int keep 1 to offer to keep the connection (a peer request)
+ * @return int TRUE if the whole response was sent with its length, FALSE else
+ */
+int file_from_local_sys(arena * a, char * full_path, char * file, int fd, int sd, char * range, int gzip, int keep) {
     struct stat st = {
             0
     };
-    char * token = strtok(path, "/");
-    for (i = 0; i < counter; i++) {
-        strcat(directories, token);
-        if (stat(directories, & st) == -1) {
-            if (mkdir(directories, 0700) == -1) {
+    fstat(fd, & st);
+    char * path = strchr(full_path, '/');
+    char * ext = path != NULL ? get_mime_type(path) : NULL;
+    ///ranges are served from the identity file
+    char * vary = "", * encoding = "";
+    if (gzip_enabled() && gzip_compressible(ext)) {
+        vary = "Vary: Accept-Encoding\r\n";
+        char * gz = gzip && range == NULL ? arena_sprintf(a, "%s.gz", file) : NULL;
+        int gfd = gz != NULL ? open(gz, O_RDONLY) : -1;
+        if (gfd >= 0) {
+            close(fd);
+            fd = gfd;
+            fstat(fd, & st);
+            encoding = "Content-Encoding: gzip\r\n";
+        }
+    }
+    byte_range * r = NULL;
+    int nr = -1;
+    if (range != NULL) {
+        r = (byte_range * ) arena_alloc(a, MAX_RANGES * sizeof(byte_range));
+        nr = r != NULL ? parse_range(range, st.st_size, r, MAX_RANGES) : -1;
+    }
+    alog_cache(ALOG_HIT);
+    if (nr == 0) {
+        send_unsatisfiable(sd, st.st_size);
+        alog_mark(ALOG_FIRST);
+        trace_event(TR_LOCAL_HEADER);
+        close(fd);
+        return FALSE;
+    }
+    ///a multipart body is the parts, each with its own header, and a closing boundary
+    char ** part = NULL;
+    long long length = st.st_size;
+    if (nr > 1) {
+        part = (char ** ) arena_alloc(a, (size_t) nr * sizeof(char * ));
+        if (part == NULL) {
+            send_error_msg(sd, Server_Error);
+            close(fd);
+            return FALSE;
+        }
+        length = (long long) strlen("\r\n--" RANGE_BOUNDARY "--\r\n");
+        for (int i = 0; i < nr; i++) {
+            part[i] = arena_sprintf(a, "%s--" RANGE_BOUNDARY "\r\n%s%s%sContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                                    i == 0 ? "" : "\r\n", ext != NULL ? "Content-Type: " : "",
+                                    ext != NULL ? ext : "", ext != NULL ? "\r\n" : "", (long long) r[i].first,
+                                    (long long) r[i].last, (long long) st.st_size);
+            if (part[i] == NULL) {
                 send_error_msg(sd, Server_Error);
+                close(fd);
                 return FALSE;
             }
+            length += (long long) strlen(part[i]) + r[i].last - r[i].first + 1;
+        }
+    } else if (nr == 1) {
+        length = r[0].last - r[0].first + 1;
+    }
+
+    char * response, * conn = keep ? "keep-alive" : "close";
+    if (nr > 1) {
+        response = arena_sprintf(a,
+                                 "HTTP/1.0 206 Partial Content\r\nContent-Length: %lld\r\nContent-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\n%sConnection: %s\r\n\r\n",
+                                 length, vary, conn);
+    } else if (nr == 1) {
+        response = arena_sprintf(a,
+                                 "HTTP/1.0 206 Partial Content\r\nContent-Length: %lld\r\nContent-Range: bytes %lld-%lld/%lld\r\n%s%s%s%sConnection: %s\r\n\r\n",
+                                 length, (long long) r[0].first, (long long) r[0].last, (long long) st.st_size,
+                                 ext != NULL ? "Content-type: " : "", ext != NULL ? ext : "", ext != NULL ? "\r\n" : "", vary,
+                                 conn);
+    } else {
+        response = arena_sprintf(a, "HTTP/1.0 200 OK\r\nContent-Length: %lld\r\n%s%s%s%s%sConnection: %s\r\n\r\n", length,
+                                 ext != NULL ? "Content-type: " : "", ext != NULL ? ext : "", ext != NULL ? "\r\n" : "",
+                                 encoding, vary, conn);
+    }
+    if (response == NULL) {
+        send_error_msg(sd, Server_Error);
+        close(fd);
+        return FALSE;
+    }
+
+    alog_status(nr > 0 ? 206 : 200);
+    int complete = write_all(sd, response, strlen(response));
+    alog_bytes(complete == TRUE ? (ssize_t) strlen(response) : -1);
+    alog_mark(ALOG_FIRST);
+    trace_event(TR_LOCAL_HEADER);
+    off_t sent;
+    if (complete == TRUE && nr > 1) {
+        for (int i = 0; i < nr && complete == TRUE; i++) {
+            ///a part header cut short would shift the body against Content-Length
+            if (write_all(sd, part[i], strlen(part[i])) == FALSE) {
+                complete = FALSE;
+                break;
+            }
+            alog_bytes((ssize_t) strlen(part[i]));
+            if ((sent = send_file_part(sd, fd, r[i].first, r[i].last - r[i].first + 1)) < 0) {
+                complete = FALSE;
+                break;
+            }
+            alog_bytes(sent);
+        }
+        if (complete == TRUE) {
+            complete = write_all(sd, "\r\n--" RANGE_BOUNDARY "--\r\n", strlen("\r\n--" RANGE_BOUNDARY "--\r\n"));
+            alog_bytes(complete == TRUE ? (ssize_t) strlen("\r\n--" RANGE_BOUNDARY "--\r\n") : -1);
         }
-        if (i + 1 != counter) {
-            strcat(directories, "/");
+    } else if (complete == TRUE) {
+        off_t first = nr == 1 ? r[0].first : 0;
+        if ((sent = send_file_part(sd, fd, first, length)) > 0) {
+            alog_bytes(sent);
         }
-        token = strtok(NULL, "/");
+        complete = sent == length ? TRUE : FALSE;
     }
-    free(path);
-    free(directories);
-    return TRUE;
+    trace_event(TR_LOCAL_DONE);
+    close(fd);
+    return complete;
 }
-
 /**
  * open a connection to the server with socket
- * @param char* name of the host
+ * @param char* name of the host, may end with :port (80 by default)
  * @param int sd socket of the client
  * @return int csd in success, FALSE else
  */
 int open_connection(char * name, int sd) {
-    int csd;
+    int csd, port = 80;
     struct sockaddr_in srv;
-    struct hostent * hp;
+    ///an origin that refused a connection recently is not tried again
+    int failed = neg_cache_get(NEG_ORIGIN, name);
+    if (failed != 0) {
+        alog_cache(ALOG_NEGATIVE);
+        send_error_msg(sd, failed);
+        return FALSE;
+    }
+    char * colon = strchr(name, ':');
+    if (colon != NULL) {
+        * colon = '\0';
+        port = (int) strtol(colon + 1, NULL, 10);
+    }
     srv.sin_family = AF_INET;
-    if (!isdigit(name[0])) {
-        hp = gethostbyname(name);
-        if (hp == NULL) {
-            send_error_msg(sd, Not_Found);
-            return FALSE;
-        }
-    } else {
-        struct in_addr a;
-        inet_aton(name, & a);
-        hp = gethostbyaddr( & a, sizeof(a), AF_INET);
-        if (hp == NULL) {
-            send_error_msg(sd, Not_Found);
-            return FALSE;
-        }
+    int found = lookup_host(name, & srv.sin_addr);
+    if (colon != NULL) {
+        * colon = ':';
+    }
+    if (found == FALSE) {
+        send_error_msg(sd, Not_Found);
+        return FALSE;
     }
-    srv.sin_addr.s_addr = ((struct in_addr * )(hp -> h_addr)) -> s_addr;
-    srv.sin_port = htons(80);
+    srv.sin_port = htons(port);
 
     if ((csd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
         send_error_msg(sd, Server_Error);
         return FALSE;
 
     }
+    sock_apply(SOCK_ORIGIN, csd);
+    req_wait(WAIT_CONNECT, csd, -1);
     if (connect(csd, (struct sockaddr * ) & srv, sizeof(srv)) < 0) {
-        send_error_msg(sd, Server_Error);
+        ///an origin that does not accept in time is as dead as one that refuses
+        int err = tw_fired(req_timer) ? Gateway_Timeout : Server_Error;
+        close_upstream(csd, sd);
+        neg_cache_put(NEG_ORIGIN, name, err);
+        send_error_msg(sd, err);
         return FALSE;
     }
+    req_wait(WAIT_IDLE, csd, sd);
     return csd;
 }
 
+static long fresh_ttl = 300;    //lifetime of a response without freshness information
+static long fresh_swr = 0;      //stale-while-revalidate window of a response without one
+
+/**
+ * parse an HTTP date (IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT")
+ * @param char* value the date, NULL if the header is missing
+ * @return time_t the date, -1 if missing or malformed
+ */
+time_t http_date(const char * value) {
+    struct tm tm;
+    memset( & tm, 0, sizeof(tm));
+    if (value == NULL || strptime(value, "%a, %d %b %Y %H:%M:%S GMT", & tm) == NULL) {
+        return -1;
+    }
+    return timegm( & tm);
+}
+
+/**
+ * the value of a Cache-Control directive with a number
+ * @param char* cc the Cache-Control header, NULL if none
+ * @param char* name the directive including '=', e.g. "max-age="
+ * @return long the number of seconds, -1 if the directive is missing
+ */
+long cc_seconds(const char * cc, const char * name) {
+    const char * d = cc != NULL ? strcasestr(cc, name) : NULL;
+    return d != NULL ? strtol(d + strlen(name), NULL, 10) : -1;
+}
+
+/**
+ * compute the freshness of an origin response from its header:
+ * s-maxage, max-age, Expires - Date, 10% of the time since Last-Modified
+ * (at most a day) or --fresh-ttl, in this order
+ * @param arena* a the arena of the request
+ * @param char* header the response header
+ * @param cache_meta* old the cached copy a 304 refreshes (validators the 304 omits), NULL else
+ * @param cache_meta* m the result
+ * @return int TRUE if the response may be stored, FALSE for no-store and private
+ */
+int compute_freshness(arena * a, const char * header, const cache_meta * old, cache_meta * m) {
+    time_t now = time(NULL);
+    memset(m, 0, sizeof(cache_meta));
+    m -> magic = CACHE_META_MAGIC;
+    char * cc = header_value(a, header, "Cache-Control");
+    char * etag = header_value(a, header, "ETag");
+    char * lm = header_value(a, header, "Last-Modified");
+    if (etag == NULL && old != NULL && old -> etag[0] != '\0') {
+        etag = (char * ) old -> etag;
+    }
+    if (lm == NULL && old != NULL && old -> last_modified[0] != '\0') {
+        lm = (char * ) old -> last_modified;
+    }
+    if (etag != NULL && strlen(etag) < sizeof(m -> etag)) {
+        strcpy(m -> etag, etag);
+    }
+    if (lm != NULL && strlen(lm) < sizeof(m -> last_modified)) {
+        strcpy(m -> last_modified, lm);
+    }
+    ///the age the response already had when it arrived
+    char * age = header_value(a, header, "Age");
+    long aged = age != NULL ? strtol(age, NULL, 10) : 0;
+    m -> stored = (int64_t) now - (aged > 0 ? aged : 0);
+    m -> expires = m -> stored;
+    if (cc != NULL && (strcasestr(cc, "no-store") != NULL || strcasestr(cc, "private") != NULL)) {
+        return FALSE;
+    }
+    time_t date = http_date(header_value(a, header, "Date"));
+    if (date < 0) {
+        date = now;
+    }
+    long lifetime = cc_seconds(cc, "s-maxage=");
+    if (lifetime < 0) {
+        lifetime = cc_seconds(cc, "max-age=");
+    }
+    char * expires = lifetime < 0 ? header_value(a, header, "Expires") : NULL;
+    if (expires != NULL) {
+        time_t e = http_date(expires);
+        lifetime = e > date ? (long)(e - date) : 0;
+    }
+    if (lifetime < 0) {
+        time_t modified = http_date(m -> last_modified[0] != '\0' ? m -> last_modified : NULL);
+        lifetime = modified >= 0 && modified <= date ? (long)((date - modified) / 10) : fresh_ttl;
+        lifetime = lifetime < 86400 ? lifetime : 86400;
+    }
+    int revalidate = cc != NULL && (strcasestr(cc, "no-cache") != NULL || strcasestr(cc, "must-revalidate") != NULL);
+    if (cc != NULL && strcasestr(cc, "no-cache") != NULL) {
+        lifetime = 0;
+    }
+    m -> expires = m -> stored + lifetime;
+    long swr = cc_seconds(cc, "stale-while-revalidate=");
+    m -> swr = revalidate ? 0 : (uint32_t)(swr >= 0 ? swr : fresh_swr);
+    return TRUE;
+}
+
+/**
+ * an object written behind, admitted to the cache once it is on disk
+ */
+typedef struct admit_ctx {
+    cache_meta meta;
+    uint64_t key;
+    off_t size;
+    char * gz;          //its gzip variant, NULL if it gets none
+    char * file;
+    char tmp[];         //the temporary file, then the names above
+} admit_ctx;
+
+/**
+ * commit of a written object, on the disk I/O thread (or the request thread
+ * with --disk-threads=0): rename it over the cached copy and compress it
+ * @param void* arg the admit_ctx, freed here
+ * @param int ok 1 if the whole body was written
+ */
+static void admit(void * arg, int ok) {
+    admit_ctx * c = (admit_ctx * ) arg;
+    if (!ok) { ///a truncated or dropped body is never served from the cache
+        unlink(c -> tmp);
+        free(c);
+        return;
+    }
+    ///the variant of the old object must not outlive it
+    if (c -> gz != NULL) {
+        unlink(c -> gz);
+    }
+    int stored = cache_maybe(c -> key) && access(c -> file, F_OK) == 0;
+    ///the old metadata goes first and the new one comes after the body: in between (or after
+    ///a crash) a copy without metadata is fetched again, never served with another's freshness
+    if (stored) {
+        char meta[CACHE_PATH_LEN + 8];
+        snprintf(meta, sizeof(meta), "%s.meta", c -> file);
+        unlink(meta);
+    }
+    int admitted = rename(c -> tmp, c -> file) == 0;
+    if (admitted) {
+        cache_meta_write(c -> file, & c -> meta);
+    }
+    if (admitted && !stored) {
+        cache_add(c -> key);
+    }
+    if (admitted && c -> gz != NULL) {
+        gzip_store(c -> file, c -> gz, c -> size);
+    } else if (!admitted) {
+        unlink(c -> tmp);
+    }
+    free(c);
+}
+
+/**
+ * start saving an object: open its temporary file and hand it to the disk stage
+ * @param arena* a the arena of the request
+ * @param char* full_path host/path of the object
+ * @param char* file its cache file
+ * @param cache_meta* meta its freshness
+ * @return admit_ctx* the commit context (the diskq_file in * out), NULL if it is not saved
+ */
+static admit_ctx * admit_open(arena * a, char * full_path, char * file, cache_meta * meta, diskq_file ** out) {
+    static unsigned long parts = 0;
+    ///the body of an earlier miss of the object may still be queued for its own temporary file,
+    ///the other workers (--workers) write into the same directories
+    char * tmp = arena_sprintf(a, "%s.part%d.%lx", file, (int) getpid(),
+                               __atomic_add_fetch( & parts, 1, __ATOMIC_RELAXED));
+    if (tmp == NULL) {
+        return NULL;
+    }
+    char * ext = get_mime_type(strchr(full_path, '/'));
+    int gz = gzip_enabled() && gzip_compressible(ext);
+    size_t tlen = strlen(tmp) + 1, flen = strlen(file) + 1;
+    admit_ctx * c = (admit_ctx * ) malloc(sizeof(admit_ctx) + tlen + flen + (gz ? flen + 3 : 0));
+    if (c == NULL) {
+        return NULL;
+    }
+    memcpy(c -> tmp, tmp, tlen);
+    c -> file = c -> tmp + tlen;
+    memcpy(c -> file, file, flen);
+    c -> gz = gz ? c -> file + flen : NULL;
+    if (gz) {
+        snprintf(c -> gz, flen + 3, "%s.gz", file);
+    }
+    c -> meta = * meta;
+    c -> key = cache_key(full_path);
+    c -> size = 0;
+    ///the directories exist since startup: one open, no walk
+    int fd = open(tmp, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0 || (* out = diskq_open(fd, admit, c)) == NULL) {
+        if (fd >= 0) {
+            unlink(tmp);
+        }
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/**
+ * the references of a page relayed to a client, queued as the tokenizer finds them
+ */
+typedef struct page_refs {
+    prefetch_scanner scan;
+    const char * page;                      //host/path of the page
+    int nseen;                              //the page itself, then the references queued
+    uint64_t seen[PREFETCH_MAX_REFS + 1];
+}
+        page_refs;
+
+int handle_prefetch(void * param);
+
+/**
+ * called by the tokenizer of a page: queue a prefetch of a reference of the same
+ * origin unless it is cached already or was seen on the page before
+ * @param void* arg the page_refs of the page
+ * @param char* ref the reference
+ */
+static void queue_ref(void * arg, const char * ref) {
+    page_refs * refs = (page_refs * ) arg;
+    char url[PREFETCH_URL_LEN + sizeof("index.html")];
+    if (refs -> nseen > PREFETCH_MAX_REFS || prefetch_resolve(refs -> page, ref, url, PREFETCH_URL_LEN) != 0) {
+        return;
+    }
+    ///the cache key of a directory is the one of its index, as in parse_header
+    size_t len = strlen(url);
+    if (url[len - 1] == '/') {
+        strcpy(url + len, "index.html");
+    }
+    uint64_t key = cache_key(url);
+    for (int i = 0; i < refs -> nseen; i++) {
+        if (refs -> seen[i] == key) {
+            return;
+        }
+    }
+    refs -> seen[refs -> nseen++] = key;
+    if (cache_maybe(key)) {
+        prefetch_note(PREFETCH_SKIPPED);
+        return;
+    }
+    url[len] = '\0';
+    prefetch_req * r = prefetch_new(url);
+    if (r == NULL) {
+        return;
+    }
+    if (dispatch(prefetch_pool, handle_prefetch, r) != 0) {
+        free(r);
+        prefetch_note(PREFETCH_SHED);
+        return;
+    }
+    prefetch_note(PREFETCH_QUEUED);
+}
+
+/**
+ * send http request to established socket, read the response, send to client and create file on the local system.
+ * only the body of a complete 2xx response is saved, into a temporary file renamed over file at the end.
+ * with a single range and a known Content-Length the client gets a 206 of the range while the whole object
+ * is saved, otherwise the response is relayed as is. sd is -1 for a background refresh
+ * @param arena* a the arena of the request
+ * @param char* request the request from the client
+ * @param char* full_path host/path of the object
+ * @param char* file the cache file of the object
+ * @param sd the socket of the client
+ * @param char* range the Range header of the request, NULL if none
+ * @param cache_meta* old the metadata of the stale cached copy, NULL for a miss. the request
+ *        is made conditional on its validators, a 304 refreshes it and nothing is sent to the client
+ * @return int Not_Modified if the cached copy is to be served, TRUE if the client got the
+ *         origin response, FALSE on error (the client got an error)
+ */
+int get_file_from_server(arena * a, char * request, char * full_path, char * file, int sd, char * range,
+                         cache_meta * old) {
+    //crate http request
+    char * path = arena_strdup(a, full_path);
+    if (path == NULL) {
+        send_error_msg(sd, Server_Error);
+        return FALSE;
+    }
+    char * save;
+    char * name = strtok_r(path, "/", & save);
+    ///open_connection answers the client when it fails
+    int csd = open_connection(name, sd);
+    if (csd == FALSE) {
+        return FALSE;
+    }
+    trace_event(TR_ORIGIN_CONNECT);
+    ///revalidation: the request ends with the validators of the cached copy
+    if (old != NULL && (old -> etag[0] != '\0' || old -> last_modified[0] != '\0')) {
+        char * cond = arena_sprintf(a, "%.*s%s%s%s%s%s%s\r\n", (int) strlen(request) - 2, request,
+                                    old -> etag[0] != '\0' ? "If-None-Match: " : "", old -> etag,
+                                    old -> etag[0] != '\0' ? "\r\n" : "",
+                                    old -> last_modified[0] != '\0' ? "If-Modified-Since: " : "",
+                                    old -> last_modified, old -> last_modified[0] != '\0' ? "\r\n" : "");
+        request = cond != NULL ? cond : request;
+    }
+    //write http request to the socket
+    if (write_all(csd, request, strlen(request)) == FALSE) {
+        close_upstream(csd, sd);
+        send_error_msg(sd, Server_Error);
+        return FALSE;
+    }
+    trace_event(TR_ORIGIN_SENT);
+    req_wait(WAIT_FIRST_BYTE, csd, -1);
+
+    ///read until the end of the response header, the body reads grow the buffer
+    buf_relay rb;
+    char * buf = buf_relay_init( & rb, RELAY_LEN) == 0 ? rb.data : NULL;
+    size_t cap = RELAY_LEN - 1, got = 0;
+    char * end = NULL;
+    ssize_t n = 0;
+    while (buf != NULL && end == NULL && got < cap) {
+        if ((n = read(csd, buf + got, cap - got)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (got == 0) {
+            trace_event(TR_ORIGIN_FIRST_BYTE);
+        }
+        got += (size_t) n;
+        buf[got] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    if (buf == NULL || got == 0) {
+        ///an origin that never answers is not waited for again for a while
+        int err = tw_fired(req_timer) ? Gateway_Timeout : Server_Error;
+        if (err == Gateway_Timeout) {
+            neg_cache_put(NEG_URL, full_path, err);
+        }
+        close_upstream(csd, sd);
+        send_error_msg(sd, err);
+        buf_relay_free( & rb);
+        return FALSE;
+    }
+    req_wait(WAIT_IDLE, csd, sd);
+    alog_cache(ALOG_MISS);
+    alog_mark(ALOG_FIRST);
+    if (end == NULL) { ///no header in the first RELAY_LEN bytes, relay without saving
+        alog_bytes(write_all(sd, buf, got) == TRUE ? (ssize_t) got : -1);
+        while ((n = read(csd, rb.data, rb.cap)) > 0 && write_all(sd, rb.data, (size_t) n) == TRUE) {
+            tw_touch(req_timer);
+            alog_bytes(n);
+            buf_relay_adapt( & rb, (size_t) n);
+        }
+        trace_event(TR_ORIGIN_DONE);
+        buf_relay_free( & rb);
+        close_upstream(csd, sd);
+        return TRUE;
+    }
+    size_t header = (size_t)(end + 4 - buf);
+    char * stat = strstr(buf, "1.");
+    int status = stat != NULL ? (int) strtol(stat + 4, NULL, 10) : 0;
+    char * value = header_value(a, buf, "Content-Length");
+    long long length = value != NULL ? strtoll(value, NULL, 10) : -1;
+    value = header_value(a, buf, "Transfer-Encoding");
+    int chunked = value != NULL && strcasestr(value, "chunked") != NULL;
+
+    ///the cached copy is still valid: refresh its freshness, the caller serves it
+    cache_meta meta;
+    if (status == Not_Modified && old != NULL) {
+        if (compute_freshness(a, buf, old, & meta) == FALSE) {
+            meta.expires = meta.stored;
+        }
+        cache_meta_write(file, & meta);
+        trace_event(TR_ORIGIN_DONE);
+        buf_relay_free( & rb);
+        close_upstream(csd, sd);
+        return Not_Modified;
+    }
+    if (old != NULL && (status == Not_Found || status == Gone)) {
+        cache_remove(cache_key(full_path));
+    }
+    ///errors the server can answer by itself are answered so for a while
+    if (status == Not_Found || status == Gone || status == Server_Error || status == Bad_Gateway ||
+        status == Service_Unavailable || status == Gateway_Timeout) {
+        neg_cache_put(NEG_URL, full_path, status);
+    }
+
+    ///the file gets the body only, a chunked body is relayed without saving.
+    ///the blocks are written behind by the disk stage, if it falls behind the object is not saved
+    diskq_file * df = NULL;
+    admit_ctx * saving = NULL;
+    if (200 <= status && status < 300 && !chunked && compute_freshness(a, buf, NULL, & meta) == TRUE) {
+        saving = admit_open(a, full_path, file, & meta, & df);
+    }
+    ///a page saved for a client: the objects it references are prefetched while it is relayed
+    page_refs * refs = NULL;
+    if (prefetch_pool != NULL && sd >= 0 && saving != NULL) {
+        char * type = header_value(a, buf, "Content-Type");
+        char * ext = type == NULL ? get_mime_type(strchr(full_path, '/')) : NULL;
+        if ((type != NULL && strcasestr(type, "text/html") != NULL) || (ext != NULL && strcmp(ext, "text/html") == 0)) {
+            refs = (page_refs * ) arena_alloc(a, sizeof(page_refs));
+        }
+        if (refs != NULL) {
+            prefetch_scan_init( & refs -> scan, queue_ref, refs);
+            refs -> page = full_path;
+            refs -> nseen = 1;
+            refs -> seen[0] = cache_key(full_path);
+        }
+    }
+
+    ///a single range of a 200 with a known length is cut from the stream
+    byte_range r;
+    int slice = -1;
+    if (range != NULL && status == 200 && length >= 0 && !chunked) {
+        slice = parse_range(range, (off_t) length, & r, 1);
+    }
+    int client = TRUE;  //FALSE once the client got all it asked for or is gone
+    ///a hit of a compressible type varies on Accept-Encoding (file_from_local_sys), so does the miss
+    char * ext = get_mime_type(strchr(full_path, '/'));
+    char * vary = "";
+    if (gzip_enabled() && gzip_compressible(ext)) {
+        char * v = header_value(a, buf, "Vary");
+        vary = v == NULL || strcasestr(v, "Accept-Encoding") == NULL ? "Vary: Accept-Encoding\r\n" : "";
+    }
+    if (slice == 0) {
+        send_unsatisfiable(sd, (off_t) length);
+        client = FALSE;
+    } else if (slice == 1) {
+        char * response = arena_sprintf(a,
+                                        "HTTP/1.0 206 Partial Content\r\nContent-Length: %lld\r\nContent-Range: bytes %lld-%lld/%lld\r\n%s%s%s%sConnection: close\r\n\r\n",
+                                        (long long)(r.last - r.first + 1), (long long) r.first, (long long) r.last,
+                                        length, ext != NULL ? "Content-type: " : "", ext != NULL ? ext : "",
+                                        ext != NULL ? "\r\n" : "", vary);
+        alog_status(206);
+        if (response == NULL || write_all(sd, response, strlen(response)) == FALSE) {
+            client = FALSE;
+        } else {
+            alog_bytes((ssize_t) strlen(response));
+        }
+    } else {
+        alog_status(status);
+        ///the origin header is relayed as is, a 200 gets the Vary of the hits before its end
+        char * head = status == 200 && vary[0] != '\0' ?
+                      arena_sprintf(a, "%.*s%s\r\n", (int)(header - 2), buf, vary) : NULL;
+        size_t head_len = head != NULL ? strlen(head) : header;
+        if (write_all(sd, head != NULL ? head : buf, head_len) == FALSE) {
+            client = FALSE;
+        } else {
+            alog_bytes((ssize_t) head_len);
+        }
+    }
+
+    ///relay the body: the whole of it to the file, the whole or the range to the client
+    long long off = 0;
+    char * body = buf + header;
+    n = (ssize_t)(got - header);
+    while (1) {
+        if (n > 0) {
+            if (refs != NULL) {
+                prefetch_scan( & refs -> scan, body, (size_t) n);
+            }
+            if (df != NULL && diskq_write(df, body, (size_t) n) != 0) {
+                diskq_close(df, 0);
+                df = NULL;
+            }
+            if (client == TRUE) {
+                long long from = 0, to = n;
+                if (slice == 1) {
+                    from = r.first > off ? r.first - off : 0;
+                    to = r.last + 1 - off < n ? r.last + 1 - off : n;
+                }
+                if (from < to) {
+                    if (write_all(sd, body + from, (size_t)(to - from)) == FALSE) {
+                        client = FALSE;
+                    } else {
+                        alog_bytes((ssize_t)(to - from));
+                    }
+                }
+                ///the range is complete: let the client go while the file fills
+                if (slice == 1 && off + n > r.last) {
+                    shutdown(sd, SHUT_WR);
+                    client = FALSE;
+                }
+            }
+            off += n;
+        }
+        if (client == FALSE && df == NULL) {
+            break;
+        }
+        ///the buffer is empty again: a bigger one if the reads keep filling it
+        if (body == buf) {
+            buf_relay_adapt( & rb, (size_t) n);
+        }
+        body = buf = rb.data;
+        if ((n = read(csd, buf, rb.cap)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            break;
+        }
+        tw_touch(req_timer);
+    }
+    if (df != NULL) {
+        ///a truncated body is never served from the cache (a timeout ends it like a close)
+        saving -> size = (off_t) off;
+        ///the client has the whole response, it does not wait for the commit (or compression)
+        if (sd >= 0) {
+            shutdown(sd, SHUT_WR);
+        }
+        diskq_close(df, n == 0 && (length < 0 || off == length) && !tw_fired(req_timer));
+    }
+    origin_body = off;
+    trace_event(TR_ORIGIN_DONE);
+    buf_relay_free( & rb);
+    close_upstream(csd, sd);
+    return TRUE;
+}
+
+/**
+ * fetch an object from the peer that owns it and relay the response. the request keeps
+ * the Range and Accept-Encoding of the client, the connection is kept for the next fetch
+ * when the peer answered from its cache (a length and Connection: keep-alive)
+ * @param arena* a the arena of the request
+ * @param int owner the peer
+ * @param char* request the request for the origin
+ * @param int sd the socket of the client
+ * @param char* range the Range header of the request, NULL if none
+ * @param int gzip 1 if the client accepts gzip
+ * @return int TRUE if the client got the response of the peer, FALSE if the peer failed
+ *         before anything was sent (the object is fetched from the origin)
+ */
+int get_file_from_peer(arena * a, int owner, char * request, int sd, char * range, int gzip) {
+    ///the origin request ends with Connection: close, the peer request asks to keep it
+    size_t base = strlen(request) - strlen("Connection: close\r\n\r\n");
+    char * req = arena_sprintf(a, "%.*sX-Peer: 1\r\n%s%s%s%s%sConnection: keep-alive\r\n\r\n", (int) base, request,
+                               peer_token_header(),
+                               range != NULL ? "Range: " : "", range != NULL ? range : "", range != NULL ? "\r\n" : "",
+                               gzip ? "Accept-Encoding: gzip\r\n" : "");
+    buf_relay rb;
+    if (req == NULL || buf_relay_init( & rb, RELAY_LEN) != 0) {
+        return FALSE;
+    }
+    char * buf = rb.data;
+    size_t cap = RELAY_LEN - 1, got = 0;
+    char * end = NULL;
+    int csd = -1, reused = 1;
+    ///a kept connection may have been closed by the peer meanwhile: then once more on a new one
+    while (end == NULL && reused) {
+        if ((csd = peer_connect(owner, & reused)) < 0) {
+            break;
+        }
+        got = 0;
+        req_wait(WAIT_FIRST_BYTE, csd, -1);
+        ssize_t n = write_all(csd, req, strlen(req)) == TRUE ? 1 : -1;
+        while (n > 0 && end == NULL && got < cap) {
+            if ((n = read(csd, buf + got, cap - got)) < 0 && errno == EINTR) {
+                n = 1;
+                continue;
+            }
+            if (n > 0) {
+                got += (size_t) n;
+                buf[got] = '\0';
+                end = strstr(buf, "\r\n\r\n");
+            }
+        }
+        if (end == NULL) {
+            close_upstream(csd, sd);
+            csd = -1;
+        }
+    }
+    char * stat = end != NULL ? strstr(buf, "1.") : NULL;
+    int status = stat != NULL ? (int) strtol(stat + 4, NULL, 10) : 0;
+    if (csd < 0 || status == 0 || status == Service_Unavailable) {
+        ///an overloaded peer is not down, it is only skipped for this request
+        if (csd >= 0) {
+            close_upstream(csd, sd);
+        } else {
+            peer_down(owner);
+        }
+        buf_relay_free( & rb);
+        return FALSE;
+    }
+    trace_event(TR_ORIGIN_FIRST_BYTE);
+    req_wait(WAIT_IDLE, csd, sd);
+    peer_fetched(owner);
+    alog_cache(ALOG_PEER);
+    alog_status(status);
+    alog_mark(ALOG_FIRST);
+    size_t header = (size_t)(end + 4 - buf);
+    char * value = header_value(a, buf, "Content-Length");
+    long long length = value != NULL ? strtoll(value, NULL, 10) : -1;
+    value = header_value(a, buf, "Connection");
+    int keep = length >= 0 && value != NULL && strcasecmp(value, "keep-alive") == 0;
+
+    ///the client gets the header with Connection: close
+    char * conn = keep ? strcasestr(buf, "\r\nConnection:") : NULL;
+    int client = TRUE;
+    if (conn != NULL) {
+        char * next = strstr(conn + 2, "\r\n");
+        client = write_all(sd, buf, (size_t)(conn - buf)) == TRUE &&
+                 write_all(sd, "\r\nConnection: close", strlen("\r\nConnection: close")) == TRUE &&
+                 write_all(sd, next, header - (size_t)(next - buf)) == TRUE ? TRUE : FALSE;
+    } else {
+        client = write_all(sd, buf, header);
+    }
+    alog_bytes(client == TRUE ? (ssize_t) header : -1);
+
+    ///the body: its length if there is one, else until the peer closes
+    long long left = length >= 0 ? length : LLONG_MAX;
+    char * body = buf + header;
+    ssize_t n = (ssize_t)(got - header);
+    while (client == TRUE) {
+        if (n > left) {
+            n = (ssize_t) left;
+        }
+        if (n > 0) {
+            if (write_all(sd, body, (size_t) n) == FALSE) {
+                client = FALSE;
+                break;
+            }
+            alog_bytes(n);
+            left -= n;
+        }
+        if (left == 0) {
+            break;
+        }
+        if (body == buf) {
+            buf_relay_adapt( & rb, (size_t) n);
+        }
+        body = buf = rb.data;
+        if ((n = read(csd, buf, left < (long long) rb.cap ? (size_t) left : rb.cap)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            break;
+        }
+        tw_touch(req_timer);
+    }
+    ///the connection goes back to the pool without its timeout
+    req_wait(WAIT_IDLE, sd, -1);
+    peer_release(owner, csd, keep && left == 0);
+    buf_relay_free( & rb);
+    trace_event(TR_ORIGIN_DONE);
+    return TRUE;
+}
+
+/**
+ * fetch an object from its owner in the cluster or the origin, or revalidate
+ * the stale cached copy, and answer the client
+ * @param arena* a the arena of the request
+ * @param char* request the request for the origin
+ * @param char* full_path host/path of the object
+ * @param char* file its cache file
+ * @param int sd the socket of the client
+ * @param char* range the Range header of the request, NULL if none
+ * @param int gzip 1 if the client accepts gzip
+ * @param cache_meta* old the metadata of the stale copy, NULL for a miss
+ * @param int owner the peer that owns the object, -1 if it is local
+ */
+void fetch_object(arena * a, char * request, char * full_path, char * file, int sd, char * range, int gzip,
+                  cache_meta * old, int owner) {
+    ///the owner keeps the only copy, the origin is the fallback if it fails
+    if (owner >= 0 && get_file_from_peer(a, owner, request, sd, range, gzip) == TRUE) {
+        return;
+    }
+    if (get_file_from_server(a, request, full_path, file, sd, range, old) != Not_Modified) {
+        return;
+    }
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        send_error_msg(sd, Server_Error);
+        return;
+    }
+    file_from_local_sys(a, full_path, file, fd, sd, range, gzip, 0);
+    alog_cache(ALOG_REVALIDATED);
+}
+
+/**
+ * function of the miss lane, fetch a missed file from the origin
+ * @param void* param the miss_ctx of the request
+ * @return int TRUE
+ * */
+int handle_miss(void * param) {
+    miss_ctx * m = (miss_ctx * ) param;
+    tw_timer timer;
+    trace_req = m -> trace_req;
+    alog_attach( & m -> rec);
+    req_timer_attach( & timer);
+    req_wait(WAIT_IDLE, m -> sd, -1);
+    fetch_object(m -> a, m -> request, m -> full_path, m -> file, m -> sd, m -> range, m -> gzip, m -> old, m -> owner);
+    close_client(m -> sd);
+    req_timer_detach();
+    trace_event(TR_REQ_END);
+    ///the record lives in the arena: commit it before the release
+    alog_end();
+    arena_release(m -> a);
+    return TRUE;
+}
+
+/**
+ * function of the miss lane, revalidate a stale object that was served
+ * to its client already
+ * @param void* param the miss_ctx of the request, sd is -1
+ * @return int TRUE
+ * */
+int handle_refresh(void * param) {
+    miss_ctx * m = (miss_ctx * ) param;
+    tw_timer timer;
+    trace_req = m -> trace_req;
+    req_timer_attach( & timer);
+    get_file_from_server(m -> a, m -> request, m -> full_path, m -> file, -1, NULL, m -> old);
+    req_timer_detach();
+    cache_refresh_done(cache_key(m -> full_path));
+    arena_release(m -> a);
+    return TRUE;
+}
+
+/**
+ * answer a miss the miss lane has no capacity for with a 503
+ * @param void* param the miss_ctx of the request
+ * @return int FALSE
+ */
+int shed_miss(void * param) {
+    miss_ctx * m = (miss_ctx * ) param;
+    ///a shed refresh has no client, the next stale hit tries again
+    if (m -> sd < 0) {
+        cache_refresh_done(cache_key(m -> full_path));
+        arena_release(m -> a);
+        return FALSE;
+    }
+    alog_attach( & m -> rec);
+    send_error_msg(m -> sd, Service_Unavailable);
+    close(m -> sd);
+    alog_end();
+    arena_release(m -> a);
+    return FALSE;
+}
+
+/**
+ * fetch a referenced object into the cache like a miss without a client, unless it
+ * is cached, failing, owned by a peer or being fetched already
+ * @param char* url host[:port]/path of the object
+ * @return long long the bytes fetched, -1 if it was not fetched
+ */
+static long long prefetch_fetch(const char * url) {
+    arena * a = arena_acquire();
+    if (a == NULL) {
+        return -1;
+    }
+    const char * path = strchr(url, '/');
+    char * full_path = arena_sprintf(a, "%s%s", url, url[strlen(url) - 1] == '/' ? "index.html" : "");
+    char * request = arena_sprintf(a, "GET %s HTTP/1.0\r\nHost: %.*s\r\nConnection: close\r\n\r\n", path,
+                                   (int)(path - url), url);
+    char * file = (char * ) arena_alloc(a, CACHE_PATH_LEN);
+    long long bytes = -1;
+    if (full_path != NULL && request != NULL && file != NULL) {
+        uint64_t key = cache_key(full_path);
+        cache_path(key, file);
+        if ((cache_maybe(key) && access(file, F_OK) == 0) || neg_cache_get(NEG_URL, full_path) != 0 ||
+            peer_owner(key) >= 0 || cache_refresh_claim(key) != 0) {
+            prefetch_note(PREFETCH_SKIPPED);
+        } else {
+            tw_timer timer;
+            req_timer_attach( & timer);
+            origin_body = -1;
+            get_file_from_server(a, request, full_path, file, -1, NULL, NULL);
+            bytes = origin_body;
+            req_timer_detach();
+            cache_refresh_done(key);
+        }
+    }
+    arena_release(a);
+    return bytes;
+}
+
+/**
+ * function of the prefetch threads, fetch an object referenced by a page. a request
+ * its origin has no slot for waits in the list of the origin and runs on the thread
+ * of the prefetch that ends first
+ * @param void* param the prefetch_req
+ * @return int TRUE
+ */
+int handle_prefetch(void * param) {
+    prefetch_req * r = (prefetch_req * ) param;
+    static __thread int niced = 0;
+    ///the prefetch threads only get the cpu the request threads leave
+    if (!niced) {
+        setpriority(PRIO_PROCESS, (id_t) gettid(), PREFETCH_NICE);
+        niced = 1;
+    }
+    int rc = prefetch_admit(r);
+    if (rc != 0) {
+        if (rc < 0) {
+            free(r);
+        }
+        return TRUE;
+    }
+    while (r != NULL) {
+        r = prefetch_done(r, prefetch_stop ? -1 : prefetch_fetch(r -> url));
+    }
+    return TRUE;
+}
+
+/**
+ * drop a prefetch the prefetch threads have no capacity for
+ * @param void* param the prefetch_req
+ * @return int FALSE
+ */
+int shed_prefetch(void * param) {
+    free(param);
+    prefetch_note(PREFETCH_SHED);
+    return FALSE;
+}
+
+/**
+ * relay a tunnel in both directions until both sides closed it, an error, or
+ * --tunnel-idle seconds without traffic. the bytes go socket -> pipe -> socket
+ * with splice and never enter user space. an end of stream on one side is
+ * passed on as a shutdown, the other direction goes on. poll has no timeout:
+ * the request timeout shuts both sockets down when the tunnel stays idle
+ * @param int sd the socket of the client
+ * @param int csd the socket of the origin
+ * @return int TRUE if both sides closed, FALSE on error or idle timeout
+ */
+int tunnel_relay(int sd, int csd) {
+    struct {
+        int from, to;
+        int pipe[2];
+        size_t pending;     //bytes in the pipe
+        int eof;
+    } dir[2] = {
+            {sd, csd, {-1, -1}, 0, 0},      //client to origin
+            {csd, sd, {-1, -1}, 0, 0}       //origin to client
+    };
+    int result = FALSE;
+    if (pipe2(dir[0].pipe, O_NONBLOCK) != 0 || pipe2(dir[1].pipe, O_NONBLOCK) != 0) {
+        goto done;
+    }
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+    fcntl(csd, F_SETFL, fcntl(csd, F_GETFL) | O_NONBLOCK);
+    req_wait(WAIT_TUNNEL, sd, csd);
+    while (!(dir[0].eof && dir[0].pending == 0 && dir[1].eof && dir[1].pending == 0)) {
+        ///a side nothing is expected from is left out, its hangup would wake poll for nothing
+        struct pollfd pfd[2] = {
+                {sd, 0, 0}, {csd, 0, 0}
+        };
+        for (int d = 0; d < 2; d++) {
+            if (!dir[d].eof && dir[d].pending == 0) {
+                pfd[d].events |= POLLIN;
+            }
+            if (dir[d].pending > 0) {
+                pfd[1 - d].events |= POLLOUT;
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            pfd[i].fd = pfd[i].events != 0 ? pfd[i].fd : -1;
+        }
+        int r = poll(pfd, 2, -1);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            goto done;
+        }
+        for (int d = 0; d < 2; d++) {
+            if (dir[d].pending == 0 && !dir[d].eof && pfd[d].revents != 0) {
+                ssize_t n = splice(dir[d].from, NULL, dir[d].pipe[1], NULL, TUNNEL_CHUNK,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n == 0) {
+                    dir[d].eof = 1;
+                    shutdown(dir[d].to, SHUT_WR);
+                } else if (n > 0) {
+                    dir[d].pending = (size_t) n;
+                    tw_touch(req_timer);
+                } else if (errno != EAGAIN) {
+                    goto done;
+                }
+            }
+            ///the other side is usually writable: no wait for the next poll
+            if (dir[d].pending > 0) {
+                ssize_t n = splice(dir[d].pipe[0], NULL, dir[d].to, NULL, dir[d].pending,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n < 0 && errno != EAGAIN) {
+                    goto done;
+                }
+                if (n > 0) {
+                    dir[d].pending -= (size_t) n;
+                    if (d == 0) {
+                        alog_bytes_up(n);
+                    } else {
+                        alog_bytes(n);
+                    }
+                }
+            }
+        }
+    }
+    ///an idle tunnel ends like a closed one
+    result = tw_fired(req_timer) ? FALSE : TRUE;
+done:
+    for (int d = 0; d < 2; d++) {
+        if (dir[d].pipe[0] >= 0) {
+            close(dir[d].pipe[0]);
+            close(dir[d].pipe[1]);
+        }
+    }
+    return result;
+}
+
+#define TUNNEL_PORTS_MAX 32
+
+static int tunnel_ports[TUNNEL_PORTS_MAX] = {443};     //ports a CONNECT may open a tunnel to
+static int tunnel_nports = 1;
+
+/**
+ * set the ports a CONNECT may open a tunnel to
+ * @param char* list the ports, comma separated
+ * @return int TRUE, FALSE if the list is malformed or too long
+ */
+int tunnel_ports_parse(char * list) {
+    int n = 0;
+    char * save;
+    for (char * port = strtok_r(list, ",", & save); port != NULL; port = strtok_r(NULL, ",", & save)) {
+        if (n == TUNNEL_PORTS_MAX || valid_num(port) == FALSE || atoi(port) < 1 || atoi(port) > 65535) {
+            return FALSE;
+        }
+        tunnel_ports[n++] = atoi(port);
+    }
+    if (n == 0) {
+        return FALSE;
+    }
+    tunnel_nports = n;
+    return TRUE;
+}
+
+/**
+ * whether a CONNECT may open a tunnel to a port
+ * @param int port the port
+ * @return int TRUE if it is in --tunnel-ports, FALSE else
+ */
+static int tunnel_port_allowed(int port) {
+    for (int i = 0; i < tunnel_nports; i++) {
+        if (tunnel_ports[i] == port) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * answer a CONNECT request: check the port and the host, connect to it and
+ * relay the tunnel until it ends
+ * @param char* request the request, ends with the header unless the client closed its side early
+ * @param ssize_t is_read the bytes read, the client may have sent data after the header
+ * @param params* p the client
+ */
+void handle_connect(char * request, ssize_t is_read, params * p) {
+    ///a client that closed its side before the end of the header sent no complete request
+    char * end = strstr(request, "\r\n\r\n");
+    if (end == NULL) {
+        send_error_msg(p -> sd, Bad_Request);
+        return;
+    }
+    end += 4;
+    char * save;
+    char * line = strtok_r(request, "\r\n", & save);
+    char * method = strtok_r(line, " ", & save);
+    char * authority = strtok_r(NULL, " ", & save);
+    char * protocol = strtok_r(NULL, " ", & save);
+    if (method == NULL || authority == NULL || protocol == NULL || strchr(authority, '/') != NULL ||
+        (strcmp(protocol, "HTTP/1.0") != 0 && strcmp(protocol, "HTTP/1.1") != 0)) {
+        send_error_msg(p -> sd, Bad_Request);
+        return;
+    }
+    alog_request(authority, "");
+    char * colon = strrchr(authority, ':');
+    if (colon == NULL || colon == authority || valid_num(colon + 1) == FALSE) {
+        send_error_msg(p -> sd, Bad_Request);
+        return;
+    }
+    ///a tunnel carries anything: only to the ports allowed, whatever the filter says of the host
+    if (tunnel_port_allowed(atoi(colon + 1)) == FALSE) {
+        send_error_msg(p -> sd, Forbidden);
+        return;
+    }
+    if (check_host(authority, p -> filter, p -> hosts, p -> ips, p -> sd) == FALSE) {
+        return;
+    }
+    int csd = open_connection(authority, p -> sd);
+    if (csd == FALSE) {
+        return;
+    }
+    trace_event(TR_ORIGIN_CONNECT);
+    const char established[] = "HTTP/1.0 200 Connection established\r\n\r\n";
+    alog_status(200);
+    alog_cache(ALOG_TUNNEL);
+    if (write_all(p -> sd, established, sizeof(established) - 1) == FALSE) {
+        close_upstream(csd, p -> sd);
+        return;
+    }
+    alog_mark(ALOG_FIRST);
+    ///bytes the client sent right after the header (a TLS client hello) go first
+    if (end < request + is_read) {
+        if (write_all(csd, end, (size_t)(request + is_read - end)) == FALSE) {
+            close_upstream(csd, p -> sd);
+            return;
+        }
+        alog_bytes_up(request + is_read - end);
+    }
+    tunnel_relay(p -> sd, csd);
+    trace_event(TR_ORIGIN_DONE);
+    close_upstream(csd, p -> sd);
+}
+
+/**
+ * function of the tunnel lane, relay a CONNECT tunnel until it ends
+ * @param void* param the tunnel_ctx of the request
+ * @return int TRUE
+ * */
+int handle_tunnel(void * param) {
+    tunnel_ctx * t = (tunnel_ctx * ) param;
+    tw_timer timer;
+    trace_req = t -> trace_req;
+    alog_attach( & t -> rec);
+    req_timer_attach( & timer);
+    req_wait(WAIT_IDLE, t -> p.sd, -1);
+    handle_connect(t -> request, t -> is_read, & t -> p);
+    close_client(t -> p.sd);
+    req_timer_detach();
+    trace_event(TR_REQ_END);
+    alog_end();
+    arena_release(t -> a);
+    return TRUE;
+}
+
+/**
+ * answer a tunnel the tunnel lane has no capacity for with a 503
+ * @param void* param the tunnel_ctx of the request
+ * @return int FALSE
+ */
+int shed_tunnel(void * param) {
+    tunnel_ctx * t = (tunnel_ctx * ) param;
+    alog_attach( & t -> rec);
+    send_error_msg(t -> p.sd, Service_Unavailable);
+    close(t -> p.sd);
+    alog_end();
+    arena_release(t -> a);
+    return FALSE;
+}
+
+/**
+ * how a cached copy may be used
+ * @param arena* a the arena of the request
+ * @param char* file the cache file
+ * @param cache_meta** meta set to the metadata read (in the arena), NULL if there is none
+ * @return int FRESH, STALE_SERVE (serve and refresh in the background) or STALE (revalidate first)
+ */
+int cache_state(arena * a, char * file, cache_meta ** meta) {
+    cache_meta * m = (cache_meta * ) arena_alloc(a, sizeof(cache_meta));
+    if (m == NULL) {
+        * meta = NULL;
+        return FRESH;
+    }
+    ///a copy without metadata is fetched again, unconditionally
+    if (cache_meta_read(file, m) != 0) {
+        memset(m, 0, sizeof(cache_meta));
+        * meta = m;
+        return STALE;
+    }
+    * meta = m;
+    int64_t now = (int64_t) time(NULL);
+    if (now < m -> expires) {
+        return FRESH;
+    }
+    return now < m -> expires + m -> swr ? STALE_SERVE : STALE;
+}
+
+/**
+ * serve one request of a client connection
+ * @param params* p the client
+ * @param int kept 1 if the connection was kept from a previous request of a peer
+ * @return int KEEP_ALIVE if the connection was kept for another request (a peer
+ *         request answered from the cache), TRUE or FALSE once it is closed or handed over
+ * */
+int serve_client(params * p, int kept) {
+    alog_rec rec;
+    trace_begin();
+    alog_begin( & rec, & p -> cli);
+    ///every allocation of the request comes from its arena
+    arena * a = arena_acquire();
+    char * request = a != NULL ? (char * ) arena_alloc(a, LEN) : NULL;
+    if (request == NULL) {
+        send_error_msg(p -> sd, Server_Error);
+        arena_release(a);
+        close_client(p -> sd);
+        alog_end();
+        return FALSE;
+    }
+    ///read from socket, a client (or a kept peer connection) that stalls gives its thread back
+    req_wait(kept ? WAIT_KEEPALIVE : WAIT_HEADER, p -> sd, -1);
+    ssize_t nbytes, is_read = 0;
+    int len = LEN;
+    char * end;
+    while ((nbytes = read(p -> sd, request + is_read, len - 1 - is_read)) != 0) {
+        if (nbytes < 0) {
+            break;
+        }
+        is_read += nbytes;
+        request[is_read] = '\0';
+        end = strstr(request, "\r\n\r\n");
+        if (end != NULL) {
+            break;
+        }
+        if (is_read == len - 1) {
+            request = (char * ) arena_realloc(a, request, len, len * 2);
+            if (request == NULL) {
+                break;
+            }
+            len *= 2;
+        }
+    }
+    ///a kept connection the peer did not use again
+    if (kept && (nbytes < 0 || is_read == 0 || tw_fired(req_timer))) {
+        alog_attach(NULL);
+        arena_release(a);
+        close_client(p -> sd);
+        return FALSE;
+    }
+    if (tw_fired(req_timer)) {
+        alog_status(Request_Timeout);
+        arena_release(a);
+        close_client(p -> sd);
+        alog_end();
+        return FALSE;
+    }
+    if (request == NULL || nbytes < 0 || is_read == 0) {
+        send_error_msg(p -> sd, Server_Error);
+        arena_release(a);
+        close_client(p -> sd);
+        alog_end();
+        return FALSE;
+    }
+    trace_event(TR_READ_DONE);
+    alog_mark(ALOG_READ);
+    req_wait(WAIT_IDLE, p -> sd, -1);
+
+    ///a tunnel holds its thread until it ends: not one of the request lane
+    if (strncmp(request, "CONNECT ", 8) == 0) {
+        tunnel_ctx * t = (tunnel_ctx * ) arena_alloc(a, sizeof(tunnel_ctx));
+        if (t != NULL) {
+            t -> a = a;
+            t -> request = request;
+            t -> is_read = is_read;
+            t -> p = * p;
+            t -> trace_req = trace_req;
+            t -> rec = rec;
+            ///from here the tunnel lane owns the request, with a timeout of its own
+            req_wait(WAIT_IDLE, -1, -1);
+            if (dispatch(p -> tunnel_pool, handle_tunnel, t) == 0) {
+                alog_attach(NULL);
+                return TRUE;
+            }
+        }
+        send_error_msg(p -> sd, Service_Unavailable);
+        arena_release(a);
+        close_client(p -> sd);
+        trace_event(TR_REQ_END);
+        alog_end();
+        return TRUE;
+    }
+    ///a peer request is answered by this node, never passed on to another peer
+    char * peer_req = header_value(a, request, "X-Peer");
+    ///from any other address or without the cluster token it is an ordinary client (the origin
+    ///request never carries the headers)
+    if (peer_req != NULL && !peer_trusted( & p -> cli.sin_addr, header_value(a, request, "X-Peer-Token"))) {
+        peer_req = NULL;
+    }
+    if (peer_req != NULL && strcmp(peer_req, "ping") == 0) {
+        const char pong[] = "HTTP/1.0 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        write_all(p -> sd, pong, sizeof(pong) - 1);
+        ///health checks are traced, not logged
+        trace_event(TR_REQ_END);
+        alog_attach(NULL);
+        arena_release(a);
+        close_client(p -> sd);
+        return TRUE;
+    }
+    ///a kept response goes out as soon as it is written, the close does not flush it
+    if (peer_req != NULL) {
+        int one = 1;
+        setsockopt(p -> sd, IPPROTO_TCP, TCP_NODELAY, & one, sizeof(one));
+    }
+    ///check if header okay, the request is replaced by the one for the origin
+    char * range = header_value(a, request, "Range");
+    int gzip = gzip_enabled() && gzip_accepted(header_value(a, request, "Accept-Encoding"));
+    char * full_path = parse_header(a, & request, is_read, p -> filter, p -> hosts, p -> ips, p -> sd);
+    if (full_path == NULL) {
+        arena_release(a);
+        close_client(p -> sd);
+        trace_event(TR_REQ_END);
+        alog_end();
+        return FALSE;
+    }
+    trace_event(TR_PARSE_DONE);
+    alog_mark(ALOG_PARSE);
+
+    char * file = (char * ) arena_alloc(a, CACHE_PATH_LEN);
+    if (file == NULL) {
+        send_error_msg(p -> sd, Server_Error);
+        arena_release(a);
+        close_client(p -> sd);
+        trace_event(TR_REQ_END);
+        alog_end();
+        return FALSE;
+    }
+    uint64_t key = cache_key(full_path);
+    cache_path(key, file);
+    ///a definite miss never touches the filesystem, a hit is one open
+    int fd = cache_maybe(key) ? open(file, O_RDONLY) : -1;
+    cache_meta * old = NULL;
+    int state = fd >= 0 ? cache_state(a, file, & old) : STALE, failed;
+    int peer_keeps = FALSE;     //TRUE once a peer got the whole response on a connection it keeps
+    ///a miss of an object another node owns is fetched from that node
+    int owner = peer_req == NULL && fd < 0 ? peer_owner(key) : -1;
+    if (fd >= 0 && state == STALE) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) { //file in system files
+        trace_event(TR_CACHE_HIT);
+        int sent = file_from_local_sys(a, full_path, file, fd, p -> sd, range, gzip, peer_req != NULL);
+        peer_keeps = peer_req != NULL && sent == TRUE ? TRUE : FALSE;
+        ///stale-while-revalidate: the client got the stale copy, refresh it after
+        if (state == STALE_SERVE) {
+            alog_cache(ALOG_STALE);
+            if (cache_refresh_claim(key) == 0) {
+                close_client(p -> sd);
+                trace_event(TR_REQ_END);
+                alog_end();
+                miss_ctx * m = p -> miss_pool != NULL ? (miss_ctx * ) arena_calloc(a, sizeof(miss_ctx)) : NULL;
+                if (m != NULL) {
+                    m -> a = a;
+                    m -> request = request;
+                    m -> full_path = full_path;
+                    m -> file = file;
+                    m -> sd = -1;
+                    m -> trace_req = trace_req;
+                    m -> old = old;
+                    if (dispatch(p -> miss_pool, handle_refresh, m) == 0) {
+                        return TRUE;
+                    }
+                    cache_refresh_done(key);
+                } else {
+                    get_file_from_server(a, request, full_path, file, -1, NULL, old);
+                    cache_refresh_done(key);
+                }
+                arena_release(a);
+                return TRUE;
+            }
+        }
+    } else if (old == NULL && (failed = neg_cache_get(NEG_URL, full_path)) != 0) { //the origin failed recently
+        alog_cache(ALOG_NEGATIVE);
+        send_error_msg(p -> sd, failed);
+    } else if (p -> miss_pool != NULL) { //file not in system files, fetch it in the miss lane
+        trace_event(TR_CACHE_MISS);
+        miss_ctx * m = (miss_ctx * ) arena_alloc(a, sizeof(miss_ctx));
+        if (m != NULL) {
+            m -> a = a;
+            m -> request = request;
+            m -> full_path = full_path;
+            m -> file = file;
+            m -> range = range;
+            m -> gzip = gzip;
+            m -> old = old;
+            m -> sd = p -> sd;
+            m -> owner = owner;
+            m -> trace_req = trace_req;
+            m -> rec = rec;
+            ///from here the miss lane owns the request, with a timeout of its own
+            req_wait(WAIT_IDLE, -1, -1);
+            if (dispatch(p -> miss_pool, handle_miss, m) == 0) {
+                alog_attach(NULL);
+                return TRUE;
+            }
+        }
+        send_error_msg(p -> sd, Service_Unavailable);
+    } else { //file not in system files
+        trace_event(TR_CACHE_MISS);
+        fetch_object(a, request, full_path, file, p -> sd, range, gzip, old, owner);
+    }
+    arena_release(a);
+    trace_event(TR_REQ_END);
+    alog_end();
+    ///the peer sends its next request on the same connection, or closes it
+    if (peer_keeps == TRUE) {
+        return KEEP_ALIVE;
+    }
+    close_client(p -> sd);
+    return TRUE;
+}
+
+/**
+ * function of thread work, deal with all work with the client. a peer
+ * connection is served until the peer closes it or leaves it idle
+ * @param void* param struct of parameters to work with client
+ * @return
+ * */
+int handle_client(void * param) {
+    params * p = (params * ) param;
+    tw_timer timer;
+    int kept = 0;
+    req_timer_attach( & timer);
+    while (serve_client(p, kept) == KEEP_ALIVE) {
+        kept = 1;
+    }
+    req_timer_detach();
+    free(p);
+    return TRUE;
+}
+
+/**
+ * print how many waits of each kind timed out, if any did
+ */
+void print_timeouts(void) {
+    for (int i = 0; i < WAIT_KINDS; i++) {
+        if (stats -> expired[i] != 0 && i != WAIT_KEEPALIVE) {
+            fprintf(stderr, "timeouts: %ld header, %ld connect, %ld first byte, %ld idle, %ld tunnel\n",
+                    stats -> expired[WAIT_HEADER], stats -> expired[WAIT_CONNECT],
+                    stats -> expired[WAIT_FIRST_BYTE], stats -> expired[WAIT_IDLE], stats -> expired[WAIT_TUNNEL]);
+            return;
+        }
+    }
+}
+
+/**
+ * print the churn and shedding counters of a pool, if there are any
+ * @param char* name the name of the pool
+ * @param threadpool* pool the pool
+ * @param int elastic 1 if the pool can change size
+ */
+void print_pool_stats(char * name, threadpool * pool, int elastic) {
+    threadpool_stats st;
+    threadpool_get_stats(pool, & st);
+    if (elastic || st.rejected != 0 || st.shed != 0) {
+        fprintf(stderr, "%s: %d threads, peak %d, %ld spawned, %ld retired, %ld rejected, %ld shed\n", name,
+                st.threads, st.peak, st.spawned, st.retired, st.rejected, st.shed);
+    }
+}
+
 /**
- * send http request to established socket, read the response, send to client and create file on the local system
- * @param char* request the request from the client
- * @param char* full_path the path of the file
- * @param sd the socket of the client
+ * choose the cpus of a shard: the configured set, narrowed to the NUMA
+ * node of the shard when there are several shards and several nodes
+ * @param cpu_set_t* base the configured cpus, NULL for all cpus
+ * @param int index the shard
+ * @param int nshards number of shards
+ * @param cpu_set_t* out the cpus of the shard
+ * @return int 1 if the shard threads should run on out only, 0 else
  */
-void get_file_from_server(char * request, char * full_path, int sd) {
-    //crate http request
-    char * path = malloc((int) strlen(full_path) + 1);
-    if (path == NULL) {
-        send_error_msg(sd, Server_Error);
-        return;
-    }
-    memset(path, '\0', (int) strlen(full_path) + 1);
-    strcpy(path, full_path);
-    char * name = strtok(path, "/");
-    int csd = open_connection(name, sd);
-    free(path);
-    if (csd == FALSE) {
-        send_error_msg(sd, Server_Error);
-        return;
+int shard_cpus(const cpu_set_t * base, int index, int nshards, cpu_set_t * out) {
+    int nodes = numa_node_count();
+    if (nshards > 1 && nodes > 1 && numa_node_cpus(index % nodes, out) == 0) {
+        if (base != NULL) {
+            cpu_set_t local;
+            CPU_AND( & local, out, base);
+            ///no configured cpu on this node: keep the configured set
+            * out = CPU_COUNT( & local) > 0 ? local : * base;
+        }
+        return 1;
     }
-    //write http request to the socket
-    if (write(csd, request, strlen(request)) < 0) {
-        send_error_msg(sd, Server_Error);
-        return;
+    if (base != NULL) {
+        * out = * base;
+        return 1;
     }
-    free(request);
-
-    //read all from socket
-    unsigned char buf[LEN], half_buf1[LEN / 2], half_buf2[LEN / 2];
-    memset(buf, '\0', LEN);
-    memset(half_buf1, '\0', LEN / 2);
-    memset(half_buf2, '\0', LEN / 2);
+    return 0;
+}
 
-    int is_read = 0, n, size_buf2;
+static volatile sig_atomic_t server_stop = 0;   //1 once the acceptors must stop
+static int wake_fd[2] = {
+        -1, -1
+};      //written once to wake every acceptor
 
-    if ((n = (int) read(csd, half_buf1, LEN / 2)) < 0) {
-        send_error_msg(sd, Server_Error);
-        close(csd);
-        return;
-    }
-    is_read += n;
-    memcpy(buf, half_buf1, n);
-    if ((n = (int) read(csd, half_buf2, LEN / 2)) < 0) {
-        send_error_msg(sd, Server_Error);
-        close(csd);
-        return;
-    }
-    is_read += n;
-    size_buf2 = n;
-    memcpy(buf + (is_read - n), half_buf2, n);
-    if (write(sd, buf, n) < 0) {
-        send_error_msg(sd, Server_Error);
-        close(csd);
-        return;
+/**
+ * stop accepting: wake every acceptor. async-signal-safe.
+ */
+void server_wake(void) {
+    server_stop = 1;
+    if (wake_fd[1] >= 0) {
+        ssize_t w = write(wake_fd[1], "x", 1);
+        (void) w;
     }
-    char * stat = strstr((char * ) buf, "1.");
-    int status = (int) strtol(stat + 4, NULL, 10);
-    if (200 <= status && status < 300) {
+}
 
-        //create folders and file
-        if (creat_directories(full_path, sd) == FALSE) {
-            send_error_msg(sd, Server_Error);
-            close(csd);
-            return;
-        }
+/**
+ * SIGTERM / SIGINT: stop accepting, finish the requests in progress, exit
+ */
+void on_stop_signal(int sig) {
+    (void) sig;
+    server_wake();
+}
 
-        int fd = open(full_path, O_CREAT | O_WRONLY, 0644);
-        if (fd < 0) {
-            send_error_msg(sd, Server_Error);
-            close(csd);
-            return;
+/**
+ * the accept loop of a shard, hands every connection to the shard pool
+ * @param void* arg the shard
+ * @return void* NULL
+ * */
+void * accept_loop(void * arg) {
+    shard * sh = (shard * ) arg;
+    server * srv = sh -> srv;
+    struct sockaddr_in cli;
+    unsigned int cli_len;
+    int counter, sd;
+    struct pollfd pfd[2] = {
+            {sh -> sd, POLLIN, 0},
+            {wake_fd[0], POLLIN, 0}
+    };
+    while (!server_stop) {
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+            perror("error: poll\n");
+            exit(EXIT_FAILURE);
         }
-        char * end = strstr((char * ) buf, "\r\n\r\n");
-        while (end == NULL) {
-            memcpy(half_buf1, half_buf2, size_buf2);
-            memset(half_buf2, '\0', LEN / 2);
-            memset(buf, '\0', LEN);
-            if ((n = (int) read(csd, half_buf2, LEN / 2)) < 0) {
-                send_error_msg(sd, Server_Error);
-                close(fd);
-                close(csd);
-                return;
-            }
-            memcpy(buf, half_buf1, size_buf2);
-            memcpy(buf + size_buf2, half_buf2, n);
-            if (write(sd, half_buf2, n) < 0) {
-                send_error_msg(sd, Server_Error);
-                close(csd);
-                close(fd);
-                return;
-            }
-            size_buf2 = n;
-            is_read += n;
-            end = strstr((char * ) buf, "\r\n\r\n");
-
-        }
-        ///check if there is something to write to the file
-        end += 4;
-        char temp = * end;
-        * end = '\0';
-        int wr = (int) strlen((char * ) buf);
-        * end = temp;
-        int hmtw = LEN - wr;
-        if (hmtw > 0) {
-            if (write(fd, buf + wr, hmtw) < 0) {
-                send_error_msg(sd, Server_Error);
-                close(csd);
-                close(fd);
-                return;
+        if (server_stop || pfd[1].revents != 0) {
+            break;
+        }
+        ///accept
+        cli_len = sizeof(cli);
+        sd = accept(sh -> sd, (struct sockaddr * ) & cli, & cli_len);
+        if (sd < 0) {
+            ///taken by another acceptor (or process), or the client gave up
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
+            perror("error: accept\n");
+            exit(EXIT_FAILURE);
         }
-
-        memset(buf, '\0', LEN);
-        while ((n = (int) read(csd, buf, LEN)) > 0) {
-            if (write(fd, buf, n) < 0) {
-                send_error_msg(sd, Server_Error);
-                close(csd);
-                close(fd);
-                return;
+        sock_apply(SOCK_ACCEPTED, sd);
+        if (srv -> max_req > 0) {
+            counter = __atomic_fetch_add( & stats -> accepted, 1, __ATOMIC_RELAXED);
+            if (counter >= srv -> max_req) {
+                ///another shard took the last request meanwhile
+                shed_client_sd(sd, & cli);
+                break;
             }
-            if (write(sd, buf, n) < 0) {
-                send_error_msg(sd, Server_Error);
-                close(csd);
-                close(fd);
-                return;
+            if (counter == srv -> max_req - 1) {
+                ///wake the other acceptors, they have nothing left to do
+                server_wake();
             }
-            is_read += n;
-            memset(buf, '\0', n);
         }
-        close(fd);
-    } else {
-
-        while ((n = (int) read(csd, buf, LEN)) != 0) {
-            if (write(sd, buf, n) < 0) {
-                send_error_msg(sd, Server_Error);
-                close(csd);
-                return;
-            }
-            is_read += n;
+        params * p = calloc(1, sizeof(params));
+        if (p == NULL) {
+            send_error_msg(sd, Server_Error);
+            close(sd);
+            continue;
+        }
+        p -> sd = sd;
+        p -> filter = srv -> filter;
+        p -> hosts = srv -> hosts;
+        p -> ips = srv -> ips;
+        p -> cli = cli;
+        p -> miss_pool = sh -> miss_pool;
+        p -> tunnel_pool = sh -> tunnel_pool;
+        ///queue full or shutting down: answer 503 now instead of queueing
+        if (dispatch(sh -> pool, handle_client, (void * ) p) != 0) {
+            shed_client(p);
         }
     }
-    printf("File is given from origin server\n");
-    printf("\n Total response bytes: %d\n", is_read);
-    close(csd);
+    return NULL;
 }
 
 /**
- * function of thread work, deal with all work with the client
- * @param void* param struct of parameters to work with client
- * @return
- * */
-int handle_client(void * param) {
-    struct params p = * ((params * ) param);
-    ///read from socket
-    char * request = (char * ) malloc(LEN);
-    if (request == NULL) {
-        send_error_msg(p.sd, Server_Error);
-        free(request);
-        close(p.sd);
-        return FALSE;
+ * serialize the warm state handed to a new server
+ * @param size_t* len size of the snapshot
+ * @return char* the snapshot (malloc'ed), NULL if out of memory
+ */
+char * build_snapshot(size_t * len) {
+    size_t cap = sizeof(handoff_sec) + (size_t) DNS_SETS * DNS_WAYS * (1 + DNS_NAME_LEN + 8);
+    char * snap = (char * ) malloc(cap);
+    if (snap == NULL) {
+        return NULL;
     }
-    memset(request, '\0', LEN);
-    ssize_t nbytes, is_read = 0;
-    int len = LEN;
-    char * end;
-    while ((nbytes = read(p.sd, request + is_read, LEN)) != 0) {
-        is_read += nbytes;
-        if (nbytes < 0) {
-            break;
-        }
-        end = strstr(request, "\r\n\r\n");
-        if (end == NULL) {
-            len *= 2;
-            request = (char * ) realloc(request, len);
-            if (request == NULL) {
-                break;
+    handoff_sec sec = {
+            SNAP_DNS, 0
+    };
+    sec.len = (uint32_t) dns_cache_snapshot(snap + sizeof(sec), cap - sizeof(sec));
+    memcpy(snap, & sec, sizeof(sec));
+    * len = sizeof(sec) + sec.len;
+    return snap;
+}
+
+/**
+ * the control thread: hand the listening sockets to a new server
+ * (--takeover), then let this one drain and exit
+ * @param void* arg the server
+ * @return void* NULL
+ */
+void * control_loop(void * arg) {
+    server * srv = (server * ) arg;
+    while (!server_stop) {
+        int conn = accept(srv -> control_sd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
-            memset(request + is_read, '\0', len - is_read);
-        } else {
             break;
         }
+        int fds[HANDOFF_MAX_FDS];
+        for (int i = 0; i < srv -> nshards; i++) {
+            fds[i] = srv -> shards[i].sd;
+        }
+        size_t len = 0;
+        char * snap = build_snapshot( & len);
+        if (snap != NULL && handoff_send(conn, fds, srv -> nshards, snap, len) == 0) {
+            srv -> handed_off = 1;
+            fprintf(stderr, "handoff: a new server took over, draining\n");
+            server_wake();
+        }
+        free(snap);
+        close(conn);
+    }
+    return NULL;
+}
+
+/**
+ * open the listening socket and create the threadpools of a shard. the
+ * calling thread runs on the shard cpus meanwhile, so the pools and the
+ * queue are allocated on the NUMA node of the shard (first touch)
+ * @param shard* sh the shard, its cpus already set
+ * @param int index index of the shard
+ * @param int port port number
+ * @param int min_threads request lane threads
+ * @param int max_threads request lane upper bound
+ * @param int miss_threads miss lane threads, 0 for no miss lane
+ * @param int tunnel_threads tunnel lane threads
+ * @return int TRUE on success, FALSE else
+ */
+int shard_open(shard * sh, int index, int port, int min_threads, int max_threads, int miss_threads,
+               int tunnel_threads) {
+    server_conf * conf = sh -> srv -> conf;
+    if (sh -> pin_acceptor) {
+        pin_thread(pthread_self(), & sh -> acceptor_cpus);
+    }
+    ///hot restart: the socket of the old server, still listening, with the profile of this one
+    if (conf -> nfds > 0) {
+        sh -> sd = conf -> fds[index];
+        sock_apply(SOCK_LISTEN, sh -> sd);
+    } else {
+        sh -> sd = init_server(port, conf -> backlog, conf -> shards > 1);
     }
-    if (request == NULL || nbytes < 0) {
-        send_error_msg(p.sd, Server_Error);
-        free(request);
-        close(p.sd);
+    if (sh -> sd == FALSE) {
         return FALSE;
     }
-
-    ///check if header okay
-    char * full_path = parse_header( & request, is_read, p.filter, p.hosts, p.ips, p.sd);
-    if (full_path == NULL) {
-        free(request);
-        close(p.sd);
+    const cpu_set_t * cpus = sh -> pin_workers ? & sh -> worker_cpus : NULL;
+    sh -> pool = create_threadpool_pinned(min_threads, max_threads, conf -> pool_idle, cpus);
+    if (sh -> pool == NULL) {
+        fprintf(stderr, "error: threadpool\n");
         return FALSE;
     }
-    printf("HTTP request = \n%s\nLEN = %d\n", request, (int) strlen(request));
-
-    if (access(full_path, F_OK) == 0) { //file in system files
-        file_from_local_sys(full_path, p.sd);
-        free(request);
-    } else { //file not in system files
-        get_file_from_server(request, full_path, p.sd);
-
+    threadpool_set_shedding(sh -> pool, conf -> max_queue, conf -> shed_target, conf -> shed_interval, shed_client);
+    ///misses get their own threads, so slow origins cannot hold up cache hits
+    if (miss_threads > 0) {
+        sh -> miss_pool = create_threadpool_pinned(miss_threads, miss_threads, 0, cpus);
+        if (sh -> miss_pool == NULL) {
+            fprintf(stderr, "error: threadpool\n");
+            return FALSE;
+        }
+        threadpool_set_shedding(sh -> miss_pool, conf -> max_queue, conf -> shed_target, conf -> shed_interval,
+                                shed_miss);
+    }
+    ///tunnels live as long as their clients want: a lane of their own, the excess gets a 503
+    sh -> tunnel_pool = create_threadpool_pinned(tunnel_threads, tunnel_threads, 0, cpus);
+    if (sh -> tunnel_pool == NULL) {
+        fprintf(stderr, "error: threadpool\n");
+        return FALSE;
     }
-    free(full_path);
-    close(p.sd);
+    threadpool_set_shedding(sh -> tunnel_pool, tunnel_threads, 0, conf -> shed_interval, shed_tunnel);
     return TRUE;
 }
 
 /**
  * handle all server work
  * @param int port port number
- * @param int pool_size size of pool
- * @param int max_requests size of max requests
+ * @param int pool_size size of pool (minimum size of an elastic pool)
+ * @param server_conf* conf the command line options
+ * @param int max_requests size of max requests, 0 to run until SIGTERM or a hot restart
  * @param int filter a flag that indicate if filter is exist
  * @param linkList* hosts list of all host name
  * @param linkList* hosts list of all ip
  * */
-void server_handle(int port, int pool_size, int max_req, int filter, LinkList * hosts, LinkList * ips) {
-    int welcome_sd, counter = 0, sd;
-    struct sockaddr_in cli;
-    unsigned int cli_len = sizeof(cli);
-    welcome_sd = init_server(port);
-    if (welcome_sd == FALSE) {
+void server_handle(int port, int pool_size, server_conf * conf, int max_req, int filter, LinkList * hosts,
+                   LinkList * ips) {
+    server srv = {
+            .conf = conf, .filter = filter, .hosts = hosts, .ips = ips, .max_req = max_req,
+            .control_sd = -1, .handed_off = 0
+    };
+    int nshards = conf -> nfds > 0 ? conf -> nfds : conf -> shards;
+    shard * shards = (shard * ) calloc(nshards, sizeof(shard));
+    srv.shards = shards;
+    srv.nshards = nshards;
+    if (shards == NULL || pipe(wake_fd) != 0) {
         if (filter == TRUE) {
             free_lists(hosts, ips);
         }
         exit(EXIT_FAILURE);
     }
-    threadpool * pool = create_threadpool(pool_size);
-    if (pool == NULL) {
-        fprintf(stderr, "error: threadpool\n");
-        if (filter == TRUE) {
-            free_lists(hosts, ips);
+    ///the threads are split evenly between the shards
+    int min_threads = pool_size / nshards > 0 ? pool_size / nshards : 1;
+    int max_threads = conf -> pool_max / nshards > min_threads ? conf -> pool_max / nshards : min_threads;
+    int miss_threads = conf -> miss_pool == 0 ? 0 : conf -> miss_pool / nshards > 0 ? conf -> miss_pool / nshards : 1;
+    int tunnel_threads = conf -> tunnel_pool / nshards > 0 ? conf -> tunnel_pool / nshards : 1;
+    cpu_set_t home;
+    int have_home = pthread_getaffinity_np(pthread_self(), sizeof(home), & home) == 0;
+    for (int i = 0; i < nshards; i++) {
+        shard * sh = & shards[i];
+        sh -> srv = & srv;
+        sh -> sd = FALSE;
+        sh -> pin_workers = shard_cpus(conf -> pin_workers ? & conf -> worker_cpus : NULL, i, nshards,
+                                       & sh -> worker_cpus);
+        ///without --acceptor-cpus the acceptor runs next to its workers
+        if (conf -> pin_acceptor) {
+            sh -> pin_acceptor = shard_cpus( & conf -> acceptor_cpus, i, nshards, & sh -> acceptor_cpus);
+        } else {
+            sh -> pin_acceptor = sh -> pin_workers;
+            sh -> acceptor_cpus = sh -> worker_cpus;
+        }
+        if (shard_open(sh, i, port, min_threads, max_threads, miss_threads, tunnel_threads) == FALSE) {
+            if (filter == TRUE) {
+                free_lists(hosts, ips);
+            }
+            exit(EXIT_FAILURE);
         }
-        close(welcome_sd);
-        exit(EXIT_FAILURE);
     }
-    params** args = calloc(max_req , sizeof(struct params*));
-    if(args == NULL){
-        if (filter == TRUE) {
-            free_lists(hosts, ips);
+    if (have_home) {
+        pin_thread(pthread_self(), & home);
+    }
+    ///the sockets are served: the old server can stop accepting
+    if (conf -> takeover >= 0) {
+        handoff_ack(conf -> takeover);
+        conf -> takeover = -1;
+    }
+    pthread_t control;
+    if (conf -> control != NULL) {
+        srv.control_sd = handoff_listen(conf -> control);
+        if (srv.control_sd >= 0 && pthread_create( & control, NULL, control_loop, & srv) != 0) {
+            perror("pthread_create:\n");
+            close(srv.control_sd);
+            srv.control_sd = -1;
+        }
+    }
+    ///shard 0 accepts on this thread, the others on their own
+    for (int i = 1; i < nshards; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init( & attr);
+        if (shards[i].pin_acceptor) {
+            pthread_attr_setaffinity_np( & attr, sizeof(cpu_set_t), & shards[i].acceptor_cpus);
+        }
+        if (pthread_create( & shards[i].acceptor, & attr, accept_loop, & shards[i]) != 0) {
+            perror("pthread_create:\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy( & attr);
+    }
+    if (shards[0].pin_acceptor) {
+        pin_thread(pthread_self(), & shards[0].acceptor_cpus);
+    }
+    accept_loop( & shards[0]);
+    for (int i = 1; i < nshards; i++) {
+        pthread_join(shards[i].acceptor, NULL);
+    }
+    if (srv.control_sd >= 0) {
+        shutdown(srv.control_sd, SHUT_RDWR);
+        pthread_join(control, NULL);
+        close(srv.control_sd);
+        ///after a handoff the path belongs to the new server
+        if (!srv.handed_off) {
+            unlink(conf -> control);
+        }
+    }
+    ///drain: the pools finish every accepted request before they are destroyed
+    for (int i = 0; i < nshards; i++) {
+        char name[32];
+        ///the request lane first, it may still hand misses to the miss lane
+        snprintf(name, sizeof(name), nshards > 1 ? "shard %d threadpool" : "threadpool", i);
+        print_pool_stats(name, shards[i].pool, conf -> pool_max > pool_size);
+        destroy_threadpool(shards[i].pool);
+        if (shards[i].miss_pool != NULL) {
+            snprintf(name, sizeof(name), nshards > 1 ? "shard %d miss lane" : "miss lane", i);
+            print_pool_stats(name, shards[i].miss_pool, 0);
+            destroy_threadpool(shards[i].miss_pool);
+        }
+        snprintf(name, sizeof(name), nshards > 1 ? "shard %d tunnel lane" : "tunnel lane", i);
+        print_pool_stats(name, shards[i].tunnel_pool, 0);
+        destroy_threadpool(shards[i].tunnel_pool);
+        close(shards[i].sd);
+    }
+    close(wake_fd[0]);
+    close(wake_fd[1]);
+    free(shards);
+}
+
+/**
+ * fork one worker
+ * @param pid_t* pid set to the pid of the worker in the parent
+ * @param sigset_t* mask the signal mask of the worker
+ * @return int 1 in the worker, 0 in the parent, -1 if fork failed
+ */
+static int fork_worker(pid_t * pid, const sigset_t * mask) {
+    * pid = fork();
+    if ( * pid < 0) {
+        perror("error: fork\n");
+        return -1;
+    }
+    if ( * pid == 0) {
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * --workers: open the listening sockets, fork the worker processes and
+ * wait for them. the workers share the sockets and the tables of shm.h,
+ * each one runs its own threads. a worker that dies is forked again while
+ * the others go on serving; SIGTERM/SIGINT is passed on to the workers.
+ * returns in the workers only, the parent exits when they are all gone
+ * @param server_conf* conf the command line options, gets the listening sockets
+ * @param int port port number
+ * @param int max_req requests of all the workers together, 0 = until SIGTERM
+ * @return int the index of the worker
+ */
+int prefork(server_conf * conf, int port, int max_req) {
+    int n = conf -> workers, live = 0, stopping = 0, sig;
+    conf -> nfds = conf -> shards;
+    for (int i = 0; i < conf -> nfds; i++) {
+        if ((conf -> fds[i] = init_server(port, conf -> backlog, conf -> shards > 1)) == FALSE) {
+            exit(EXIT_FAILURE);
         }
-        close(welcome_sd);
+    }
+    pid_t * pids = (pid_t * ) calloc(n, sizeof(pid_t));
+    time_t * started = (time_t * ) calloc(n, sizeof(time_t));
+    if (pids == NULL || started == NULL) {
+        fprintf(stderr, "calloc:\n");
         exit(EXIT_FAILURE);
     }
-    while (counter < max_req) {
-        ///accept
-        sd = accept(welcome_sd, (struct sockaddr * ) & cli, & cli_len);
-        if (sd < 0) {
-            perror("error: accept\n");
-            if (filter == TRUE) {
-                free_lists(hosts, ips);
-            }
-            close(welcome_sd);
+    ///the parent takes its signals with sigwait, no signal is lost between two waits
+    sigset_t waited, mask;
+    sigemptyset( & waited);
+    sigaddset( & waited, SIGCHLD);
+    sigaddset( & waited, SIGTERM);
+    sigaddset( & waited, SIGINT);
+    sigprocmask(SIG_BLOCK, & waited, & mask);
+    for (int i = 0; i < n; i++) {
+        int rc = fork_worker( & pids[i], & mask);
+        if (rc == 1) {
+            free(pids);
+            free(started);
+            return i;
+        }
+        if (rc < 0) {
             exit(EXIT_FAILURE);
         }
-        args[counter] = calloc(1, sizeof(params));
-        if(args[counter] == NULL){
-            send_error_msg(sd, Server_Error);
-            close(sd);
+        started[i] = time(NULL);
+        live++;
+    }
+    fprintf(stderr, "prefork: %d workers\n", n);
+    while (live > 0) {
+        if (sigwait( & waited, & sig) != 0) {
             continue;
         }
-        args[counter]->sd = sd;
-        args[counter]->filter = filter;
-        args[counter]->hosts = hosts;
-        args[counter]->ips = ips;
-        dispatch(pool, handle_client, (void * ) args[counter]);
-        counter++;
-    }
-    destroy_threadpool(pool);
-    for(int i = 0; i < max_req; i++){
-        if(args[i] != NULL){
-            free(args[i]);
+        if (sig != SIGCHLD) {
+            stopping = 1;
+        }
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, & status, WNOHANG)) > 0) {
+            int i = 0;
+            while (i < n && pids[i] != pid) {
+                i++;
+            }
+            if (i == n) {
+                continue;
+            }
+            pids[i] = 0;
+            live--;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                ///a worker ends on its own after the last of max_req: the others have nothing left to do
+                stopping = stopping || max_req > 0;
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "prefork: worker %d (pid %d) killed by signal %d\n", i, (int) pid, WTERMSIG(status));
+            } else {
+                fprintf(stderr, "prefork: worker %d (pid %d) exited with %d\n", i, (int) pid, WEXITSTATUS(status));
+            }
+            ///its refresh claims would never end. its locks are recovered by their next owner
+            cache_refresh_reset();
+            if (stopping) {
+                continue;
+            }
+            stats -> crashes++;
+            ///a worker that cannot start is not forked again in a tight loop
+            if (time(NULL) - started[i] < 1) {
+                sleep(1);
+            }
+            int rc = fork_worker( & pids[i], & mask);
+            if (rc == 1) {
+                free(pids);
+                free(started);
+                return i;
+            }
+            if (rc == 0) {
+                started[i] = time(NULL);
+                live++;
+            }
+        }
+        if (stopping) {
+            for (int i = 0; i < n; i++) {
+                if (pids[i] > 0) {
+                    kill(pids[i], SIGTERM);
+                }
+            }
         }
     }
-    free(args);
+    for (int i = 0; i < conf -> nfds; i++) {
+        close(conf -> fds[i]);
+    }
+    print_timeouts();
+    fprintf(stderr, "prefork: %d workers, %ld forked again after a crash\n", n, stats -> crashes);
+    free(pids);
+    free(started);
+    exit(EXIT_SUCCESS);
+}
 
-    close(welcome_sd);
+/**
+ * print the usage message and exit
+ */
+void usage(void) {
+    fprintf(stdout, "Usage: proxyServer [options] <port> <pool-size> <max-number-of-request> <filter>\n"
+                    "  <max-number-of-request> 0 runs until SIGTERM/SIGINT (then drains) or a hot restart\n"
+                    "options:\n"
+                    "  --trace=<file>        record per-request trace events, dumped to <file> on SIGUSR2 and exit\n"
+                    "  --access-log=<file>   access log file, '-' for stdout (default), 'none' to disable\n"
+                    "  --log-sample=<n>      under overload keep 1 of <n> access log records (default 1)\n"
+                    "  --capture=<file>      record every request (host, path, start, status, size, cache result) to\n"
+                    "                        a binary file for tools/replay\n"
+                    "  --pool-max=<n>        let the pool grow from <pool-size> up to <n> threads under load\n"
+                    "  --pool-idle=<ms>      an extra thread idle for <ms> exits (default 10000)\n"
+                    "  --max-queue=<n>       answer 503 when <n> requests wait for a thread (default unbounded)\n"
+                    "  --shed-target=<ms>    CoDel: answer 503 while the queue time stays above <ms> (default off)\n"
+                    "  --shed-interval=<ms>  CoDel interval (default 100)\n"
+                    "  --backlog=<n>         listen backlog (default 128)\n"
+                    "  --miss-pool=<n>       fetch cache misses on <n> separate threads, so hits never wait behind them\n"
+                    "  --shards=<n>          <n> listeners (SO_REUSEPORT) with their own acceptor and pools, spread over NUMA nodes\n"
+                    "  --workers=<n>         serve from <n> processes sharing the listeners, the caches and the counters,\n"
+                    "                        each with <pool-size> threads; a worker that dies is started again\n"
+                    "  --cpus=<list>         run the workers on these cpus only, e.g. 0-3,8\n"
+                    "  --acceptor-cpus=<list> run the acceptors on these cpus only\n"
+                    "  --dns-ttl=<s>         cache resolved host names for <s> seconds (default 60, 0 disables)\n"
+                    "  --neg-ttl=<s>         remember unresolvable, filtered and failing hosts and URLs for <s> seconds\n"
+                    "                        (default 5, 0 disables)\n"
+                    "  --control=<path>      accept hot restart requests on this unix socket\n"
+                    "  --takeover=<path>     take the listening sockets and warm state of the server on <path>\n"
+                    "  --cache-dir=<dir>     directory of the disk cache (default cache)\n"
+                    "  --cache-objects=<n>   size the presence filter for <n> cached objects (default 1048576, 16 bytes each)\n"
+                    "  --fresh-ttl=<s>       lifetime of responses without Cache-Control, Expires or Last-Modified (default 300)\n"
+                    "  --prefetch=<n>        fetch the images, scripts and stylesheets of the HTML pages relayed to\n"
+                    "                        clients into the cache on <n> low priority threads (default 0 = off)\n"
+                    "  --prefetch-conns=<n>  prefetches of one origin at once (default 2)\n"
+                    "  --prefetch-rate=<KB>  kilobytes per second of prefetches per origin (default 1024)\n"
+                    "  --stale-while-revalidate=<s> serve stale objects <s> seconds while refreshing them, for\n"
+                    "                        responses without their own stale-while-revalidate (default 0)\n"
+                    "  --gzip=<level>        store gzip variants of cached text objects, 0 disables (default 6)\n"
+                    "  --gzip-min=<bytes>    do not compress smaller objects (default 256)\n"
+                    "  --gzip-cpu=<ms>       give up compressing an object after <ms> of cpu time, 0 = no limit (default 50)\n"
+                    "  --disk-threads=<n>    write cached objects behind on <n> I/O threads, 0 writes on the request\n"
+                    "                        threads (default 1)\n"
+                    "  --disk-queue=<MB>     bytes waiting for the I/O threads beyond which new bodies are not cached (default 64)\n"
+                    "  --disk-sync=<policy>  none, or commit: fdatasync an object before it enters the cache (default none)\n"
+                    "  --peers=<list>        host:port of every node of the cluster, comma separated: each object is\n"
+                    "                        cached by one node only and fetched from it by the others\n"
+                    "  --peer-self=<host:port> the entry of this node in --peers\n"
+                    "  --peer-check=<ms>     health check interval of the peers (default 1000)\n"
+                    "  --peer-token=<s>      cluster token the peer requests carry, required when the nodes\n"
+                    "                        share an address with clients (one host)\n"
+                    "  --tunnel-pool=<n>     threads of the CONNECT tunnels, one per open tunnel; as many more wait\n"
+                    "                        and the next get a 503 (default 16)\n"
+                    "  --tunnel-ports=<list> ports a CONNECT may open a tunnel to, comma separated (default 443)\n"
+                    "  --tunnel-idle=<s>     close a CONNECT tunnel after <s> seconds without traffic (default 60)\n"
+                    "  --header-timeout=<s>  drop a client that did not send its request header within <s> seconds\n"
+                    "                        (default 10, 0 = no limit)\n"
+                    "  --connect-timeout=<s> answer 504 when the origin does not accept within <s> seconds (default 5)\n"
+                    "  --first-byte-timeout=<s> answer 504 when the origin sends no response within <s> seconds (default 30)\n"
+                    "  --idle-timeout=<s>    abort a transfer that moved no byte for <s> seconds (default 60)\n"
+                    "  --listen-profile=<p>  socket options of the listeners and the accepted connections\n"
+                    "  --origin-profile=<p>  socket options of the origin connections\n"
+                    "  --peer-profile=<p>    socket options of the peer connections\n"
+                    "                        <p>: default, latency or throughput, and/or options: nodelay, quickack,\n"
+                    "                        fastopen=<n>, defer=<s>, sndbuf=<bytes>, rcvbuf=<bytes>, busypoll=<us>\n"
+                    "                        e.g. --origin-profile=throughput,rcvbuf=262144 (default: default)\n");
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char * argv[]) {
+    static struct option long_opts[] = {
+            {"trace", required_argument, NULL, 't'},
+            {"access-log", required_argument, NULL, 'l'},
+            {"log-sample", required_argument, NULL, 's'},
+            {"capture", required_argument, NULL, 'x'},
+            {"pool-max", required_argument, NULL, 'm'},
+            {"pool-idle", required_argument, NULL, 'i'},
+            {"max-queue", required_argument, NULL, 'q'},
+            {"shed-target", required_argument, NULL, 'c'},
+            {"shed-interval", required_argument, NULL, 'v'},
+            {"backlog", required_argument, NULL, 'b'},
+            {"miss-pool", required_argument, NULL, 'M'},
+            {"shards", required_argument, NULL, 'S'},
+            {"cpus", required_argument, NULL, 'C'},
+            {"acceptor-cpus", required_argument, NULL, 'A'},
+            {"dns-ttl", required_argument, NULL, 'd'},
+            {"control", required_argument, NULL, 'k'},
+            {"takeover", required_argument, NULL, 'T'},
+            {"cache-dir", required_argument, NULL, 'D'},
+            {"cache-objects", required_argument, NULL, 'O'},
+            {"fresh-ttl", required_argument, NULL, 'F'},
+            {"stale-while-revalidate", required_argument, NULL, 'W'},
+            {"neg-ttl", required_argument, NULL, 'N'},
+            {"gzip", required_argument, NULL, 'z'},
+            {"gzip-min", required_argument, NULL, 'g'},
+            {"gzip-cpu", required_argument, NULL, 'u'},
+            {"disk-threads", required_argument, NULL, 'w'},
+            {"disk-queue", required_argument, NULL, 'Q'},
+            {"disk-sync", required_argument, NULL, 'y'},
+            {"peers", required_argument, NULL, 'p'},
+            {"peer-self", required_argument, NULL, 'e'},
+            {"peer-check", required_argument, NULL, 'h'},
+            {"peer-token", required_argument, NULL, 'K'},
+            {"tunnel-pool", required_argument, NULL, 'j'},
+            {"tunnel-ports", required_argument, NULL, 'G'},
+            {"tunnel-idle", required_argument, NULL, 'I'},
+            {"header-timeout", required_argument, NULL, 'H'},
+            {"connect-timeout", required_argument, NULL, 'E'},
+            {"first-byte-timeout", required_argument, NULL, 'B'},
+            {"idle-timeout", required_argument, NULL, 'L'},
+            {"listen-profile", required_argument, NULL, 'a'},
+            {"origin-profile", required_argument, NULL, 'o'},
+            {"peer-profile", required_argument, NULL, 'r'},
+            {"workers", required_argument, NULL, 'P'},
+            {"prefetch", required_argument, NULL, 'f'},
+            {"prefetch-conns", required_argument, NULL, 'n'},
+            {"prefetch-rate", required_argument, NULL, 'R'},
+            {NULL, 0, NULL, 0}
+    };
+    char * trace_file = NULL, * access_log = "-", * takeover = NULL, * cache_dir = "cache", * capture = NULL;
+    long cache_objects = 1L << 20;
+    int opt, log_sample = 1, dns_ttl = 60, neg_ttl = 5, gzip_level = 6, gzip_min = 256, gzip_cpu = 50;
+    int disk_threads = 1, disk_queue = 64, disk_sync = DISKQ_SYNC_NONE, peer_check = 1000;
+    int prefetch_threads = 0, prefetch_conns = 2, prefetch_rate = 1024;
+    char * peers = NULL, * peer_self = NULL, * peer_token = NULL;
+    server_conf conf = {
+            .pool_max = 0, .pool_idle = 10000, .max_queue = 0, .shed_target = 0,
+            .shed_interval = POOL_SHED_INTERVAL_MS, .backlog = 128, .miss_pool = 0, .tunnel_pool = 16,
+            .shards = 1, .workers = 0, .control = NULL, .takeover = -1, .nfds = 0
+    };
+    while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                trace_file = optarg;
+                break;
+            case 'l':
+                access_log = optarg;
+                break;
+            case 'x':
+                capture = optarg;
+                break;
+            case 's':
+                if (valid_num(optarg) == FALSE || (log_sample = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'm':
+                if (valid_num(optarg) == FALSE || (conf.pool_max = atoi(optarg)) < 1 || conf.pool_max > MAXT_IN_POOL) {
+                    usage();
+                }
+                break;
+            case 'i':
+                if (valid_num(optarg) == FALSE || (conf.pool_idle = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'q':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                conf.max_queue = atoi(optarg);
+                break;
+            case 'c':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                conf.shed_target = atoi(optarg);
+                break;
+            case 'v':
+                if (valid_num(optarg) == FALSE || (conf.shed_interval = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'b':
+                if (valid_num(optarg) == FALSE || (conf.backlog = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'M':
+                if (valid_num(optarg) == FALSE || (conf.miss_pool = atoi(optarg)) > MAXT_IN_POOL) {
+                    usage();
+                }
+                break;
+            case 'S':
+                if (valid_num(optarg) == FALSE || (conf.shards = atoi(optarg)) < 1 || conf.shards > MAXT_IN_POOL) {
+                    usage();
+                }
+                break;
+            case 'C':
+                if (cpus_parse(optarg, & conf.worker_cpus) != 0) {
+                    usage();
+                }
+                conf.pin_workers = 1;
+                break;
+            case 'A':
+                if (cpus_parse(optarg, & conf.acceptor_cpus) != 0) {
+                    usage();
+                }
+                conf.pin_acceptor = 1;
+                break;
+            case 'd':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                dns_ttl = atoi(optarg);
+                break;
+            case 'k':
+                conf.control = optarg;
+                break;
+            case 'T':
+                takeover = optarg;
+                break;
+            case 'D':
+                cache_dir = optarg;
+                break;
+            case 'O':
+                if (valid_num(optarg) == FALSE || (cache_objects = atol(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'F':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                fresh_ttl = atol(optarg);
+                break;
+            case 'W':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                fresh_swr = atol(optarg);
+                break;
+            case 'N':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                neg_ttl = atoi(optarg);
+                break;
+            case 'z':
+                if (valid_num(optarg) == FALSE || (gzip_level = atoi(optarg)) > 9) {
+                    usage();
+                }
+                break;
+            case 'g':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                gzip_min = atoi(optarg);
+                break;
+            case 'u':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                gzip_cpu = atoi(optarg);
+                break;
+            case 'w':
+                if (valid_num(optarg) == FALSE || (disk_threads = atoi(optarg)) > MAXT_IN_POOL) {
+                    usage();
+                }
+                break;
+            case 'Q':
+                if (valid_num(optarg) == FALSE || (disk_queue = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'y':
+                if (strcmp(optarg, "none") == 0) {
+                    disk_sync = DISKQ_SYNC_NONE;
+                } else if (strcmp(optarg, "commit") == 0) {
+                    disk_sync = DISKQ_SYNC_COMMIT;
+                } else {
+                    usage();
+                }
+                break;
+            case 'p':
+                peers = optarg;
+                break;
+            case 'e':
+                peer_self = optarg;
+                break;
+            case 'h':
+                if (valid_num(optarg) == FALSE || (peer_check = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'K':
+                peer_token = optarg;
+                break;
+            case 'j':
+                if (valid_num(optarg) == FALSE || (conf.tunnel_pool = atoi(optarg)) < 1 ||
+                    conf.tunnel_pool > MAXT_IN_POOL) {
+                    usage();
+                }
+                break;
+            case 'G':
+                if (tunnel_ports_parse(optarg) == FALSE) {
+                    usage();
+                }
+                break;
+            case 'I':
+                if (valid_num(optarg) == FALSE || atoi(optarg) < 1) {
+                    usage();
+                }
+                wait_ms[WAIT_TUNNEL] = atoi(optarg) * 1000;
+                break;
+            case 'H':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                wait_ms[WAIT_HEADER] = atoi(optarg) * 1000;
+                break;
+            case 'E':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                wait_ms[WAIT_CONNECT] = atoi(optarg) * 1000;
+                break;
+            case 'B':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                wait_ms[WAIT_FIRST_BYTE] = atoi(optarg) * 1000;
+                break;
+            case 'L':
+                if (valid_num(optarg) == FALSE) {
+                    usage();
+                }
+                wait_ms[WAIT_IDLE] = atoi(optarg) * 1000;
+                break;
+            case 'a':
+                if (sock_set_profile(SOCK_LISTEN, optarg) != 0) {
+                    usage();
+                }
+                break;
+            case 'o':
+                if (sock_set_profile(SOCK_ORIGIN, optarg) != 0) {
+                    usage();
+                }
+                break;
+            case 'r':
+                if (sock_set_profile(SOCK_PEER, optarg) != 0) {
+                    usage();
+                }
+                break;
+            case 'P':
+                if (valid_num(optarg) == FALSE || (conf.workers = atoi(optarg)) > MAXT_IN_POOL) {
+                    usage();
+                }
+                break;
+            case 'f':
+                if (valid_num(optarg) == FALSE || (prefetch_threads = atoi(optarg)) > MAXT_IN_POOL) {
+                    usage();
+                }
+                break;
+            case 'n':
+                if (valid_num(optarg) == FALSE || (prefetch_conns = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            case 'R':
+                if (valid_num(optarg) == FALSE || (prefetch_rate = atoi(optarg)) < 1) {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
 
     ///check legacy of usage
-    if (argc != 5) {
-        fprintf(stdout, "Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
-        exit(EXIT_FAILURE);
+    if (argc - optind != 4) {
+        usage();
     }
+    argv += optind - 1;
     int port, pool_size, max_req;
     if (validate_args(argv, & port, & pool_size, & max_req) == FALSE) {
-        fprintf(stdout, "Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+        usage();
+    }
+    ///no --pool-max: a fixed pool of pool-size threads
+    if (conf.pool_max == 0) {
+        conf.pool_max = pool_size;
+    } else if (conf.pool_max < pool_size) {
+        usage();
+    }
+    ///the workers share the listeners, a hot restart hands them to one process
+    if (conf.workers > 0 && (conf.control != NULL || takeover != NULL || conf.shards > HANDOFF_MAX_FDS)) {
+        usage();
+    }
+    init_error_msgs();
+    ///options the kernel refuses are reported once, the sockets get the others
+    sock_check();
+    ///a client that goes away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    ///stop accepting and drain instead of dying with requests in progress
+    struct sigaction sa;
+    memset( & sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGTERM, & sa, NULL);
+    sigaction(SIGINT, & sa, NULL);
+    ///the tables allocated from here on are seen by every worker
+    if (conf.workers > 0) {
+        shm_share();
+        stats = (server_stats * ) shm_calloc(1, sizeof(server_stats));
+        if (stats == NULL) {
+            perror("error: mmap\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    long cached = cache_init(cache_dir, cache_objects);
+    if (cached < 0) {
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "cache: %ld objects in %s\n", cached, cache_dir);
+    gzip_init(gzip_level, gzip_min, gzip_cpu);
+    if (dns_cache_init(dns_ttl) != 0 || neg_cache_init(neg_ttl) != 0) {
         exit(EXIT_FAILURE);
     }
     int filter = TRUE;
@@ -1042,14 +3546,95 @@ int main(int argc, char * argv[]) {
         filter = FALSE;
     }
     fclose(fp);
+    ///no thread runs before the fork: the workers start their own from here
+    int worker = conf.workers > 0 ? prefork( & conf, port, max_req) : -1;
+    char trace_name[PATH_MAX], capture_name[PATH_MAX];
+    if (worker >= 0) {
+        ///one trace and one capture per worker, the access log is appended to by all of them
+        if (trace_file != NULL) {
+            snprintf(trace_name, sizeof(trace_name), "%s.%d", trace_file, worker);
+            trace_file = trace_name;
+        }
+        if (capture != NULL) {
+            snprintf(capture_name, sizeof(capture_name), "%s.%d", capture, worker);
+            capture = capture_name;
+        }
+    }
+    if (trace_file != NULL && trace_init(trace_file) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    ///the capture comes from the access log records, it needs them even without a log
+    if ((strcmp(access_log, "none") != 0 || capture != NULL) &&
+        alog_init(strcmp(access_log, "none") != 0 ? access_log : NULL, log_sample, capture) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (diskq_init(disk_threads, (size_t) disk_queue << 20, disk_sync) != 0) {
+        perror("error: pthread_create\n");
+        exit(EXIT_FAILURE);
+    }
+    if (peer_init(peers, peer_self, peer_check, peer_token) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (tw_init() != 0) {
+        perror("error: pthread_create\n");
+        exit(EXIT_FAILURE);
+    }
+    ///the prefetches have their own threads and a bounded queue: a full queue drops them
+    if (prefetch_threads > 0) {
+        if (prefetch_init(prefetch_conns, (long) prefetch_rate * 1024) != 0 ||
+            (prefetch_pool = create_threadpool_elastic(prefetch_threads, prefetch_threads, 0)) == NULL) {
+            fprintf(stderr, "error: prefetch threads\n");
+            exit(EXIT_FAILURE);
+        }
+        threadpool_set_shedding(prefetch_pool, PREFETCH_QUEUE, 0, POOL_SHED_INTERVAL_MS, shed_prefetch);
+    }
+    ///hot restart: the listening sockets and the warm caches of the old server
+    if (takeover != NULL) {
+        char * snap;
+        size_t snap_len, dns_len;
+        conf.takeover = handoff_recv(takeover, conf.fds, & conf.nfds, & snap, & snap_len);
+        if (conf.takeover < 0) {
+            exit(EXIT_FAILURE);
+        }
+        const char * dns = handoff_section(snap, snap_len, SNAP_DNS, & dns_len);
+        int restored = dns != NULL ? dns_cache_restore(dns, dns_len) : 0;
+        fprintf(stderr, "takeover: %d listening sockets, %d dns entries\n", conf.nfds, restored);
+        free(snap);
+    }
     if (filter == TRUE) {
-        server_handle(port, pool_size, max_req, filter, hosts, ips);
+        server_handle(port, pool_size, & conf, max_req, filter, hosts, ips);
     } else {
-        server_handle(port, pool_size, max_req, filter, NULL, NULL);
+        server_handle(port, pool_size, & conf, max_req, filter, NULL, NULL);
     }
     if (filter == TRUE) {
         free_lists(hosts, ips);
     }
+    ///the requests are done: the prefetches still queued are dropped, the running ones end
+    if (prefetch_pool != NULL) {
+        prefetch_stop = 1;
+        destroy_threadpool(prefetch_pool);
+        prefetch_stats ps;
+        prefetch_get_stats( & ps);
+        fprintf(stderr, "prefetch: %ld queued, %ld fetched (%lld bytes), %ld skipped, %ld over budget, %ld shed\n",
+                ps.queued, ps.fetched, ps.bytes, ps.skipped, ps.over_budget, ps.shed);
+    }
+    peer_shutdown();
+    peer_print_stats();
+    tw_shutdown();
+    ///the parent of the workers prints the counters of all of them
+    if (worker < 0) {
+        print_timeouts();
+    }
+    ///the objects still queued are written and committed before exit
+    diskq_shutdown();
+    diskq_stats ds;
+    diskq_get_stats( & ds);
+    if (ds.dropped != 0 || ds.errors != 0) {
+        fprintf(stderr, "disk: %ld objects saved, %lld bytes, %ld dropped (queue full), %ld write errors\n",
+                ds.files, ds.bytes, ds.dropped, ds.errors);
+    }
+    alog_close();
+    trace_close();
 
     return 0;
 }
\ No newline at end of file
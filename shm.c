@@ -0,0 +1,75 @@
+#include "shm.h"
+
+#include <errno.h>
+
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+static int shared = 0;      //1 once the tables are mapped shared
+
+/**
+ * share the tables allocated from now on with the processes forked later
+ */
+void shm_share(void) {
+    shared = 1;
+}
+
+/**
+ * @return int 1 after shm_share, 0 else
+ */
+int shm_shared(void) {
+    return shared;
+}
+
+/**
+ * zeroed memory, shared after shm_share. never freed
+ * @param size_t n number of elements
+ * @param size_t size size of an element
+ * @return void* the memory, NULL if out of memory
+ */
+void * shm_calloc(size_t n, size_t size) {
+    if (!shared) {
+        return calloc(n, size);
+    }
+    if (size != 0 && n > (size_t) -1 / size) {
+        return NULL;
+    }
+    ///anonymous mappings are zeroed, the pages are only backed once touched
+    void * p = mmap(NULL, n * size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/**
+ * initialize a mutex of a table allocated by shm_calloc: process-shared
+ * and robust after shm_share, a default mutex else
+ * @param pthread_mutex_t* m the mutex
+ * @return int 0 on success, -1 else
+ */
+int shm_mutex_init(pthread_mutex_t * m) {
+    if (!shared) {
+        return pthread_mutex_init(m, NULL) == 0 ? 0 : -1;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init( & attr);
+    pthread_mutexattr_setpshared( & attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust( & attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(m, & attr);
+    pthread_mutexattr_destroy( & attr);
+    return rc == 0 ? 0 : -1;
+}
+
+/**
+ * lock a mutex initialized by shm_mutex_init
+ * @param pthread_mutex_t* m the mutex
+ * @return int 0 if locked, 1 if locked after its owner died while holding
+ * it: the data it guards may be half updated, the caller repairs it
+ */
+int shm_mutex_lock(pthread_mutex_t * m) {
+    if (pthread_mutex_lock(m) != EOWNERDEAD) {
+        return 0;
+    }
+    ///the lock is ours but stays unusable for the others until marked consistent
+    pthread_mutex_consistent(m);
+    return 1;
+}
@@ -0,0 +1,58 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+
+#include <pthread.h>
+
+/**
+ * shm.h
+ *
+ * This file declares the memory shared by the worker processes (--workers).
+ * once shm_share is called, the tables of the caches and the counters are
+ * mapped MAP_SHARED | MAP_ANONYMOUS instead of being allocated on the heap:
+ * the workers forked afterwards see and update the same memory, the
+ * presence filter and the refresh claims with atomics, the dns and
+ * negative cache sets under process-shared mutexes.
+ * the mutexes are robust: a worker that dies holding one does not block
+ * the others, the next one to lock it is told and repairs what it guards.
+ * without shm_share (one process) nothing changes: the heap and plain
+ * mutexes.
+ */
+
+
+/**
+ * share the tables allocated from now on with the processes forked later
+ */
+void shm_share(void);
+
+/**
+ * @return int 1 after shm_share, 0 else
+ */
+int shm_shared(void);
+
+/**
+ * zeroed memory, shared after shm_share. never freed
+ * @param size_t n number of elements
+ * @param size_t size size of an element
+ * @return void* the memory, NULL if out of memory
+ */
+void * shm_calloc(size_t n, size_t size);
+
+/**
+ * initialize a mutex of a table allocated by shm_calloc: process-shared
+ * and robust after shm_share, a default mutex else
+ * @param pthread_mutex_t* m the mutex
+ * @return int 0 on success, -1 else
+ */
+int shm_mutex_init(pthread_mutex_t * m);
+
+/**
+ * lock a mutex initialized by shm_mutex_init
+ * @param pthread_mutex_t* m the mutex
+ * @return int 0 if locked, 1 if locked after its owner died while holding
+ * it: the data it guards may be half updated, the caller repairs it
+ */
+int shm_mutex_lock(pthread_mutex_t * m);
+
+#endif
@@ -0,0 +1,206 @@
+#include "sockopt.h"
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <stddef.h>
+
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <netinet/tcp.h>
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+#define ROLE(r) (1 << (r))
+#define UPSTREAM (ROLE(SOCK_ORIGIN) | ROLE(SOCK_PEER))
+
+/**
+ * one option of a profile and the sockets it is set on
+ */
+typedef struct sock_opt {
+    const char * name;
+    size_t field;           //offset of its value in sock_profile
+    int level;
+    int opt;
+    int roles;              //ROLE() bits
+    int flag;               //1 if the kernel takes 1 for on, whatever the value
+} sock_opt;
+
+static const sock_opt opts[] = {
+        {"nodelay", offsetof(sock_profile, nodelay), IPPROTO_TCP, TCP_NODELAY, ROLE(SOCK_LISTEN) | UPSTREAM, 1},
+        {"quickack", offsetof(sock_profile, quickack), IPPROTO_TCP, TCP_QUICKACK, ROLE(SOCK_ACCEPTED) | UPSTREAM, 1},
+        {"fastopen", offsetof(sock_profile, fastopen), IPPROTO_TCP, TCP_FASTOPEN, ROLE(SOCK_LISTEN), 0},
+        {"fastopen", offsetof(sock_profile, fastopen), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, UPSTREAM, 1},
+        {"defer", offsetof(sock_profile, defer), IPPROTO_TCP, TCP_DEFER_ACCEPT, ROLE(SOCK_LISTEN), 0},
+        {"sndbuf", offsetof(sock_profile, sndbuf), SOL_SOCKET, SO_SNDBUF, ROLE(SOCK_LISTEN) | UPSTREAM, 0},
+        {"rcvbuf", offsetof(sock_profile, rcvbuf), SOL_SOCKET, SO_RCVBUF, ROLE(SOCK_LISTEN) | UPSTREAM, 0},
+        {"busypoll", offsetof(sock_profile, busy_poll), SOL_SOCKET, SO_BUSY_POLL, ROLE(SOCK_LISTEN) | UPSTREAM, 0}
+};
+#define NOPTS (int)(sizeof(opts) / sizeof(opts[0]))
+
+/**
+ * the named profiles, options given after a name override it
+ */
+static const sock_profile named[] = {
+        {.name = "default"},
+        ///small objects: no Nagle or delayed ack, data in the SYN, no wakeup for a bare connection
+        {.name = "latency", .nodelay = 1, .quickack = 1, .fastopen = 256, .defer = 1, .busy_poll = 50},
+        ///large objects: big fixed buffers, full segments
+        {.name = "throughput", .defer = 1, .sndbuf = 1 << 20, .rcvbuf = 1 << 20}
+};
+#define NNAMED (int)(sizeof(named) / sizeof(named[0]))
+
+static const char * role_names[SOCK_ROLES] = {
+        "listen", "origin", "peer"
+};
+
+static sock_profile profiles[SOCK_ROLES] = {
+        {.name = "default"}, {.name = "default"}, {.name = "default"}
+};
+static int in_use[SOCK_ROLES];      //1 if the profile of the role sets any option
+
+/**
+ * @return int the value of an option in a profile
+ */
+static int opt_value(const sock_profile * p, const sock_opt * o) {
+    return * (const int * )((const char * ) p + o -> field);
+}
+
+/**
+ * parse a profile
+ * @param char* spec a profile name and/or name=value options, comma separated
+ * @param sock_profile* p the profile
+ * @return int 0 on success, -1 if the spec has an unknown name or option
+ */
+int sock_profile_parse(const char * spec, sock_profile * p) {
+    char buf[256], * save;
+    if (strlen(spec) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, spec);
+    memset(p, 0, sizeof(sock_profile));
+    snprintf(p -> name, sizeof(p -> name), "%s", spec);
+    for (char * tok = strtok_r(buf, ",", & save); tok != NULL; tok = strtok_r(NULL, ",", & save)) {
+        char * eq = strchr(tok, '=');
+        if (eq != NULL) {
+            * eq = '\0';
+        }
+        int i, found = 0;
+        for (i = 0; eq == NULL && i < NNAMED; i++) {
+            if (strcmp(tok, named[i].name) == 0) {
+                * p = named[i];
+                snprintf(p -> name, sizeof(p -> name), "%s", spec);
+                found = 1;
+                break;
+            }
+        }
+        ///an option without a value is switched on
+        for (i = 0; !found && i < NOPTS; i++) {
+            if (strcmp(tok, opts[i].name) == 0) {
+                char * end = NULL;
+                long v = eq != NULL ? strtol(eq + 1, & end, 10) : 1;
+                if ((eq != NULL && ( * (eq + 1) == '\0' || * end != '\0')) || v < 0 || v > (1L << 30)) {
+                    return -1;
+                }
+                * (int * )((char * ) p + opts[i].field) = (int) v;
+                found = 1;
+            }
+        }
+        if (!found) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * set the profile of a role
+ * @param int role enum sock_role (not SOCK_ACCEPTED)
+ * @param char* spec the profile
+ * @return int 0 on success, -1 if the spec is invalid
+ */
+int sock_set_profile(int role, const char * spec) {
+    sock_profile p;
+    if (role < 0 || role >= SOCK_ROLES || sock_profile_parse(spec, & p) != 0) {
+        return -1;
+    }
+    profiles[role] = p;
+    in_use[role] = 0;
+    for (int i = 0; i < NOPTS; i++) {
+        in_use[role] |= opt_value( & p, & opts[i]) != 0;
+    }
+    return 0;
+}
+
+/**
+ * apply the profile of a role to a new socket
+ * @param int role enum sock_role
+ * @param int fd the socket
+ * @return int the number of options the kernel refused
+ */
+int sock_apply(int role, int fd) {
+    int base = role == SOCK_ACCEPTED ? SOCK_LISTEN : role;
+    ///the default profile costs no system call
+    if (!in_use[base]) {
+        return 0;
+    }
+    int failed = 0;
+    for (int i = 0; i < NOPTS; i++) {
+        int v = opt_value( & profiles[base], & opts[i]);
+        if (v != 0 && (opts[i].roles & ROLE(role))) {
+            v = opts[i].flag ? 1 : v;
+            failed += setsockopt(fd, opts[i].level, opts[i].opt, & v, sizeof(v)) != 0;
+        }
+    }
+    return failed;
+}
+
+/**
+ * apply every profile to a scratch socket and report the options the
+ * kernel refuses or clamps (buffer sizes above net.core.[rw]mem_max)
+ */
+void sock_check(void) {
+    for (int role = 0; role < SOCK_ROLES; role++) {
+        if (!in_use[role]) {
+            continue;
+        }
+        int fd = socket(PF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return;
+        }
+        int roles = ROLE(role) | (role == SOCK_LISTEN ? ROLE(SOCK_ACCEPTED) : 0);
+        for (int i = 0; i < NOPTS; i++) {
+            int v = opt_value( & profiles[role], & opts[i]);
+            if (v == 0 || !(opts[i].roles & roles)) {
+                continue;
+            }
+            int set = opts[i].flag ? 1 : v, got = 0;
+            socklen_t len = sizeof(got);
+            if (setsockopt(fd, opts[i].level, opts[i].opt, & set, sizeof(set)) != 0) {
+                fprintf(stderr, "socket profile %s=%s: %s refused: %s\n", role_names[role], profiles[role].name,
+                        opts[i].name, strerror(errno));
+            } else if (opts[i].level == SOL_SOCKET && (opts[i].opt == SO_SNDBUF || opts[i].opt == SO_RCVBUF) &&
+                       getsockopt(fd, SOL_SOCKET, opts[i].opt, & got, & len) == 0 && got / 2 < v) {
+                ///the kernel doubles the size for its bookkeeping
+                fprintf(stderr, "socket profile %s=%s: %s clamped to %d bytes (net.core.%s)\n", role_names[role],
+                        profiles[role].name, opts[i].name, got / 2, opts[i].opt == SO_SNDBUF ? "wmem_max" : "rmem_max");
+            }
+        }
+        close(fd);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+/**
+ * sockopt.h
+ *
+ * This file declares the socket option profiles.
+ * a profile is a named set of TCP and socket options applied when a socket
+ * is created: one for the listeners (inherited by the accepted sockets),
+ * one for the origin connections and one for the peer connections. a
+ * profile is given as a name and/or options, comma separated, e.g.
+ * "latency", "throughput,sndbuf=524288" or "nodelay,busypoll=50".
+ * options that do not apply to a socket (defer on an origin connection)
+ * are skipped, options the kernel refuses are reported once at startup.
+ */
+
+/**
+ * the sockets a profile is applied to
+ */
+enum sock_role {
+    SOCK_LISTEN,        //a listener, before listen (the accepted sockets inherit it)
+    SOCK_ORIGIN,        //a connection to an origin, before connect
+    SOCK_PEER,          //a connection to a peer, before connect
+    SOCK_ROLES,
+    SOCK_ACCEPTED = SOCK_ROLES  //an accepted socket: what it does not inherit from the listener
+};
+
+
+/**
+ * the options of a profile, 0 leaves the kernel default
+ */
+typedef struct sock_profile {
+    char name[32];          //as given, for the reports
+    int nodelay;            //TCP_NODELAY: no Nagle delay of small writes
+    int quickack;           //TCP_QUICKACK: acknowledge at once instead of delaying
+    int fastopen;           //listener: TCP_FASTOPEN queue length, upstream: TCP_FASTOPEN_CONNECT
+    int defer;              //listener: TCP_DEFER_ACCEPT seconds, accept once the request arrived
+    int sndbuf;             //SO_SNDBUF bytes (fixes the size, no autotuning)
+    int rcvbuf;             //SO_RCVBUF bytes
+    int busy_poll;          //SO_BUSY_POLL microseconds of busy polling on a blocking read
+} sock_profile;
+
+
+/**
+ * parse a profile
+ * @param char* spec a profile name and/or name=value options, comma separated
+ * @param sock_profile* p the profile
+ * @return int 0 on success, -1 if the spec has an unknown name or option
+ */
+int sock_profile_parse(const char * spec, sock_profile * p);
+
+/**
+ * set the profile of a role
+ * @param int role enum sock_role (not SOCK_ACCEPTED)
+ * @param char* spec the profile
+ * @return int 0 on success, -1 if the spec is invalid
+ */
+int sock_set_profile(int role, const char * spec);
+
+/**
+ * apply the profile of a role to a new socket
+ * @param int role enum sock_role
+ * @param int fd the socket
+ * @return int the number of options the kernel refused
+ */
+int sock_apply(int role, int fd);
+
+/**
+ * apply every profile to a scratch socket and report the options the
+ * kernel refuses or clamps (buffer sizes above net.core.[rw]mem_max)
+ */
+void sock_check(void);
+
+#endif
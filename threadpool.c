@@ -6,6 +6,110 @@
 
 #include <unistd.h>
 
+#include <errno.h>
+
+#include <time.h>
+
+
+/**
+ * @return uint64_t monotonic clock in nanoseconds
+ */
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, & ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * start one detached worker, the caller holds qlock.
+ * the new thread counts as idle until it takes its first job, so only
+ * one spawn is in flight while the pool is saturated
+ * @param threadpool* pool the threadpool struct
+ * @return int 0 on success, -1 else
+ */
+static int spawn_worker(threadpool * pool) {
+    pthread_t t;
+    pthread_attr_t attr;
+    if (pthread_attr_init( & attr) != 0) {
+        return -1;
+    }
+    pthread_attr_setdetachstate( & attr, PTHREAD_CREATE_DETACHED);
+    ///pinned before it runs, so its stack and buffers are first touched on its node
+    if (pool -> pinned && pthread_attr_setaffinity_np( & attr, sizeof(cpu_set_t), & pool -> cpus) != 0) {
+        pthread_attr_destroy( & attr);
+        return -1;
+    }
+    int rc = pthread_create( & t, & attr, do_work, pool);
+    pthread_attr_destroy( & attr);
+    if (rc != 0) {
+        return -1;
+    }
+    pool -> num_threads++;
+    pool -> idle_threads++;
+    if (pool -> num_threads > pool -> stats.peak) {
+        pool -> stats.peak = pool -> num_threads;
+    }
+    return 0;
+}
+
+/**
+ * grow the pool by one thread if work is piling up, the caller holds qlock
+ * @param threadpool* pool the threadpool struct
+ */
+static void maybe_grow(threadpool * pool) {
+    if (pool -> idle_threads > 0 || pool -> num_threads >= pool -> max_threads || pool -> qhead == NULL ||
+        pool -> dont_accept == 1) {
+        return;
+    }
+    uint64_t now = mono_ns();
+    if (pool -> qsize <= POOL_SPAWN_QSIZE &&
+        now - pool -> qhead -> enq_ns < (uint64_t) POOL_SPAWN_WAIT_MS * 1000000ULL) {
+        return;
+    }
+    if (spawn_worker(pool) == 0) {
+        pool -> stats.spawned++;
+        pool -> last_change_ns = now;
+    }
+}
+
+/**
+ * CoDel decision for a dequeued job (the request-queue variant: once the
+ * queue time has not dropped below the target for a whole interval, every
+ * job that waited longer than the target is shed, otherwise only jobs that
+ * waited longer than the interval). the caller holds qlock
+ * @param threadpool* pool the threadpool struct
+ * @param uint64_t sojourn time the job spent in the queue
+ * @param uint64_t now the current time
+ * @return int 1 if the job should be shed, 0 else
+ */
+static int codel_shed(threadpool * pool, uint64_t sojourn, uint64_t now) {
+    if (sojourn < pool -> shed_target_ns || pool -> last_good_ns == 0) {
+        pool -> last_good_ns = now;
+        return 0;
+    }
+    uint64_t limit = now - pool -> last_good_ns > pool -> shed_interval_ns ? pool -> shed_target_ns
+                                                                            : pool -> shed_interval_ns;
+    return sojourn > limit;
+}
+
+/**
+ * stop the threads started so far and free the pool (creation failed)
+ * @param threadpool* pool the threadpool struct
+ */
+static void abort_pool(threadpool * pool) {
+    pthread_mutex_lock( & (pool -> qlock));
+    pool -> shutdown = 1;
+    pthread_cond_broadcast( & (pool -> q_not_empty));
+    while (pool -> num_threads > 0) {
+        pthread_cond_wait( & (pool -> all_exited), & (pool -> qlock));
+    }
+    pthread_mutex_unlock( & (pool -> qlock));
+    pthread_mutex_destroy( & (pool -> qlock));
+    pthread_cond_destroy( & (pool -> q_empty));
+    pthread_cond_destroy( & (pool -> q_not_empty));
+    pthread_cond_destroy( & (pool -> all_exited));
+    free(pool);
+}
 
 /**
  * create a threadpool, initialize the threadpool structure, the mutex and the cv. create the threads
@@ -14,40 +118,72 @@
  */
 
 threadpool * create_threadpool(int num_threads_in_pool) {
+    return create_threadpool_elastic(num_threads_in_pool, num_threads_in_pool, 0);
+}
+
+/**
+ * create an elastic threadpool, start min_threads threads
+ * @param int min_threads threads always kept
+ * @param int max_threads upper bound under load
+ * @param int idle_timeout_ms idle time after which a thread above min_threads exits
+ * @return threadpool* pool if nothing failed in the process, NULL elsewhere
+ */
+threadpool * create_threadpool_elastic(int min_threads, int max_threads, int idle_timeout_ms) {
+    return create_threadpool_pinned(min_threads, max_threads, idle_timeout_ms, NULL);
+}
+
+/**
+ * create an elastic threadpool whose threads run on a cpu set
+ * @param int min_threads threads always kept
+ * @param int max_threads upper bound under load
+ * @param int idle_timeout_ms idle time after which a thread above min_threads exits
+ * @param cpu_set_t* cpus the cpus of the threads, NULL for no pinning
+ * @return threadpool* pool if nothing failed in the process, NULL elsewhere
+ */
+threadpool * create_threadpool_pinned(int min_threads, int max_threads, int idle_timeout_ms, const cpu_set_t * cpus) {
 
     ///input sanity check
-    if (num_threads_in_pool > MAXT_IN_POOL || num_threads_in_pool < 1) {
+    if (max_threads > MAXT_IN_POOL || min_threads < 1 || max_threads < min_threads) {
         fprintf(stderr, "Illegal number of threads\n");
         return NULL;
     }
+    if (max_threads > min_threads && idle_timeout_ms < 1) {
+        fprintf(stderr, "Illegal idle timeout\n");
+        return NULL;
+    }
     ///initialize the threadpool structure
     threadpool * pool = (threadpool * ) calloc(1, sizeof(threadpool));
     if (pool == NULL) {
         return NULL;
     }
-    pool -> num_threads = num_threads_in_pool;
-
-    pool -> threads = (pthread_t * ) calloc(pool -> num_threads, sizeof(pthread_t));
-    if (pool -> threads == NULL) {
-        free(pool);
-        return NULL;
+    pool -> min_threads = min_threads;
+    pool -> max_threads = max_threads;
+    pool -> idle_timeout_ms = idle_timeout_ms;
+    if (cpus != NULL) {
+        pool -> pinned = 1;
+        pool -> cpus = * cpus;
     }
+
     ///initialized mutex and conditional variables
     if (pthread_mutex_init( & (pool -> qlock), NULL) != 0) {
-        free(pool -> threads);
         free(pool);
         return NULL;
     }
     if (pthread_cond_init( & (pool -> q_not_empty), NULL) != 0) {
         pthread_mutex_destroy( & (pool -> qlock));
-        free(pool -> threads);
         free(pool);
         return NULL;
     }
     if (pthread_cond_init( & (pool -> q_empty), NULL) != 0) {
         pthread_mutex_destroy( & (pool -> qlock));
         pthread_cond_destroy( & (pool -> q_not_empty));
-        free(pool -> threads);
+        free(pool);
+        return NULL;
+    }
+    if (pthread_cond_init( & (pool -> all_exited), NULL) != 0) {
+        pthread_mutex_destroy( & (pool -> qlock));
+        pthread_cond_destroy( & (pool -> q_not_empty));
+        pthread_cond_destroy( & (pool -> q_empty));
         free(pool);
         return NULL;
     }
@@ -56,19 +192,19 @@ threadpool * create_threadpool(int num_threads_in_pool) {
     pool -> qtail = NULL;
     pool -> shutdown = 0;
     pool -> dont_accept = 0;
+    pool -> last_change_ns = mono_ns();
 
     ///create the threads
-    for (int i = 0; i < pool -> num_threads; i++) {
-        if (pthread_create( & (pool -> threads[i]), NULL, do_work, pool) != 0) {
+    pthread_mutex_lock( & (pool -> qlock));
+    for (int i = 0; i < min_threads; i++) {
+        if (spawn_worker(pool) != 0) {
             perror("pthread_create:\n");
-            pthread_mutex_destroy( & (pool -> qlock));
-            pthread_cond_destroy( & (pool -> q_empty));
-            pthread_cond_destroy( & (pool -> q_not_empty));
-            free(pool -> threads);
-            free(pool);
+            pthread_mutex_unlock( & (pool -> qlock));
+            abort_pool(pool);
             return NULL;
         }
     }
+    pthread_mutex_unlock( & (pool -> qlock));
 
     return pool;
 }
@@ -79,33 +215,42 @@ threadpool * create_threadpool(int num_threads_in_pool) {
  * @param dispatch_fn dispatch_to_here the function of the new work
  * @param void* arg the argument for the function dispatch_to_here
  */
-void dispatch(threadpool * from_me, dispatch_fn dispatch_to_here, void * arg) {
+int dispatch(threadpool * from_me, dispatch_fn dispatch_to_here, void * arg) {
     pthread_mutex_lock( & (from_me -> qlock));
     if (from_me -> dont_accept == 1) {
         pthread_mutex_unlock( & (from_me -> qlock));
-        return;
+        return -1;
     }
     pthread_mutex_unlock( & (from_me -> qlock));
     if ((dispatch_to_here == NULL) || (arg == NULL)) {
         fprintf(stderr, "invalid parameters");
-        return;
+        return -1;
     }
 
     work_t * new_work = (work_t * ) calloc(1, sizeof(work_t));
     if (new_work == NULL) {
         fprintf(stderr, "calloc:\n");
-        return;
+        return -1;
     }
     new_work -> routine = dispatch_to_here;
     new_work -> arg = arg;
     new_work -> next = NULL;
+    new_work -> enq_ns = mono_ns();
 
     pthread_mutex_lock( & (from_me -> qlock));
 
     if (from_me -> dont_accept == 1) {
         free(new_work);
         pthread_mutex_unlock( & (from_me -> qlock));
-        return;
+        return -1;
+    }
+    ///bounded queue: refuse instead of queueing without limit
+    if (from_me -> max_queue > 0 && from_me -> qsize >= from_me -> max_queue) {
+        from_me -> stats.rejected++;
+        maybe_grow(from_me);
+        pthread_mutex_unlock( & (from_me -> qlock));
+        free(new_work);
+        return -1;
     }
     if (from_me -> qhead == NULL) {
         from_me -> qhead = new_work;
@@ -118,48 +263,128 @@ void dispatch(threadpool * from_me, dispatch_fn dispatch_to_here, void * arg) {
     from_me -> qsize++;
 
     pthread_cond_signal( & (from_me -> q_not_empty));
+    maybe_grow(from_me);
 
     pthread_mutex_unlock( & (from_me -> qlock));
+    return 0;
 }
 
 /**
- * the thread function work. take a work from the queue and do it
+ * leave the pool, the caller holds qlock and releases it
+ * @param threadpool* pool the threadpool struct
+ */
+static void * worker_exit(threadpool * pool) {
+    pool -> num_threads--;
+    if (pool -> num_threads == 0) {
+        pthread_cond_signal( & (pool -> all_exited));
+    }
+    pthread_mutex_unlock( & (pool -> qlock));
+    return NULL;
+}
+
+/**
+ * the thread function work. take a work from the queue and do it.
+ * in an elastic pool a thread above min_threads that waited idle_timeout_ms
+ * without work exits, at most one per POOL_COOLDOWN_MS
  * @param threadpool* p the threadpool struct
  */
 void * do_work(void * p) {
     threadpool * pool = (threadpool * ) p;
+    pthread_mutex_lock( & (pool -> qlock));
+    ///spawn_worker counted this thread as idle
+    pool -> idle_threads--;
     while (1) {
-        pthread_mutex_lock( & (pool -> qlock));
-        if (pool -> shutdown == 1) {
-            pthread_mutex_unlock( & (pool -> qlock));
-            return NULL;
-        }
-        if (pool -> qsize == 0) {
-            pthread_cond_wait( & (pool -> q_not_empty), & (pool -> qlock));
+        while (pool -> qsize == 0 && pool -> shutdown == 0) {
+            int elastic = pool -> num_threads > pool -> min_threads;
+            int rc;
+            pool -> idle_threads++;
+            if (elastic) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, & ts);
+                ts.tv_sec += pool -> idle_timeout_ms / 1000;
+                ts.tv_nsec += (long)(pool -> idle_timeout_ms % 1000) * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                rc = pthread_cond_timedwait( & (pool -> q_not_empty), & (pool -> qlock), & ts);
+            } else {
+                rc = pthread_cond_wait( & (pool -> q_not_empty), & (pool -> qlock));
+            }
+            pool -> idle_threads--;
+            if (rc == ETIMEDOUT && pool -> qsize == 0 && pool -> shutdown == 0 &&
+                pool -> num_threads > pool -> min_threads) {
+                uint64_t now = mono_ns();
+                ///hysteresis: no retire right after the pool changed size
+                if (now - pool -> last_change_ns >= (uint64_t) POOL_COOLDOWN_MS * 1000000ULL) {
+                    pool -> last_change_ns = now;
+                    pool -> stats.retired++;
+                    return worker_exit(pool);
+                }
+            }
         }
         if (pool -> shutdown == 1) {
-            pthread_mutex_unlock( & (pool -> qlock));
-            return NULL;
+            return worker_exit(pool);
         }
         work_t * w = pool -> qhead;
-        if (w == NULL) {
-            pthread_mutex_unlock( & (pool -> qlock));
-            continue;
-        }
         pool -> qhead = pool -> qhead -> next;
+        if (pool -> qhead == NULL) {
+            pool -> qtail = NULL;
+        }
         pool -> qsize--;
         if (pool -> qsize == 0 && pool -> dont_accept == 1) {
             pthread_cond_signal( & (pool -> q_empty));
         }
+        ///the queue is still backing up with this thread busy
+        maybe_grow(pool);
+        int (*routine)(void * ) = w -> routine;
+        if (pool -> shed_target_ns != 0) {
+            uint64_t now = mono_ns();
+            if (codel_shed(pool, now - w -> enq_ns, now)) {
+                routine = pool -> shed;
+                pool -> stats.shed++;
+            }
+        }
 
         pthread_mutex_unlock( & (pool -> qlock));
 
-        w -> routine(w -> arg);
+        routine(w -> arg);
         free(w);
+        pthread_mutex_lock( & (pool -> qlock));
     }
 
 }
 
+/**
+ * bound the queue and enable CoDel shedding
+ * @param threadpool* pool the threadpool struct
+ * @param int max_queue queue bound, 0 for unbounded
+ * @param int target_ms CoDel target queue time, 0 disables shedding
+ * @param int interval_ms CoDel interval, 0 for POOL_SHED_INTERVAL_MS
+ * @param dispatch_fn shed called with the argument of a shed job
+ */
+void threadpool_set_shedding(threadpool * pool, int max_queue, int target_ms, int interval_ms, dispatch_fn shed) {
+    pthread_mutex_lock( & (pool -> qlock));
+    pool -> max_queue = max_queue > 0 ? max_queue : 0;
+    pool -> shed = shed;
+    pool -> shed_target_ns = target_ms > 0 && shed != NULL ? (uint64_t) target_ms * 1000000ULL : 0;
+    pool -> shed_interval_ns = (uint64_t)(interval_ms > 0 ? interval_ms : POOL_SHED_INTERVAL_MS) * 1000000ULL;
+    pool -> last_good_ns = 0;
+    pthread_mutex_unlock( & (pool -> qlock));
+}
+
+/**
+ * copy the thread churn statistics of the pool
+ * @param threadpool* pool the threadpool struct
+ * @param threadpool_stats* out the copy
+ */
+void threadpool_get_stats(threadpool * pool, threadpool_stats * out) {
+    pthread_mutex_lock( & (pool -> qlock));
+    * out = pool -> stats;
+    out -> threads = pool -> num_threads;
+    pthread_mutex_unlock( & (pool -> qlock));
+}
+
 /**
  * destroy the threadpool, after all threads are done and the queue is empty
  * @param threadpool* destroyme the threadpool struct
@@ -168,23 +393,23 @@ void destroy_threadpool(threadpool * destroyme) {
     pthread_mutex_lock( & (destroyme -> qlock));
 
     destroyme -> dont_accept = 1;
-    if (destroyme -> qsize != 0) {
+    while (destroyme -> qsize != 0) {
         pthread_cond_wait( & (destroyme -> q_empty), & (destroyme -> qlock));
     }
 
     destroyme -> shutdown = 1;
     pthread_cond_broadcast( & (destroyme -> q_not_empty));
 
-    pthread_mutex_unlock( & (destroyme -> qlock));
-    void * status;
-    for (int i = 0; i < destroyme -> num_threads; i++) {
-        pthread_join(destroyme -> threads[i], & status);
+    ///the threads are detached, wait for the last one to leave
+    while (destroyme -> num_threads > 0) {
+        pthread_cond_wait( & (destroyme -> all_exited), & (destroyme -> qlock));
     }
+    pthread_mutex_unlock( & (destroyme -> qlock));
 
     pthread_mutex_destroy( & (destroyme -> qlock));
     pthread_cond_destroy( & (destroyme -> q_empty));
     pthread_cond_destroy( & (destroyme -> q_not_empty));
-    free(destroyme -> threads);
+    pthread_cond_destroy( & (destroyme -> all_exited));
     free(destroyme);
 
-}
\ No newline at end of file
+}
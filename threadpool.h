@@ -1,5 +1,13 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <pthread.h>
 
+#include <sched.h>
+
+#include <stdint.h>
+
 /**
  * threadpool.h
  *
@@ -10,6 +18,19 @@
 // maximum number of threads allowed in a pool
 #define MAXT_IN_POOL 200
 
+// elastic mode: spawn a thread when no thread is idle and more than
+// POOL_SPAWN_QSIZE jobs wait, or the oldest job waited POOL_SPAWN_WAIT_MS
+#define POOL_SPAWN_QSIZE 4
+#define POOL_SPAWN_WAIT_MS 5
+
+// elastic mode: minimum time between two pool size changes, a thread is
+// never retired sooner than this after the last spawn (hysteresis)
+#define POOL_COOLDOWN_MS 1000
+
+// default CoDel interval: queue time must stay above the target this long
+// before jobs are shed
+#define POOL_SHED_INTERVAL_MS 100
+
 
 /**
  * the pool holds a queue of this structure
@@ -17,24 +38,51 @@
 typedef struct work_st{
       int (*routine) (void*);  //the threads process function
       void * arg;  //argument to the function
+      uint64_t enq_ns;  //monotonic time the job entered the queue
       struct work_st* next;  
 } work_t;
 
 
+/**
+ * thread churn statistics of a pool
+ */
+typedef struct threadpool_stats {
+    int threads;        //threads alive now
+    int peak;           //most threads alive at once
+    long spawned;       //threads created after the pool started
+    long retired;       //threads that exited because they were idle
+    long rejected;      //jobs refused by dispatch because the queue was full
+    long shed;          //jobs handed to the shed function by the CoDel policy
+} threadpool_stats;
+
+
 /**
  * The actual pool
  */
 typedef struct _threadpool_st {
  	int num_threads;	//number of active threads
 	int qsize;	        //number in the queue
-	pthread_t *threads;	//pointer to threads
 	work_t* qhead;		//queue head pointer
 	work_t* qtail;		//queue tail pointer
 	pthread_mutex_t qlock;		//lock on the queue list
 	pthread_cond_t q_not_empty;	//non empty and empty condidtion vairiables
 	pthread_cond_t q_empty;
+	pthread_cond_t all_exited;	//signaled when the last thread exits
     int shutdown;            //1 if the pool is in distruction process     
     int dont_accept;       //1 if destroy function has begun
+    int min_threads;       //elastic lower bound (== max_threads for a fixed pool)
+    int max_threads;       //elastic upper bound
+    int idle_threads;      //threads waiting for work
+    int idle_timeout_ms;   //an idle thread above min_threads retires after this
+    uint64_t last_change_ns;    //last spawn or retire
+    int max_queue;         //dispatch refuses jobs beyond this (0 = unbounded)
+    uint64_t shed_target_ns;    //CoDel target queue time (0 = no shedding)
+    uint64_t shed_interval_ns;  //CoDel interval
+    uint64_t last_good_ns;      //last time a job waited less than the target
+    int (*shed)(void*);    //called instead of the job routine for a shed job
+    int pinned;            //1 if the threads run on cpus only
+    cpu_set_t cpus;
+    threadpool_stats stats;
 } threadpool;
 
 
@@ -58,6 +106,36 @@ typedef int (*dispatch_fn)(void *);
  */
 threadpool* create_threadpool(int num_threads_in_pool);
 
+/**
+ * create_threadpool_elastic creates a pool that starts min_threads
+ * threads and grows up to max_threads under queue pressure (see
+ * POOL_SPAWN_QSIZE / POOL_SPAWN_WAIT_MS). a thread idle for
+ * idle_timeout_ms exits while the pool is above min_threads.
+ * returns NULL on failure.
+ */
+threadpool* create_threadpool_elastic(int min_threads, int max_threads, int idle_timeout_ms);
+
+/**
+ * create_threadpool_pinned is create_threadpool_elastic with every thread
+ * (also the ones spawned later) restricted to cpus. NULL cpus: no pinning.
+ */
+threadpool* create_threadpool_pinned(int min_threads, int max_threads, int idle_timeout_ms, const cpu_set_t* cpus);
+
+/**
+ * copy the thread churn and load shedding statistics of the pool
+ */
+void threadpool_get_stats(threadpool* pool, threadpool_stats* out);
+
+/**
+ * threadpool_set_shedding bounds the queue and enables shedding.
+ * max_queue > 0: dispatch refuses a job when max_queue jobs wait.
+ * target_ms > 0: CoDel. once no dequeued job waited less than target_ms
+ * for interval_ms, every job that waited longer than target_ms is passed
+ * to shed (which should answer quickly and release the argument) instead
+ * of its routine. outside overload only jobs older than interval_ms are.
+ */
+void threadpool_set_shedding(threadpool* pool, int max_queue, int target_ms, int interval_ms, dispatch_fn shed);
+
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
@@ -68,9 +146,10 @@ threadpool* create_threadpool(int num_threads_in_pool);
  * 2. lock the mutex
  * 3. add the work_t element to the queue
  * 4. unlock mutex
- *
+ * returns 0 if the job was queued, -1 if it was refused (queue full,
+ * pool shutting down or out of memory), the caller still owns arg then.
  */
-void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+int dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
 /**
  * The work function of the thread
@@ -0,0 +1,199 @@
+#include "timerwheel.h"
+
+#include <stdlib.h>
+
+#include <time.h>
+
+#include <sys/socket.h>
+
+typedef struct tw_slot {
+    pthread_mutex_t lock;
+    tw_timer * head;
+} tw_slot;
+
+uint64_t tw_now = 0;                    //last tick the ticker processed
+static tw_slot * slots = NULL;          //NULL = no ticker, timers are never armed
+static pthread_t ticker;
+static int stopping = 0;
+
+/**
+ * @return uint64_t the current tick of the monotonic clock
+ */
+static uint64_t clock_tick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, & ts);
+    return ((uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000) / TW_TICK_MS;
+}
+
+/**
+ * insert a timer in the list of its expiry tick, the list is locked
+ */
+static void link_timer(tw_slot * s, tw_timer * t, int slot) {
+    t -> prev = NULL;
+    t -> next = s -> head;
+    if (s -> head != NULL) {
+        s -> head -> prev = t;
+    }
+    s -> head = t;
+    __atomic_store_n( & t -> slot, slot, __ATOMIC_RELEASE);
+}
+
+/**
+ * remove a timer from its list, the list is locked
+ */
+static void unlink_timer(tw_slot * s, tw_timer * t) {
+    if (t -> prev != NULL) {
+        t -> prev -> next = t -> next;
+    } else {
+        s -> head = t -> next;
+    }
+    if (t -> next != NULL) {
+        t -> next -> prev = t -> prev;
+    }
+    __atomic_store_n( & t -> slot, -1, __ATOMIC_RELEASE);
+}
+
+/**
+ * fire the timers of a tick, move the touched ones to their new deadline
+ * @param uint64_t tick the tick
+ */
+static void run_slot(uint64_t tick) {
+    int index = (int)(tick & (TW_SLOTS - 1));
+    tw_slot * s = & slots[index];
+    pthread_mutex_lock( & s -> lock);
+    tw_timer * t = s -> head;
+    while (t != NULL) {
+        tw_timer * next = t -> next;
+        uint64_t deadline = __atomic_load_n( & t -> deadline, __ATOMIC_RELAXED);
+        if (t -> expires > tick) { ///a later turn
+        } else if (deadline > tick) {
+            ///touched: only the ticker holds two slot locks, arm and cancel hold one
+            int to = (int)(deadline & (TW_SLOTS - 1));
+            t -> expires = deadline;
+            if (to != index) {
+                unlink_timer(s, t);
+                pthread_mutex_lock( & slots[to].lock);
+                link_timer( & slots[to], t, to);
+                pthread_mutex_unlock( & slots[to].lock);
+            }
+        } else {
+            ///under the slot lock: once tw_cancel returned the sockets are not touched.
+            ///fired is set first, the worker checks it as soon as the shutdown wakes it
+            unlink_timer(s, t);
+            __atomic_store_n( & t -> fired, 1, __ATOMIC_RELEASE);
+            if (t -> fd >= 0) {
+                shutdown(t -> fd, SHUT_RDWR);
+            }
+            if (t -> fd2 >= 0) {
+                shutdown(t -> fd2, SHUT_RDWR);
+            }
+        }
+        t = next;
+    }
+    pthread_mutex_unlock( & s -> lock);
+}
+
+/**
+ * the ticker thread: processes every tick up to the clock
+ */
+static void * tick_loop(void * arg) {
+    (void) arg;
+    struct timespec tick = {
+            0, TW_TICK_MS * 1000000L
+    };
+    while (!__atomic_load_n( & stopping, __ATOMIC_RELAXED)) {
+        nanosleep( & tick, NULL);
+        uint64_t now = clock_tick();
+        for (uint64_t t = tw_now + 1; t <= now; t++) {
+            run_slot(t);
+            __atomic_store_n( & tw_now, t, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * start the ticker
+ * @return int 0 on success, -1 else
+ */
+int tw_init(void) {
+    tw_slot * s = (tw_slot * ) calloc(TW_SLOTS, sizeof(tw_slot));
+    if (s == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < TW_SLOTS; i++) {
+        pthread_mutex_init( & s[i].lock, NULL);
+    }
+    tw_now = clock_tick();
+    slots = s;
+    if (pthread_create( & ticker, NULL, tick_loop, NULL) != 0) {
+        slots = NULL;
+        free(s);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * prepare a timer that is not armed
+ * @param tw_timer* t the timer
+ */
+void tw_clear(tw_timer * t) {
+    t -> slot = -1;
+    t -> fired = 0;
+    t -> fd = -1;
+    t -> fd2 = -1;
+}
+
+/**
+ * arm (or re-arm) a timer
+ * @param tw_timer* t the timer
+ * @param int fd socket to shut down when it fires
+ * @param int fd2 second socket to shut down, -1 for none
+ * @param int ms the timeout, 0 leaves the timer disarmed
+ */
+void tw_arm(tw_timer * t, int fd, int fd2, int ms) {
+    tw_cancel(t);
+    t -> fired = 0;
+    if (slots == NULL || ms <= 0) {
+        return;
+    }
+    t -> fd = fd;
+    t -> fd2 = fd2;
+    t -> period = (uint32_t)((ms + TW_TICK_MS - 1) / TW_TICK_MS);
+    ///the ticker never goes back: a deadline after its last tick is always reached
+    t -> expires = t -> deadline = __atomic_load_n( & tw_now, __ATOMIC_ACQUIRE) + t -> period + 1;
+    int index = (int)(t -> expires & (TW_SLOTS - 1));
+    pthread_mutex_lock( & slots[index].lock);
+    link_timer( & slots[index], t, index);
+    pthread_mutex_unlock( & slots[index].lock);
+}
+
+/**
+ * disarm a timer, once it returns the timer does not fire
+ * @param tw_timer* t the timer
+ */
+void tw_cancel(tw_timer * t) {
+    int index;
+    ///the ticker may move the timer to another slot meanwhile: check again under the lock
+    while ((index = __atomic_load_n( & t -> slot, __ATOMIC_ACQUIRE)) >= 0) {
+        pthread_mutex_lock( & slots[index].lock);
+        if (t -> slot == index) {
+            unlink_timer( & slots[index], t);
+            pthread_mutex_unlock( & slots[index].lock);
+            return;
+        }
+        pthread_mutex_unlock( & slots[index].lock);
+    }
+}
+
+/**
+ * stop the ticker
+ */
+void tw_shutdown(void) {
+    if (slots == NULL) {
+        return;
+    }
+    __atomic_store_n( & stopping, 1, __ATOMIC_RELAXED);
+    pthread_join(ticker, NULL);
+}
@@ -0,0 +1,95 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#include <pthread.h>
+
+/**
+ * timerwheel.h
+ *
+ * This file declares the timeout wheel.
+ * a hashed timing wheel of TW_SLOTS lists, one tick per TW_TICK_MS: a timer
+ * goes into the list of its expiry tick (deadlines past one turn wait for
+ * a later turn), so arming and cancelling is a list insert or unlink under
+ * the lock of one slot, whatever the number of timers. a ticker thread
+ * walks the slots as time passes. a timer that fires shuts its sockets
+ * down, which ends the blocking call of the worker (read, write, connect,
+ * sendfile) or wakes the poll of a tunnel with a hangup.
+ * a transfer touches its timer after each chunk: the touch only moves the
+ * deadline, the ticker moves the timer when it reaches the old one.
+ */
+
+#define TW_SLOTS 4096           //must be a power of 2, 40 seconds per turn
+#define TW_TICK_MS 10
+
+
+/**
+ * a timeout, embedded in the request that owns it
+ */
+typedef struct tw_timer {
+    struct tw_timer * next;
+    struct tw_timer * prev;
+    int slot;                   //list it is in, -1 if not armed
+    uint64_t expires;           //tick of its list position
+    uint64_t deadline;          //tick it fires at, moved forward by tw_touch
+    uint32_t period;            //ticks from a touch to the deadline
+    int fd;                     //sockets shut down when it fires, -1 for none
+    int fd2;
+    int fired;                  //1 once it fired, until it is armed again
+} tw_timer;
+
+
+extern uint64_t tw_now;
+
+/**
+ * start the ticker
+ * @return int 0 on success, -1 else
+ */
+int tw_init(void);
+
+/**
+ * prepare a timer that is not armed
+ * @param tw_timer* t the timer
+ */
+void tw_clear(tw_timer * t);
+
+/**
+ * arm (or re-arm) a timer
+ * @param tw_timer* t the timer
+ * @param int fd socket to shut down when it fires
+ * @param int fd2 second socket to shut down, -1 for none
+ * @param int ms the timeout, 0 leaves the timer disarmed
+ */
+void tw_arm(tw_timer * t, int fd, int fd2, int ms);
+
+/**
+ * disarm a timer, once it returns the timer does not fire
+ * @param tw_timer* t the timer
+ */
+void tw_cancel(tw_timer * t);
+
+/**
+ * progress: the deadline is one period from now again
+ * @param tw_timer* t the timer, NULL is ignored
+ */
+static inline void tw_touch(tw_timer * t) {
+    if (t != NULL && t -> slot >= 0) {
+        __atomic_store_n( & t -> deadline, __atomic_load_n( & tw_now, __ATOMIC_RELAXED) + t -> period + 1,
+                          __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @return int 1 if the timer fired since it was armed
+ */
+static inline int tw_fired(tw_timer * t) {
+    return t != NULL && __atomic_load_n( & t -> fired, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * stop the ticker
+ */
+void tw_shutdown(void);
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <stdint.h>
+
+#include <unistd.h>
+
+#include <time.h>
+
+#include <netdb.h>
+
+#include <arpa/inet.h>
+
+#include <netinet/in.h>
+
+#include <sys/socket.h>
+
+/**
+ * bench.h
+ *
+ * small helpers shared by the benchmark tools: clock, tcp client,
+ * a one-shot HTTP/1.0 GET and a latency recorder with percentiles.
+ * everything is static so each tool builds from a single .c file.
+ */
+
+/**
+ * @return double monotonic time in microseconds
+ */
+static inline double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, & ts);
+    return (double) ts.tv_sec * 1e6 + (double) ts.tv_nsec / 1e3;
+}
+
+/**
+ * split "host:port" into its parts
+ * @param char* s the string (not modified)
+ * @param char* host buffer of at least 256 bytes
+ * @param int* port the port, unchanged if s has none
+ * @return int 0 on success, -1 else
+ */
+static inline int parse_hostport(const char * s, char * host, int * port) {
+    const char * colon = strrchr(s, ':');
+    size_t n = colon ? (size_t)(colon - s) : strlen(s);
+    if (n == 0 || n > 255) {
+        return -1;
+    }
+    memcpy(host, s, n);
+    host[n] = '\0';
+    if (colon != NULL) {
+        * port = atoi(colon + 1);
+    }
+    return 0;
+}
+
+/**
+ * resolve host into an ipv4 address
+ * @param char* host name or dotted address
+ * @param struct sockaddr_in* out the address (port not set)
+ * @return int 0 on success, -1 else
+ */
+static inline int resolve4(const char * host, struct sockaddr_in * out) {
+    memset(out, 0, sizeof( * out));
+    out -> sin_family = AF_INET;
+    if (inet_aton(host, & out -> sin_addr) != 0) {
+        return 0;
+    }
+    struct addrinfo hints, * res;
+    memset( & hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, & hints, & res) != 0) {
+        return -1;
+    }
+    out -> sin_addr = ((struct sockaddr_in * ) res -> ai_addr) -> sin_addr;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/**
+ * open a tcp connection
+ * @param struct sockaddr_in* addr the address with the port set
+ * @return int the socket, -1 on failure
+ */
+static inline int tcp_connect(const struct sockaddr_in * addr) {
+    int sd = socket(PF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+        return -1;
+    }
+    if (connect(sd, (const struct sockaddr * ) addr, sizeof( * addr)) < 0) {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+/**
+ * send a GET through the proxy and read the response until the proxy closes
+ * @param struct sockaddr_in* proxy the proxy address
+ * @param char* host the Host header value
+ * @param char* path the request path
+ * @param long* bytes number of response bytes (header included)
+ * @return int the response status, -1 on a connection error
+ */
+static inline int http_get(const struct sockaddr_in * proxy, const char * host, const char * path, long * bytes) {
+    char req[1024], buf[65536];
+    int sd = tcp_connect(proxy);
+    * bytes = 0;
+    if (sd < 0) {
+        return -1;
+    }
+    int n = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", path, host);
+    if (write(sd, req, (size_t) n) != n) {
+        close(sd);
+        return -1;
+    }
+    int status = -1;
+    ssize_t r;
+    while ((r = read(sd, buf, sizeof(buf))) > 0) {
+        if ( * bytes == 0 && r > 12 && strncmp(buf, "HTTP/1.", 7) == 0) {
+            status = atoi(buf + 9);
+        }
+        * bytes += r;
+    }
+    close(sd);
+    return r < 0 ? -1 : status;
+}
+
+
+/**
+ * growable array of latencies (microseconds)
+ */
+typedef struct lat_vec {
+    double * v;
+    size_t n, cap;
+    long bytes;
+    long errors;
+} lat_vec;
+
+static inline void lat_push(lat_vec * l, double us) {
+    if (l -> n == l -> cap) {
+        l -> cap = l -> cap ? l -> cap * 2 : 1024;
+        l -> v = realloc(l -> v, l -> cap * sizeof(double));
+        if (l -> v == NULL) {
+            fprintf(stderr, "realloc:\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    l -> v[l -> n++] = us;
+}
+
+/**
+ * append all samples of src to dst
+ */
+static inline void lat_merge(lat_vec * dst, const lat_vec * src) {
+    for (size_t i = 0; i < src -> n; i++) {
+        lat_push(dst, src -> v[i]);
+    }
+    dst -> bytes += src -> bytes;
+    dst -> errors += src -> errors;
+}
+
+static inline int cmp_lat(const void * a, const void * b) {
+    double x = * (const double * ) a, y = * (const double * ) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * nearest-rank percentile, the vector must be sorted
+ */
+static inline double lat_pct(const lat_vec * l, double p) {
+    if (l -> n == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)(p * (double) l -> n + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > l -> n) {
+        rank = l -> n;
+    }
+    return l -> v[rank - 1];
+}
+
+static inline void lat_header(void) {
+    printf("%-10s %9s %10s %10s %10s %10s %10s %10s %8s\n",
+           "class", "requests", "rps", "MB/s", "p50(us)", "p99(us)", "p99.9(us)", "max(us)", "errors");
+}
+
+/**
+ * sort and print one line of statistics
+ * @param char* name the row name
+ * @param lat_vec* l the samples
+ * @param double seconds the measured interval
+ */
+static inline void lat_report(const char * name, lat_vec * l, double seconds) {
+    qsort(l -> v, l -> n, sizeof(double), cmp_lat);
+    printf("%-10s %9zu %10.1f %10.2f %10.1f %10.1f %10.1f %10.1f %8ld\n", name, l -> n,
+           (double) l -> n / seconds, (double) l -> bytes / seconds / 1e6,
+           lat_pct(l, 0.5), lat_pct(l, 0.99), lat_pct(l, 0.999),
+           l -> n ? l -> v[l -> n - 1] : 0.0, l -> errors);
+}
+
+#endif
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+
+#include <signal.h>
+
+#include "bench.h"
+
+/**
+ * loadgen.c
+ *
+ * multi-threaded load generator for the proxy. requests are drawn from
+ * three classes:
+ *   hit       a warm set of objects, fetched once before the measurement
+ *   miss      a unique path per request, always goes to the origin
+ *   filtered  Host is a blocked name, the proxy answers 403
+ * closed loop (default): every thread sends its next request when the
+ * previous one finished. open loop (-r): requests are sent on a fixed
+ * schedule and latency is measured from the scheduled time, so a slow
+ * proxy is not hidden by a slow generator.
+ *
+ * usage: loadgen -x <proxy host:port> -o <origin host:port> [-t threads]
+ *                [-d seconds] [-r total-rps] [-m hit:miss:filtered]
+ *                [-s object-size] [-w warm-objects] [-b blocked-host]
+ */
+
+enum {
+    HIT, MISS, FILTERED, CLASSES
+};
+static const char * class_name[CLASSES] = {
+        "hit",
+        "miss",
+        "filtered"
+};
+static const int class_status[CLASSES] = {
+        200,
+        200,
+        403
+};
+
+typedef struct opts {
+    struct sockaddr_in proxy;
+    char origin[300];
+    char blocked[256];
+    int threads;
+    double seconds;
+    double rate;            //total requests per second, 0 for closed loop
+    int mix[CLASSES];       //percent of each class
+    long size;
+    int warm;
+    unsigned run_id;
+} opts;
+
+typedef struct worker {
+    pthread_t t;
+    int id;
+    opts * o;
+    lat_vec lat[CLASSES];
+} worker;
+
+static opts o;
+
+/**
+ * the path and host of a request of the given class
+ */
+static void make_request(int cls, worker * w, long seq, unsigned * seed, char * path, size_t n, const char ** host) {
+    * host = o.origin;
+    switch (cls) {
+        case HIT:
+            snprintf(path, n, "/size/%ld/hit/%d.html", o.size, (int)(rand_r(seed) % (unsigned) o.warm));
+            break;
+        case MISS:
+            snprintf(path, n, "/size/%ld/miss/%u/%d/%ld.html", o.size, o.run_id, w -> id, seq);
+            break;
+        default:
+            * host = o.blocked;
+            snprintf(path, n, "/blocked.html");
+    }
+}
+
+/**
+ * pick a class according to the mix
+ */
+static int pick_class(unsigned * seed) {
+    int r = (int)(rand_r(seed) % 100), acc = 0;
+    for (int c = 0; c < CLASSES; c++) {
+        acc += o.mix[c];
+        if (r < acc) {
+            return c;
+        }
+    }
+    return HIT;
+}
+
+static void * run(void * arg) {
+    worker * w = (worker * ) arg;
+    unsigned seed = (unsigned) w -> id * 7919u + o.run_id;
+    double start = now_us(), end = start + o.seconds * 1e6;
+    double interval = o.rate > 0 ? 1e6 * o.threads / o.rate : 0;
+    double next = start + interval * w -> id / o.threads;
+    char path[512];
+    const char * host;
+    for (long seq = 0;; seq++) {
+        double t0;
+        if (interval > 0) {
+            ///open loop: wait for the slot, measure from the slot
+            double now = now_us();
+            if (next >= end) {
+                break;
+            }
+            if (next > now) {
+                usleep((useconds_t)(next - now));
+            }
+            t0 = next;
+            next += interval;
+        } else {
+            t0 = now_us();
+            if (t0 >= end) {
+                break;
+            }
+        }
+        int cls = pick_class( & seed);
+        make_request(cls, w, seq, & seed, path, sizeof(path), & host);
+        long bytes;
+        int status = http_get( & o.proxy, host, path, & bytes);
+        double us = now_us() - t0;
+        lat_vec * l = & w -> lat[cls];
+        if (status != class_status[cls]) {
+            l -> errors++;
+            continue;
+        }
+        lat_push(l, us);
+        l -> bytes += bytes;
+    }
+    return NULL;
+}
+
+/**
+ * put the hit set into the proxy cache
+ */
+static void warm_up(void) {
+    char path[512];
+    for (int i = 0; i < o.warm; i++) {
+        long bytes;
+        snprintf(path, sizeof(path), "/size/%ld/hit/%d.html", o.size, i);
+        if (http_get( & o.proxy, o.origin, path, & bytes) != 200) {
+            fprintf(stderr, "warm up of %s failed\n", path);
+        }
+    }
+}
+
+static void usage(void) {
+    fprintf(stdout, "Usage: loadgen -x <proxy host:port> -o <origin host:port> [-t threads] [-d seconds]\n"
+                    "               [-r total-rps] [-m hit:miss:filtered] [-s object-size] [-w warm-objects]\n"
+                    "               [-b blocked-host]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char * argv[]) {
+    char host[256];
+    int port = 0, opt, have_proxy = 0;
+    o.threads = 8;
+    o.seconds = 10;
+    o.mix[HIT] = 100;
+    o.size = 1024;
+    o.warm = 100;
+    strcpy(o.blocked, "localhost");
+    o.run_id = (unsigned) getpid() ^ (unsigned) time(NULL);
+    while ((opt = getopt(argc, argv, "x:o:t:d:r:m:s:w:b:")) != -1) {
+        switch (opt) {
+            case 'x':
+                if (parse_hostport(optarg, host, & port) != 0 || resolve4(host, & o.proxy) != 0) {
+                    usage();
+                }
+                o.proxy.sin_port = htons(port);
+                have_proxy = 1;
+                break;
+            case 'o':
+                snprintf(o.origin, sizeof(o.origin), "%s", optarg);
+                break;
+            case 't':
+                o.threads = atoi(optarg);
+                break;
+            case 'd':
+                o.seconds = atof(optarg);
+                break;
+            case 'r':
+                o.rate = atof(optarg);
+                break;
+            case 'm':
+                if (sscanf(optarg, "%d:%d:%d", & o.mix[HIT], & o.mix[MISS], & o.mix[FILTERED]) != 3) {
+                    usage();
+                }
+                break;
+            case 's':
+                o.size = atol(optarg);
+                break;
+            case 'w':
+                o.warm = atoi(optarg);
+                break;
+            case 'b':
+                snprintf(o.blocked, sizeof(o.blocked), "%s", optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (!have_proxy || o.origin[0] == '\0' || o.threads < 1 || o.warm < 1 ||
+        o.mix[HIT] + o.mix[MISS] + o.mix[FILTERED] != 100) {
+        usage();
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (o.mix[HIT] > 0) {
+        warm_up();
+    }
+
+    worker * w = calloc((size_t) o.threads, sizeof(worker));
+    if (w == NULL) {
+        fprintf(stderr, "calloc:\n");
+        exit(EXIT_FAILURE);
+    }
+    double t0 = now_us();
+    for (int i = 0; i < o.threads; i++) {
+        w[i].id = i;
+        w[i].o = & o;
+        if (pthread_create( & w[i].t, NULL, run, & w[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < o.threads; i++) {
+        pthread_join(w[i].t, NULL);
+    }
+    double seconds = (now_us() - t0) / 1e6;
+
+    printf("%s loop, %d threads, %.1fs, mix %d:%d:%d, object %ld bytes\n",
+           o.rate > 0 ? "open" : "closed", o.threads, seconds, o.mix[HIT], o.mix[MISS], o.mix[FILTERED], o.size);
+    lat_header();
+    lat_vec all = {
+            0
+    };
+    for (int c = 0; c < CLASSES; c++) {
+        lat_vec cls = {
+                0
+        };
+        for (int i = 0; i < o.threads; i++) {
+            lat_merge( & cls, & w[i].lat[c]);
+            free(w[i].lat[c].v);
+        }
+        if (cls.n > 0 || cls.errors > 0) {
+            lat_report(class_name[c], & cls, seconds);
+            lat_merge( & all, & cls);
+        }
+        free(cls.v);
+    }
+    lat_report("total", & all, seconds);
+    free(all.v);
+    free(w);
+    return 0;
+}
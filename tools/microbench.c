@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+
+#include <netdb.h>
+
+#include <time.h>
+
+#include <errno.h>
+
+/**
+ * microbench.c
+ *
+ * microbenchmarks of the proxy hot functions. the proxy source is
+ * included directly (its main renamed) so static and non-exported
+ * functions are measured exactly as they are built into the server.
+ * dns is stubbed: every name resolves to a fixed address without I/O.
+ *
+ * every benchmark runs a number of batches, a batch is sized to take a
+ * few milliseconds. reported: median ns/op over the batches, the median
+ * absolute deviation (MAD) and the median tsc ticks (cycles) per op.
+ *
+ * usage: microbench [filter-substring] [-q]   (-q: fewer batches)
+ */
+
+static int stub_gethostbyname_r(const char * name, struct hostent * ret, char * buf, size_t buflen,
+                                struct hostent ** result, int * h_errnop);
+static int stub_gethostbyaddr_r(const void * addr, socklen_t len, int type, struct hostent * ret, char * buf,
+                                size_t buflen, struct hostent ** result, int * h_errnop);
+
+#define main proxy_main
+#define gethostbyname_r stub_gethostbyname_r
+#define gethostbyaddr_r stub_gethostbyaddr_r
+
+#include "../proxyServer.c"
+
+#undef main
+#undef gethostbyname_r
+#undef gethostbyaddr_r
+
+/**
+ * fill a hostent with 93.184.216.34
+ */
+static int stub_fill(struct hostent * ret, char * buf, size_t buflen, struct hostent ** result) {
+    if (buflen < sizeof(struct in_addr) + 2 * sizeof(char * )) {
+        * result = NULL;
+        return ERANGE;
+    }
+    char ** list = (char ** ) buf;
+    struct in_addr * a = (struct in_addr * )(buf + 2 * sizeof(char * ));
+    inet_aton("93.184.216.34", a);
+    list[0] = (char * ) a;
+    list[1] = NULL;
+    ret -> h_name = "stub";
+    ret -> h_aliases = NULL;
+    ret -> h_addrtype = AF_INET;
+    ret -> h_length = sizeof(struct in_addr);
+    ret -> h_addr_list = list;
+    * result = ret;
+    return 0;
+}
+
+static int stub_gethostbyname_r(const char * name, struct hostent * ret, char * buf, size_t buflen,
+                                struct hostent ** result, int * h_errnop) {
+    (void) name;
+    * h_errnop = 0;
+    return stub_fill(ret, buf, buflen, result);
+}
+
+static int stub_gethostbyaddr_r(const void * addr, socklen_t len, int type, struct hostent * ret, char * buf,
+                                size_t buflen, struct hostent ** result, int * h_errnop) {
+    (void) addr;
+    (void) len;
+    (void) type;
+    * h_errnop = 0;
+    return stub_fill(ret, buf, buflen, result);
+}
+
+
+/************ HARNESS ************/
+
+typedef void (*bench_fn)(void * ctx, long iters);
+
+#define MAX_BATCHES 31
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static char * only = NULL;
+static int batches = MAX_BATCHES;
+static volatile long sink;
+
+static double mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, & ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static int cmp_d(const void * a, const void * b) {
+    double x = * (const double * ) a, y = * (const double * ) b;
+    return (x > y) - (x < y);
+}
+
+static double median(double * v, int n) {
+    qsort(v, (size_t) n, sizeof(double), cmp_d);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/**
+ * run one benchmark and print its statistics
+ * @param char* name the row name
+ * @param bench_fn fn runs iters operations
+ * @param void* ctx argument of fn
+ * @param double batch_ns target duration of a batch
+ */
+static void run(const char * name, bench_fn fn, void * ctx, double batch_ns) {
+    if (only != NULL && strstr(name, only) == NULL) {
+        return;
+    }
+    ///warm up and size the batch
+    long iters = 1;
+    while (1) {
+        double t0 = mono_ns();
+        fn(ctx, iters);
+        double t = mono_ns() - t0;
+        if (t >= batch_ns || iters >= (1L << 30)) {
+            break;
+        }
+        iters = t < batch_ns / 64 ? iters * 8 : (long)((double) iters * batch_ns / (t > 1 ? t : 1)) + 1;
+    }
+    double ns[MAX_BATCHES], ticks[MAX_BATCHES], dev[MAX_BATCHES];
+    for (int b = 0; b < batches; b++) {
+        double t0 = mono_ns();
+        uint64_t c0 = trace_now();
+        fn(ctx, iters);
+        uint64_t c1 = trace_now();
+        ns[b] = (mono_ns() - t0) / (double) iters;
+        ticks[b] = (double)(c1 - c0) / (double) iters;
+    }
+    double med = median(ns, batches);
+    for (int b = 0; b < batches; b++) {
+        dev[b] = ns[b] > med ? ns[b] - med : med - ns[b];
+    }
+    double mad = median(dev, batches);
+    printf("%-34s %10ld %12.1f %10.1f %7.2f%% %12.1f\n", name, iters, med, mad, med > 0 ? 100 * mad / med : 0,
+           median(ticks, batches));
+    fflush(stdout);
+}
+
+
+/************ BENCHMARKS ************/
+
+static const char * sample_request =
+        "GET /images/logo/site/header.png HTTP/1.1\r\nHost: www.example.com\r\n"
+        "User-Agent: microbench/1.0\r\nAccept: */*\r\nAccept-Encoding: gzip\r\n\r\n";
+
+static void b_parse_header(void * ctx, long iters) {
+    (void) ctx;
+    size_t len = strlen(sample_request);
+    for (long i = 0; i < iters; i++) {
+        arena * a = arena_acquire();
+        char * buf = arena_alloc(a, LEN);
+        memcpy(buf, sample_request, len + 1);
+        char * full_path = parse_header(a, & buf, (ssize_t) len, FALSE, NULL, NULL, -1);
+        sink += full_path[0];
+        arena_release(a);
+    }
+}
+
+typedef struct filter_ctx {
+    LinkList * hosts;
+    LinkList * ips;
+    char * addr;
+} filter_ctx;
+
+/**
+ * build a filter of n host rules and n ip rules, none of them matches
+ */
+static void make_filter(filter_ctx * f, int n) {
+    f -> hosts = calloc(1, sizeof(LinkList));
+    f -> ips = calloc(1, sizeof(LinkList));
+    unsigned seed = 12345;
+    for (int i = 0; i < n; i++) {
+        char * name = malloc(64);
+        snprintf(name, 64, "blocked-%d.example.net", i);
+        add(f -> hosts, name, -1);
+        char * ip = malloc(17);
+        int mask = 8 + (int)(rand_r( & seed) % 25);
+        snprintf(ip, 17, "%u.%u.%u.%u", 10 + (unsigned) rand_r( & seed) % 80, (unsigned) rand_r( & seed) % 256,
+                 (unsigned) rand_r( & seed) % 256, (unsigned) rand_r( & seed) % 256);
+        base_ip(ip, mask);
+        add(f -> ips, ip, mask);
+    }
+}
+
+static void b_search_filter(void * ctx, long iters) {
+    filter_ctx * f = (filter_ctx * ) ctx;
+    for (long i = 0; i < iters; i++) {
+        sink += search_in_filter(f -> addr, f -> hosts, f -> ips);
+    }
+}
+
+static void b_base_ip(void * ctx, long iters) {
+    (void) ctx;
+    char ip[17];
+    for (long i = 0; i < iters; i++) {
+        strcpy(ip, "192.168.137.201");
+        base_ip(ip, (int)(i % 32) + 1);
+        sink += ip[0];
+    }
+}
+
+static char * mime_names[] = {
+        "/index.html", "/a/b/style.css", "/img/logo.png", "/img/photo.jpeg", "/video/clip.mpg",
+        "/sound/beep.wav", "/download/archive.tar.gz", "/no-extension"
+};
+
+static void b_mime(void * ctx, long iters) {
+    (void) ctx;
+    int n = (int)(sizeof(mime_names) / sizeof(mime_names[0]));
+    for (long i = 0; i < iters; i++) {
+        char * t = get_mime_type(mime_names[i % n]);
+        sink += t != NULL;
+    }
+}
+
+static void b_cache_path(void * ctx, long iters) {
+    (void) ctx;
+    char file[CACHE_PATH_LEN];
+    for (long i = 0; i < iters; i++) {
+        cache_path(cache_key("www.example.com/images/logo/site/header.png"), file);
+        sink += file[0];
+    }
+}
+
+static void b_buf(void * ctx, long iters) {
+    (void) ctx;
+    size_t cap;
+    for (long i = 0; i < iters; i++) {
+        char * b = (char * ) buf_get(65536, & cap);
+        sink += b[0];
+        buf_put(b, cap);
+    }
+}
+
+static void b_timer(void * ctx, long iters) {
+    (void) ctx;
+    tw_timer t;
+    tw_clear( & t);
+    for (long i = 0; i < iters; i++) {
+        tw_arm( & t, -1, -1, 30000 + (int)(i & 1023) * 10);
+        tw_touch( & t);
+        tw_cancel( & t);
+    }
+}
+
+typedef struct page_ctx {
+    char * html;
+    size_t len;
+} page_ctx;
+
+/**
+ * build a page of about 32KB: text, links and images, a script and a comment per block
+ */
+static void make_page(page_ctx * p) {
+    size_t cap = 40000;
+    p -> html = malloc(cap);
+    p -> len = 0;
+    for (int i = 0; p -> len < 32768; i++) {
+        p -> len += (size_t) snprintf(p -> html + p -> len, cap - p -> len,
+                                      "<div class=\"item\"><p>Item %d of the catalogue, with a description long enough "
+                                      "to be read as text.</p><a href=\"/items/%d.html\">more</a>"
+                                      "<img src=\"/images/item-%d.jpg\" alt=\"item %d\" width=120 height=80>"
+                                      "<link rel=\"stylesheet\" href=\"/css/item-%d.css\"><!-- item %d -->"
+                                      "<script>var item = \"<img src='x'>\";</script></div>\n", i, i, i, i, i, i);
+    }
+}
+
+static void count_ref(void * arg, const char * ref) {
+    (void) arg;
+    sink += ref[0];
+}
+
+static void b_prefetch_scan(void * ctx, long iters) {
+    page_ctx * p = (page_ctx * ) ctx;
+    prefetch_scanner s;
+    for (long i = 0; i < iters; i++) {
+        prefetch_scan_init( & s, count_ref, NULL);
+        for (size_t off = 0; off < p -> len; off += RELAY_LEN) {
+            prefetch_scan( & s, p -> html + off, p -> len - off < RELAY_LEN ? p -> len - off : RELAY_LEN);
+        }
+    }
+}
+
+static void b_error_handle(void * ctx, long iters) {
+    (void) ctx;
+    static const int codes[] = {
+            Bad_Request, Forbidden, Not_Found, Server_Error, Not_Supported
+    };
+    char msg[400];
+    for (long i = 0; i < iters; i++) {
+        error_handle(msg, codes[i % 5]);
+        sink += msg[9];
+    }
+}
+
+typedef struct rt_ctx {
+    threadpool * pool;
+    volatile int done;
+} rt_ctx;
+
+static int rt_job(void * arg) {
+    rt_ctx * c = (rt_ctx * ) arg;
+    __atomic_store_n( & c -> done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * dispatch one job and wait until a worker ran it
+ */
+static void b_dispatch(void * ctx, long iters) {
+    rt_ctx * c = (rt_ctx * ) ctx;
+    for (long i = 0; i < iters; i++) {
+        c -> done = 0;
+        dispatch(c -> pool, rt_job, c);
+        while (!__atomic_load_n( & c -> done, __ATOMIC_ACQUIRE)) {
+            cpu_relax();
+        }
+    }
+}
+
+int main(int argc, char * argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            batches = 11;
+        } else {
+            only = argv[i];
+        }
+    }
+    printf("%-34s %10s %12s %10s %8s %12s\n", "benchmark", "iters", "median ns/op", "MAD ns", "MAD%",
+           "cycles/op");
+
+    run("parse_header", b_parse_header, NULL, 5e6);
+    run("base_ip", b_base_ip, NULL, 5e6);
+
+    int sizes[] = {
+            10, 100, 1000, 10000
+    };
+    for (int i = 0; i < 4; i++) {
+        filter_ctx f;
+        char name[64];
+        make_filter( & f, sizes[i]);
+        f.addr = "93.184.216.34";
+        snprintf(name, sizeof(name), "search_in_filter ip/%d rules", sizes[i]);
+        run(name, b_search_filter, & f, 5e6);
+        f.addr = "www.example.com";
+        snprintf(name, sizeof(name), "search_in_filter host/%d rules", sizes[i]);
+        run(name, b_search_filter, & f, 5e6);
+        free_lists(f.hosts, f.ips);
+    }
+
+    run("get_mime_type", b_mime, NULL, 5e6);
+    run("cache_key+cache_path", b_cache_path, NULL, 5e6);
+    run("buf_get+buf_put", b_buf, NULL, 2e7);
+    ///arm and cancel do not depend on the number of timers armed
+    static tw_timer armed[100000];
+    if ((only == NULL || strstr("tw_arm+tw_touch+tw_cancel", only) != NULL) && tw_init() == 0) {
+        for (int i = 0; i < 100000; i++) {
+            tw_clear( & armed[i]);
+            tw_arm( & armed[i], -1, -1, 60000 + i % 30000);
+        }
+        run("tw_arm+tw_touch+tw_cancel", b_timer, NULL, 2e7);
+        for (int i = 0; i < 100000; i++) {
+            tw_cancel( & armed[i]);
+        }
+        tw_shutdown();
+    }
+    run("error_handle", b_error_handle, NULL, 5e6);
+    page_ctx page;
+    make_page( & page);
+    run("prefetch_scan 32KB page", b_prefetch_scan, & page, 5e6);
+    free(page.html);
+
+    int threads[] = {
+            1, 2, 4, 8, 16, 50, 100, 200
+    };
+    for (int i = 0; i < 8; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "dispatch->do_work/%d threads", threads[i]);
+        if (only != NULL && strstr(name, only) == NULL) {
+            continue;
+        }
+        rt_ctx c;
+        c.pool = create_threadpool(threads[i]);
+        if (c.pool == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        run(name, b_dispatch, & c, 2e7);
+        destroy_threadpool(c.pool);
+    }
+    return 0;
+}
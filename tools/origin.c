@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+
+#include <errno.h>
+
+#include <signal.h>
+
+#include "bench.h"
+
+/**
+ * origin.c
+ *
+ * local origin server stand-in for the benchmarks.
+ * every GET is answered with a generated body, the defaults come from the
+ * command line and can be overridden per request by path segments:
+ *   /size/<bytes>/     body size
+ *   /delay/<ms>/       latency injected before the response
+ *   /chunked/          Transfer-Encoding: chunked
+ *   /status/<code>/    response status (the body is still sent)
+ * e.g. GET /size/65536/delay/20/a.html
+ *
+ * usage: origin [-p port] [-s size] [-l latency-ms] [-c]
+ */
+
+typedef struct cfg {
+    long size;
+    int latency_ms;
+    int chunked;
+} cfg;
+
+static cfg defaults = {
+        1024,
+        0,
+        0
+};
+
+static char pattern[65536];
+
+/**
+ * write a whole buffer
+ * @return int 0 on success, -1 if the peer went away
+ */
+static int write_all(int sd, const char * p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(sd, p, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return -1;
+        }
+        p += w;
+        n -= (size_t) w;
+    }
+    return 0;
+}
+
+/**
+ * the mime type the proxy would give to the path
+ */
+static const char * content_type(const char * path) {
+    const char * ext = strrchr(path, '.');
+    if (ext != NULL && (strcmp(ext, ".css") == 0)) {
+        return "text/css";
+    }
+    if (ext != NULL && (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)) {
+        return "image/jpeg";
+    }
+    return "text/html";
+}
+
+/**
+ * serve one connection
+ * @param void* arg the socket (intptr_t)
+ */
+static void * serve(void * arg) {
+    int sd = (int)(intptr_t) arg;
+    char req[8192];
+    size_t got = 0;
+    ssize_t n;
+    while (got < sizeof(req) - 1 && (n = read(sd, req + got, sizeof(req) - 1 - got)) > 0) {
+        got += (size_t) n;
+        req[got] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    req[got] = '\0';
+    char path[4096] = "/";
+    sscanf(req, "%*s %4095s", path);
+
+    cfg c = defaults;
+    int status = 200;
+    char * p = path;
+    while (( p = strchr(p, '/')) != NULL) {
+        p++;
+        if (strncmp(p, "size/", 5) == 0) {
+            c.size = atol(p + 5);
+        } else if (strncmp(p, "delay/", 6) == 0) {
+            c.latency_ms = atoi(p + 6);
+        } else if (strncmp(p, "chunked/", 8) == 0) {
+            c.chunked = 1;
+        } else if (strncmp(p, "status/", 7) == 0) {
+            status = atoi(p + 7);
+        }
+    }
+    if (c.latency_ms > 0) {
+        usleep((useconds_t) c.latency_ms * 1000);
+    }
+
+    char hdr[512];
+    int h;
+    if (c.chunked) {
+        h = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d X\r\nContent-Type: %s\r\nTransfer-Encoding: chunked\r\n"
+                                       "Connection: close\r\n\r\n", status, content_type(path));
+    } else {
+        h = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d X\r\nContent-Type: %s\r\nContent-Length: %ld\r\n"
+                                       "Connection: close\r\n\r\n", status, content_type(path), c.size);
+    }
+    if (write_all(sd, hdr, (size_t) h) == 0) {
+        long left = c.size;
+        while (left > 0) {
+            size_t chunk = left > (long) sizeof(pattern) ? sizeof(pattern) : (size_t) left;
+            if (c.chunked) {
+                char len[32];
+                int l = snprintf(len, sizeof(len), "%zx\r\n", chunk);
+                if (write_all(sd, len, (size_t) l) < 0 || write_all(sd, pattern, chunk) < 0 ||
+                    write_all(sd, "\r\n", 2) < 0) {
+                    break;
+                }
+            } else if (write_all(sd, pattern, chunk) < 0) {
+                break;
+            }
+            left -= (long) chunk;
+        }
+        if (c.chunked && left == 0) {
+            write_all(sd, "0\r\n\r\n", 5);
+        }
+    }
+    close(sd);
+    return NULL;
+}
+
+int main(int argc, char * argv[]) {
+    int port = 8080, opt;
+    while ((opt = getopt(argc, argv, "p:s:l:c")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 's':
+                defaults.size = atol(optarg);
+                break;
+            case 'l':
+                defaults.latency_ms = atoi(optarg);
+                break;
+            case 'c':
+                defaults.chunked = 1;
+                break;
+            default:
+                fprintf(stdout, "Usage: origin [-p port] [-s size] [-l latency-ms] [-c]\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (char)('a' + i % 26);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int sd = socket(PF_INET, SOCK_STREAM, 0), one = 1;
+    struct sockaddr_in srv;
+    memset( & srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons(port);
+    srv.sin_addr.s_addr = htonl(INADDR_ANY);
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, & one, sizeof(one));
+    if (bind(sd, (struct sockaddr * ) & srv, sizeof(srv)) < 0 || listen(sd, 1024) < 0) {
+        perror("origin: bind/listen");
+        exit(EXIT_FAILURE);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init( & attr);
+    pthread_attr_setdetachstate( & attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize( & attr, 256 * 1024);
+    while (1) {
+        int csd = accept(sd, NULL, NULL);
+        if (csd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) {
+                continue;
+            }
+            perror("origin: accept");
+            exit(EXIT_FAILURE);
+        }
+        pthread_t t;
+        if (pthread_create( & t, & attr, serve, (void * )(intptr_t) csd) != 0) {
+            close(csd);
+        }
+    }
+}
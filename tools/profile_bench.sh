@@ -0,0 +1,54 @@
+#!/bin/sh
+# profile_bench.sh - compare the socket option profiles: for each profile the
+# proxy is started with it on the listener and the origin connections, then
+# loadgen measures small cached objects (latency) and large misses relayed
+# from the origin (throughput).
+#
+# usage: tools/profile_bench.sh [seconds] [threads] [small-size] [large-size]
+# the profiles compared can be given in PROFILES, e.g.
+# PROFILES="default latency nodelay,quickack throughput,rcvbuf=262144"
+
+set -e
+SECONDS_PER_RUN=${1:-10}
+THREADS=${2:-16}
+SMALL=${3:-1024}
+LARGE=${4:-1048576}
+PROFILES=${PROFILES:-"default latency throughput"}
+ORIGIN_PORT=${ORIGIN_PORT:-18080}
+PROXY_PORT=${PROXY_PORT:-18081}
+POOL=${POOL:-32}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+PROXY_PID=
+trap 'kill $ORIGIN_PID $PROXY_PID 2>/dev/null; rm -rf "$WORK"' EXIT
+
+CC=${CC:-gcc}
+$CC -O2 -Wall -Wextra -Wvla "$ROOT"/proxyServer.c "$ROOT"/threadpool.c "$ROOT"/trace.c "$ROOT"/accesslog.c "$ROOT"/arena.c "$ROOT"/affinity.c "$ROOT"/dnscache.c "$ROOT"/handoff.c "$ROOT"/gzip.c "$ROOT"/cache.c "$ROOT"/negcache.c "$ROOT"/diskq.c "$ROOT"/peer.c "$ROOT"/bufpool.c "$ROOT"/timerwheel.c "$ROOT"/sockopt.c "$ROOT"/shm.c "$ROOT"/prefetch.c -o "$WORK/proxy" -lpthread -lz
+$CC -O2 -Wall -Wextra "$ROOT"/tools/origin.c -o "$WORK/origin" -lpthread
+$CC -O2 -Wall -Wextra "$ROOT"/tools/loadgen.c -o "$WORK/loadgen" -lpthread
+
+"$WORK/origin" -p "$ORIGIN_PORT" &
+ORIGIN_PID=$!
+
+echo localhost > "$WORK/filter"
+cd "$WORK"
+for PROFILE in $PROFILES; do
+    # every profile starts with an empty cache, on a port the last one did not leave in TIME_WAIT
+    rm -rf cache
+    PROXY_PORT=$((PROXY_PORT + 1))
+    ./proxy --access-log=none --listen-profile="$PROFILE" --origin-profile="$PROFILE" \
+            "$PROXY_PORT" "$POOL" 0 filter > proxy.log 2>&1 &
+    PROXY_PID=$!
+    sleep 0.5
+    echo "== profile $PROFILE"
+    grep "socket profile" proxy.log || true
+    ./loadgen -x 127.0.0.1:"$PROXY_PORT" -o 127.0.0.1:"$ORIGIN_PORT" -t "$THREADS" \
+              -d "$SECONDS_PER_RUN" -s "$SMALL" -m 100:0:0
+    ./loadgen -x 127.0.0.1:"$PROXY_PORT" -o 127.0.0.1:"$ORIGIN_PORT" -t "$THREADS" \
+              -d "$SECONDS_PER_RUN" -s "$LARGE" -m 0:100:0
+    echo
+    kill $PROXY_PID
+    wait $PROXY_PID 2>/dev/null || true
+    PROXY_PID=
+done
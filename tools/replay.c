@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+
+#include <signal.h>
+
+#include "bench.h"
+
+#include "../accesslog.h"
+
+/**
+ * replay.c
+ *
+ * plays a capture of the proxy (--capture) back against a proxy, with the
+ * original gaps between the requests divided by a speed factor. the
+ * requests are sent on schedule from a pool of threads and latency is
+ * measured from the scheduled time, like the open loop of loadgen.
+ * with -o the requests go to the origin stand-in (tools/origin) instead of
+ * the captured hosts: the path asks it for a body of the captured size and
+ * status (and with -l the captured time of a miss as latency), so a
+ * production mix runs on one machine.
+ * the latency of each cache result of the capture is printed next to the
+ * captured one. -w first fetches the objects that were hits before any miss
+ * of them in the capture, so the proxy starts with the same cache content.
+ *
+ * usage: replay -x <proxy host:port> [-o <origin host:port>] [-t threads]
+ *               [-S speed] [-n requests] [-w] [-l] <capture>
+ */
+
+#define CACHE_RESULTS 8
+
+static const char * cache_names[CACHE_RESULTS] = {
+        "-", "hit", "miss", "stale", "revalid", "neg", "peer", "tunnel"
+};
+
+/**
+ * one request to replay
+ */
+typedef struct req {
+    double at_us;           //when to send it, after the start of the replay
+    char * host;            //Host header
+    char * path;            //request path
+    int status;             //captured status
+    int cache;              //captured enum alog_cache
+    uint32_t total_us;      //captured time
+    uint64_t bytes;         //captured response size
+} req;
+
+typedef struct worker {
+    pthread_t t;
+    lat_vec lat[CACHE_RESULTS];
+    long differ;            //responses with another status than captured
+} worker;
+
+static struct sockaddr_in proxy;
+static req * reqs = NULL;
+static long nreqs = 0;
+static long next_req = 0;   //next request to send, taken by the workers
+static long truncated = 0;  //captured requests skipped, their host or path was cut
+static double start_us;
+
+static int cmp_at(const void * a, const void * b) {
+    double x = ((const req * ) a) -> at_us, y = ((const req * ) b) -> at_us;
+    return (x > y) - (x < y);
+}
+
+/**
+ * read a capture, keep the requests that can be replayed, in start order
+ * @param char* file the capture file
+ * @param char* origin the origin stand-in, NULL to keep the captured hosts
+ * @param int delay 1 to ask the stand-in for the captured time of the misses
+ * @param double speed the gaps are divided by it
+ * @param long max keep at most max requests, 0 for all
+ * @return int 0 on success, -1 else
+ */
+static int load(const char * file, const char * origin, int delay, double speed, long max) {
+    FILE * fp = fopen(file, "rb");
+    if (fp == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    alog_cap_hdr hdr;
+    if (fread( & hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != ALOG_CAP_MAGIC || hdr.version != ALOG_CAP_VERSION) {
+        fprintf(stderr, "%s: not a capture file\n", file);
+        fclose(fp);
+        return -1;
+    }
+    long cap = 0;
+    alog_cap_rec r;
+    char host[ALOG_HOST_LEN + 1], path[ALOG_PATH_LEN + 1];
+    while (fread( & r, sizeof(r), 1, fp) == 1) {
+        if (fread(host, 1, r.host_len, fp) != r.host_len || fread(path, 1, r.path_len, fp) != r.path_len) {
+            break;
+        }
+        host[r.host_len] = '\0';
+        path[r.path_len] = '\0';
+        ///only the end of a long host or path was kept: replayed it would be another object
+        if ((r.flags & ALOG_CAP_TRUNCATED) && r.cache != ALOG_TUNNEL) {
+            truncated++;
+            continue;
+        }
+        ///requests rejected before parsing and tunnels cannot be replayed
+        if (r.host_len == 0 || r.path_len == 0 || path[0] != '/' || r.cache == ALOG_TUNNEL) {
+            continue;
+        }
+        if (nreqs == cap) {
+            cap = cap ? cap * 2 : 4096;
+            req * grown = (req * ) realloc(reqs, (size_t) cap * sizeof(req));
+            if (grown == NULL) {
+                fprintf(stderr, "realloc:\n");
+                fclose(fp);
+                return -1;
+            }
+            reqs = grown;
+        }
+        req * q = & reqs[nreqs++];
+        q -> at_us = (double) r.start_us / speed;
+        q -> status = r.status;
+        q -> cache = r.cache < CACHE_RESULTS ? r.cache : 0;
+        q -> total_us = r.total_us;
+        q -> bytes = r.bytes;
+        if (origin != NULL) {
+            char stand_in[ALOG_PATH_LEN + ALOG_HOST_LEN + 96];
+            int ms = delay && r.cache == ALOG_MISS ? (int)(r.total_us / 1000) : 0;
+            snprintf(stand_in, sizeof(stand_in), "/size/%llu/status/%d/delay/%d/%s%s",
+                     (unsigned long long) r.bytes, r.status >= 200 ? r.status : 200, ms, host, path);
+            q -> host = strdup(origin);
+            q -> path = strdup(stand_in);
+        } else {
+            q -> host = strdup(host);
+            q -> path = strdup(path);
+        }
+        if (q -> host == NULL || q -> path == NULL) {
+            fprintf(stderr, "strdup:\n");
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    ///the writer drains the threads one after the other: the records come roughly by completion
+    qsort(reqs, (size_t) nreqs, sizeof(req), cmp_at);
+    if (max > 0 && nreqs > max) {
+        nreqs = max;
+    }
+    if (nreqs > 0) {
+        double first = reqs[0].at_us;
+        for (long i = 0; i < nreqs; i++) {
+            reqs[i].at_us -= first;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 64-bit FNV-1a of host and path
+ */
+static uint64_t url_hash(const req * q) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const char * s = q -> host; * s; s++) {
+        h = (h ^ (unsigned char) * s) * 1099511628211ULL;
+    }
+    for (const char * s = q -> path; * s; s++) {
+        h = (h ^ (unsigned char) * s) * 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+/**
+ * fetch the objects that were cached before the capture started: their
+ * first request in the capture was answered from the cache
+ */
+static void warm_up(void) {
+    size_t size = 1;
+    while (size < (size_t) nreqs * 2) {
+        size <<= 1;
+    }
+    uint64_t * seen = (uint64_t * ) calloc(size, sizeof(uint64_t));
+    if (seen == NULL) {
+        fprintf(stderr, "calloc:\n");
+        return;
+    }
+    long warmed = 0, failed = 0;
+    for (long i = 0; i < nreqs; i++) {
+        uint64_t h = url_hash( & reqs[i]);
+        size_t s = (size_t) h & (size - 1);
+        while (seen[s] != 0 && seen[s] != h) {
+            s = (s + 1) & (size - 1);
+        }
+        if (seen[s] == h) {
+            continue;
+        }
+        seen[s] = h;
+        int c = reqs[i].cache;
+        if (c == ALOG_HIT || c == ALOG_STALE || c == ALOG_REVALIDATED) {
+            long bytes;
+            if (http_get( & proxy, reqs[i].host, reqs[i].path, & bytes) == 200) {
+                warmed++;
+            } else {
+                failed++;
+            }
+        }
+    }
+    free(seen);
+    fprintf(stdout, "warm up: %ld objects fetched, %ld failed\n", warmed, failed);
+}
+
+static void * run(void * arg) {
+    worker * w = (worker * ) arg;
+    long i;
+    while ((i = __atomic_fetch_add( & next_req, 1, __ATOMIC_RELAXED)) < nreqs) {
+        req * q = & reqs[i];
+        ///open loop: wait for the slot, measure from the slot
+        double slot = start_us + q -> at_us, now = now_us();
+        if (slot > now) {
+            usleep((useconds_t)(slot - now));
+        }
+        long bytes;
+        int status = http_get( & proxy, q -> host, q -> path, & bytes);
+        double us = now_us() - slot;
+        lat_vec * l = & w -> lat[q -> cache];
+        if (status < 0) {
+            l -> errors++;
+            continue;
+        }
+        if (status != q -> status) {
+            w -> differ++;
+        }
+        lat_push(l, us);
+        l -> bytes += bytes;
+    }
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stdout, "Usage: replay -x <proxy host:port> [-o <origin host:port>] [-t threads] [-S speed]\n"
+                    "              [-n requests] [-w] [-l] <capture>\n"
+                    "  -o   send the requests to the origin stand-in instead of the captured hosts\n"
+                    "  -S   speed factor, 2 replays twice as fast (default 1)\n"
+                    "  -w   fetch the objects that were cached when the capture started first\n"
+                    "  -l   with -o, the stand-in answers a captured miss after its captured time\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char * argv[]) {
+    char host[256], * origin = NULL;
+    int port = 0, opt, have_proxy = 0, threads = 64, warm = 0, delay = 0;
+    double speed = 1;
+    long max = 0;
+    while ((opt = getopt(argc, argv, "x:o:t:S:n:wl")) != -1) {
+        switch (opt) {
+            case 'x':
+                if (parse_hostport(optarg, host, & port) != 0 || resolve4(host, & proxy) != 0) {
+                    usage();
+                }
+                proxy.sin_port = htons(port);
+                have_proxy = 1;
+                break;
+            case 'o':
+                origin = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'S':
+                speed = atof(optarg);
+                break;
+            case 'n':
+                max = atol(optarg);
+                break;
+            case 'w':
+                warm = 1;
+                break;
+            case 'l':
+                delay = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (!have_proxy || optind != argc - 1 || threads < 1 || speed <= 0) {
+        usage();
+    }
+    if (load(argv[optind], origin, delay, speed, max) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (truncated > 0) {
+        fprintf(stdout, "%ld requests skipped: host or path too long for the capture\n", truncated);
+    }
+    if (nreqs == 0) {
+        fprintf(stderr, "nothing to replay\n");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (warm) {
+        warm_up();
+    }
+
+    worker * w = calloc((size_t) threads, sizeof(worker));
+    if (w == NULL) {
+        fprintf(stderr, "calloc:\n");
+        exit(EXIT_FAILURE);
+    }
+    start_us = now_us();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create( & w[i].t, NULL, run, & w[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    long differ = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(w[i].t, NULL);
+        differ += w[i].differ;
+    }
+    double seconds = (now_us() - start_us) / 1e6;
+
+    printf("replay of %ld requests, %.1fx speed, %d threads, %.1fs (captured %.1fs)\n", nreqs, speed, threads,
+           seconds, reqs[nreqs - 1].at_us * speed / 1e6);
+    printf("replayed, by captured cache result:\n");
+    lat_header();
+    lat_vec all = {
+            0
+    };
+    for (int c = 0; c < CACHE_RESULTS; c++) {
+        lat_vec cls = {
+                0
+        };
+        for (int i = 0; i < threads; i++) {
+            lat_merge( & cls, & w[i].lat[c]);
+            free(w[i].lat[c].v);
+        }
+        if (cls.n > 0 || cls.errors > 0) {
+            lat_report(cache_names[c], & cls, seconds);
+            lat_merge( & all, & cls);
+        }
+        free(cls.v);
+    }
+    lat_report("total", & all, seconds);
+    free(all.v);
+
+    ///the same table from the captured times, the baseline of the comparison
+    printf("captured:\n");
+    lat_header();
+    lat_vec captured[CACHE_RESULTS], total = {
+            0
+    };
+    memset(captured, 0, sizeof(captured));
+    for (long i = 0; i < nreqs; i++) {
+        lat_push( & captured[reqs[i].cache], (double) reqs[i].total_us);
+        lat_push( & total, (double) reqs[i].total_us);
+        captured[reqs[i].cache].bytes += (long) reqs[i].bytes;
+        total.bytes += (long) reqs[i].bytes;
+    }
+    double captured_seconds = reqs[nreqs - 1].at_us * speed / 1e6;
+    captured_seconds = captured_seconds > 0 ? captured_seconds : 1;
+    for (int c = 0; c < CACHE_RESULTS; c++) {
+        if (captured[c].n > 0) {
+            lat_report(cache_names[c], & captured[c], captured_seconds);
+        }
+        free(captured[c].v);
+    }
+    lat_report("total", & total, captured_seconds);
+    free(total.v);
+    if (differ > 0) {
+        printf("%ld responses had another status than captured\n", differ);
+    }
+    for (long i = 0; i < nreqs; i++) {
+        free(reqs[i].host);
+        free(reqs[i].path);
+    }
+    free(reqs);
+    free(w);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# run_bench.sh - build the proxy and the load tools, start a local origin and
+# a proxy, and drive the cache-hit, cache-miss, filtered and mixed workloads.
+#
+# usage: tools/run_bench.sh [seconds] [threads] [object-size]
+# extra proxy options can be given in PROXY_OPTS, e.g. PROXY_OPTS=--trace=t.bin
+
+set -e
+SECONDS_PER_RUN=${1:-10}
+THREADS=${2:-16}
+SIZE=${3:-4096}
+ORIGIN_PORT=${ORIGIN_PORT:-18080}
+PROXY_PORT=${PROXY_PORT:-18081}
+POOL=${POOL:-32}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $ORIGIN_PID $PROXY_PID 2>/dev/null; rm -rf "$WORK"' EXIT
+
+CC=${CC:-gcc}
+$CC -O2 -Wall -Wextra -Wvla "$ROOT"/proxyServer.c "$ROOT"/threadpool.c "$ROOT"/trace.c "$ROOT"/accesslog.c "$ROOT"/arena.c "$ROOT"/affinity.c "$ROOT"/dnscache.c "$ROOT"/handoff.c "$ROOT"/gzip.c "$ROOT"/cache.c "$ROOT"/negcache.c "$ROOT"/diskq.c "$ROOT"/peer.c "$ROOT"/bufpool.c "$ROOT"/timerwheel.c "$ROOT"/sockopt.c "$ROOT"/shm.c "$ROOT"/prefetch.c -o "$WORK/proxy" -lpthread -lz
+$CC -O2 -Wall -Wextra "$ROOT"/tools/origin.c -o "$WORK/origin" -lpthread
+$CC -O2 -Wall -Wextra "$ROOT"/tools/loadgen.c -o "$WORK/loadgen" -lpthread
+
+"$WORK/origin" -p "$ORIGIN_PORT" -s "$SIZE" &
+ORIGIN_PID=$!
+
+# the filtered class uses Host: localhost, the other classes use 127.0.0.1
+echo localhost > "$WORK/filter"
+cd "$WORK"
+./proxy $PROXY_OPTS "$PROXY_PORT" "$POOL" 10000000 filter > proxy.log 2>&1 &
+PROXY_PID=$!
+sleep 0.5
+
+for MIX in 100:0:0 0:100:0 0:0:100 80:15:5; do
+    ./loadgen -x 127.0.0.1:"$PROXY_PORT" -o 127.0.0.1:"$ORIGIN_PORT" -t "$THREADS" \
+              -d "$SECONDS_PER_RUN" -s "$SIZE" -m "$MIX"
+    echo
+done
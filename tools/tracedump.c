@@ -0,0 +1,303 @@
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <stdint.h>
+
+#include "../trace.h"
+
+/**
+ * tracedump.c
+ *
+ * decode a trace file written by the proxy (--trace) into
+ * chrome trace JSON (load it in chrome://tracing or perfetto) or into
+ * a per-stage latency summary.
+ * only the last dump in the file is decoded unless -a is given.
+ *
+ * usage: tracedump [-c | -s] [-a] <trace-file>
+ */
+
+/**
+ * name of the stage that ends with each event
+ */
+static const char * stage_name[TR_EVENT_COUNT] = {
+        "begin",
+        "read request",
+        "parse header",
+        "cache lookup",
+        "cache lookup",
+        "local header",
+        "local body",
+        "origin connect",
+        "origin send",
+        "origin wait",
+        "origin relay",
+        "close"
+};
+
+typedef struct rec_t {
+    uint64_t ts;
+    uint32_t req;
+    uint16_t event;
+    uint16_t tid;
+} rec_t;
+
+typedef struct recs_t {
+    rec_t * v;
+    size_t n, cap;
+    double ticks_per_us;
+} recs_t;
+
+/**
+ * append a record
+ * @param recs_t* r the vector
+ * @param rec_t x the record
+ */
+static void push(recs_t * r, rec_t x) {
+    if (r -> n == r -> cap) {
+        r -> cap = r -> cap ? r -> cap * 2 : 4096;
+        r -> v = realloc(r -> v, r -> cap * sizeof(rec_t));
+        if (r -> v == NULL) {
+            fprintf(stderr, "realloc:\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    r -> v[r -> n++] = x;
+}
+
+/**
+ * order by request, then by time
+ */
+static int cmp_rec(const void * a, const void * b) {
+    const rec_t * x = a, * y = b;
+    if (x -> req != y -> req) {
+        return x -> req < y -> req ? -1 : 1;
+    }
+    if (x -> ts != y -> ts) {
+        return x -> ts < y -> ts ? -1 : 1;
+    }
+    return 0;
+}
+
+static int cmp_double(const void * a, const void * b) {
+    double x = * (const double * ) a, y = * (const double * ) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * nearest-rank percentile of a sorted array
+ * @param double* v sorted values
+ * @param size_t n number of values (> 0)
+ * @param double p percentile in [0, 1]
+ */
+static double pct(double * v, size_t n, double p) {
+    size_t rank = (size_t)(p * (double) n + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > n) {
+        rank = n;
+    }
+    return v[rank - 1];
+}
+
+/**
+ * read the dumps of the file, keep the last one (or all of them)
+ * @param FILE* fp the trace file
+ * @param int all 1 to merge all dumps
+ * @param recs_t* out the records
+ * @return int 0 on success, -1 on a malformed file
+ */
+static int load(FILE * fp, int all, recs_t * out) {
+    trace_dump_hdr hdr;
+    int dumps = 0;
+    while (fread( & hdr, sizeof(hdr), 1, fp) == 1) {
+        if (hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+            fprintf(stderr, "bad trace header\n");
+            return -1;
+        }
+        if (!all) {
+            out -> n = 0;
+        }
+        out -> ticks_per_us = hdr.ticks_per_us;
+        for (uint32_t i = 0; i < hdr.nrings; i++) {
+            trace_dump_ring rh;
+            if (fread( & rh, sizeof(rh), 1, fp) != 1) {
+                fprintf(stderr, "truncated trace\n");
+                return -1;
+            }
+            for (uint32_t j = 0; j < rh.count; j++) {
+                trace_rec tr;
+                if (fread( & tr, sizeof(tr), 1, fp) != 1) {
+                    fprintf(stderr, "truncated trace\n");
+                    return -1;
+                }
+                ///a record may be torn if the dump raced with its writer
+                if (tr.event >= TR_EVENT_COUNT || tr.ts == 0) {
+                    continue;
+                }
+                rec_t r = {
+                        tr.ts,
+                        tr.req,
+                        tr.event,
+                        (uint16_t) rh.tid
+                };
+                push(out, r);
+            }
+        }
+        dumps++;
+    }
+    if (dumps == 0) {
+        fprintf(stderr, "empty trace\n");
+        return -1;
+    }
+    if (all) {
+        ///the same records show up again in later dumps
+        qsort(out -> v, out -> n, sizeof(rec_t), cmp_rec);
+        size_t k = 0;
+        for (size_t i = 0; i < out -> n; i++) {
+            if (k > 0 && memcmp( & out -> v[k - 1], & out -> v[i], sizeof(rec_t)) == 0) {
+                continue;
+            }
+            out -> v[k++] = out -> v[i];
+        }
+        out -> n = k;
+    } else {
+        qsort(out -> v, out -> n, sizeof(rec_t), cmp_rec);
+    }
+    return 0;
+}
+
+/**
+ * print the records as chrome trace events, one complete ("X") event
+ * per stage and one per request
+ * @param recs_t* r the sorted records
+ */
+static void chrome(recs_t * r) {
+    uint64_t base = ~0ULL;
+    for (size_t i = 0; i < r -> n; i++) {
+        if (r -> v[i].ts < base) {
+            base = r -> v[i].ts;
+        }
+    }
+    printf("{\"traceEvents\":[\n");
+    int first = 1;
+    for (size_t i = 0; i < r -> n; i++) {
+        rec_t * cur = & r -> v[i];
+        double ts = (double)(cur -> ts - base) / r -> ticks_per_us;
+        if (cur -> event == TR_REQ_BEGIN) {
+            ///whole request span up to its last record
+            size_t j = i;
+            while (j + 1 < r -> n && r -> v[j + 1].req == cur -> req) {
+                j++;
+            }
+            double dur = (double)(r -> v[j].ts - cur -> ts) / r -> ticks_per_us;
+            printf("%s{\"name\":\"request %u\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                   first ? "" : ",\n", cur -> req, ts, dur, cur -> tid);
+            first = 0;
+            continue;
+        }
+        if (i == 0 || r -> v[i - 1].req != cur -> req) {
+            continue;
+        }
+        rec_t * prev = & r -> v[i - 1];
+        double start = (double)(prev -> ts - base) / r -> ticks_per_us;
+        double dur = (double)(cur -> ts - prev -> ts) / r -> ticks_per_us;
+        printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"req\":%u}}",
+               first ? "" : ",\n", stage_name[cur -> event], start, dur, cur -> tid, cur -> req);
+        first = 0;
+    }
+    printf("\n],\"displayTimeUnit\":\"ns\"}\n");
+}
+
+/**
+ * print count, p50, p99 and max of every stage and of the whole request
+ * @param recs_t* r the sorted records
+ */
+static void summary(recs_t * r) {
+    double * d[TR_EVENT_COUNT + 1];
+    size_t n[TR_EVENT_COUNT + 1];
+    for (int e = 0; e <= TR_EVENT_COUNT; e++) {
+        d[e] = malloc((r -> n + 1) * sizeof(double));
+        if (d[e] == NULL) {
+            fprintf(stderr, "malloc:\n");
+            exit(EXIT_FAILURE);
+        }
+        n[e] = 0;
+    }
+    size_t begin = 0;
+    for (size_t i = 0; i < r -> n; i++) {
+        rec_t * cur = & r -> v[i];
+        if (i == 0 || r -> v[i - 1].req != cur -> req) {
+            begin = i;
+            continue;
+        }
+        double us = (double)(cur -> ts - r -> v[i - 1].ts) / r -> ticks_per_us;
+        d[cur -> event][n[cur -> event]++] = us;
+        if (cur -> event == TR_REQ_END && r -> v[begin].event == TR_REQ_BEGIN) {
+            ///slot TR_EVENT_COUNT holds the end to end latency
+            d[TR_EVENT_COUNT][n[TR_EVENT_COUNT]++] = (double)(cur -> ts - r -> v[begin].ts) / r -> ticks_per_us;
+        }
+    }
+    printf("%-16s %10s %12s %12s %12s\n", "stage", "count", "p50(us)", "p99(us)", "max(us)");
+    for (int e = 1; e <= TR_EVENT_COUNT; e++) {
+        if (n[e] == 0) {
+            continue;
+        }
+        qsort(d[e], n[e], sizeof(double), cmp_double);
+        const char * name = e == TR_EVENT_COUNT ? "total" : stage_name[e];
+        if (e == TR_CACHE_HIT) {
+            name = "lookup (hit)";
+        }
+        if (e == TR_CACHE_MISS) {
+            name = "lookup (miss)";
+        }
+        printf("%-16s %10zu %12.2f %12.2f %12.2f\n", name, n[e],
+               pct(d[e], n[e], 0.5), pct(d[e], n[e], 0.99), d[e][n[e] - 1]);
+    }
+    for (int e = 0; e <= TR_EVENT_COUNT; e++) {
+        free(d[e]);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    int mode_chrome = 1, all = 0;
+    char * path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            mode_chrome = 1;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            mode_chrome = 0;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            all = 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL) {
+        fprintf(stdout, "Usage: tracedump [-c | -s] [-a] <trace-file>\n");
+        exit(EXIT_FAILURE);
+    }
+    FILE * fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    recs_t r = {
+            0
+    };
+    if (load(fp, all, & r) != 0) {
+        fclose(fp);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    if (mode_chrome) {
+        chrome( & r);
+    } else {
+        summary( & r);
+    }
+    free(r.v);
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include "trace.h"
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <signal.h>
+
+#include <pthread.h>
+
+int trace_enabled = 0;
+__thread trace_ring * trace_local = NULL;
+__thread uint32_t trace_req = 0;
+
+static trace_ring * rings = NULL;       //all registered rings (push only)
+static uint32_t next_tid = 0;
+static uint32_t next_req = 0;
+static int trace_fd = -1;
+static double ticks_per_us = 1000.0;
+static pthread_key_t ring_key;          //releases the ring when its thread exits
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+/**
+ * thread exit: the ring stays in the list (for the dump) and can be reused
+ */
+static void ring_release(void * r) {
+    __atomic_store_n( & ((trace_ring * ) r) -> owned, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create( & ring_key, ring_release);
+}
+
+/**
+ * give the calling thread a ring, a thread pool that grows and shrinks
+ * reuses the rings of exited threads instead of leaking one per thread
+ * @return trace_ring* the ring, NULL if the allocation failed
+ */
+trace_ring * trace_ring_attach(void) {
+    pthread_once( & ring_once, ring_key_init);
+    trace_ring * r;
+    for (r = __atomic_load_n( & rings, __ATOMIC_ACQUIRE); r != NULL; r = r -> next) {
+        int free_ring = 0;
+        if (__atomic_compare_exchange_n( & r -> owned, & free_ring, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (r == NULL) {
+        r = (trace_ring * ) calloc(1, sizeof(trace_ring));
+        if (r == NULL) {
+            return NULL;
+        }
+        r -> owned = 1;
+        r -> tid = __atomic_fetch_add( & next_tid, 1, __ATOMIC_RELAXED);
+        r -> next = __atomic_load_n( & rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n( & rings, & r -> next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(ring_key, r);
+    trace_local = r;
+    return r;
+}
+
+/**
+ * start a new request on the calling thread
+ */
+void trace_begin(void) {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_req = __atomic_add_fetch( & next_req, 1, __ATOMIC_RELAXED);
+    trace_event(TR_REQ_BEGIN);
+}
+
+/**
+ * measure how many clock ticks are in one microsecond
+ * @return double ticks per microsecond
+ */
+static double calibrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, & a);
+    uint64_t t0 = trace_now();
+    usleep(20000);
+    uint64_t t1 = trace_now();
+    clock_gettime(CLOCK_MONOTONIC, & b);
+    double us = (double)(b.tv_sec - a.tv_sec) * 1e6 + (double)(b.tv_nsec - a.tv_nsec) / 1e3;
+    return (double)(t1 - t0) / us;
+#else
+    return 1000.0;
+#endif
+}
+
+/**
+ * write a whole buffer, retry on short writes
+ * @param int fd the file
+ * @param void* buf the data
+ * @param size_t n number of bytes
+ */
+static void write_all(int fd, void * buf, size_t n) {
+    char * p = (char * ) buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w <= 0) {
+            return;
+        }
+        p += w;
+        n -= (size_t) w;
+    }
+}
+
+/**
+ * signal handler of SIGUSR2
+ * @param int sig the signal number
+ */
+static void on_dump_signal(int sig) {
+    (void) sig;
+    trace_dump();
+}
+
+/**
+ * enable tracing into the given file
+ * @param char* path the trace file
+ * @return int 0 on success, -1 else
+ */
+int trace_init(char * path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (trace_fd < 0) {
+        perror("error: trace file\n");
+        return -1;
+    }
+    ticks_per_us = calibrate();
+
+    struct sigaction sa;
+    sa.sa_handler = on_dump_signal;
+    sigemptyset( & sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR2, & sa, NULL) < 0) {
+        perror("error: sigaction\n");
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    trace_enabled = 1;
+    return 0;
+}
+
+/**
+ * write every ring to the trace file, oldest record first.
+ * only uses write() so it can run inside the signal handler.
+ */
+void trace_dump(void) {
+    if (trace_fd < 0) {
+        return;
+    }
+    trace_dump_hdr hdr = {
+            TRACE_MAGIC,
+            TRACE_VERSION,
+            ticks_per_us,
+            0,
+            0
+    };
+    ///rings are pushed at the head: both passes walk from the same snapshot of it
+    trace_ring * first_ring = __atomic_load_n( & rings, __ATOMIC_ACQUIRE), * r;
+    for (r = first_ring; r != NULL; r = r -> next) {
+        hdr.nrings++;
+    }
+    write_all(trace_fd, & hdr, sizeof(hdr));
+
+    for (r = first_ring; r != NULL; r = r -> next) {
+        uint64_t head = __atomic_load_n( & r -> head, __ATOMIC_ACQUIRE);
+        uint64_t count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+        trace_dump_ring rh = {
+                r -> tid,
+                (uint32_t) count
+        };
+        write_all(trace_fd, & rh, sizeof(rh));
+        ///the ring may wrap, write the older part first
+        uint64_t start = (head - count) & (TRACE_RING_SIZE - 1);
+        uint64_t first = TRACE_RING_SIZE - start;
+        if (first > count) {
+            first = count;
+        }
+        write_all(trace_fd, & r -> recs[start], first * sizeof(trace_rec));
+        write_all(trace_fd, & r -> recs[0], (count - first) * sizeof(trace_rec));
+    }
+}
+
+/**
+ * last dump and close the trace file
+ */
+void trace_close(void) {
+    if (trace_fd < 0) {
+        return;
+    }
+    trace_dump();
+    trace_enabled = 0;
+    close(trace_fd);
+    trace_fd = -1;
+}
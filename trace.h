@@ -0,0 +1,158 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * trace.h
+ *
+ * This file declares the low-overhead request tracer.
+ * every thread owns a ring of fixed-size binary records, recording an
+ * event is a timestamp read and two stores (no locks, no syscalls).
+ * the rings are written to the trace file on SIGUSR2 and when the server
+ * exits. tools/tracedump.c decodes a dump into chrome trace JSON or a
+ * per-stage latency summary.
+ */
+
+// number of records kept per thread, must be a power of 2
+#define TRACE_RING_SIZE 4096
+
+#define TRACE_MAGIC 0x52545850      // "PXTR"
+#define TRACE_VERSION 1
+
+
+/**
+ * the hot path boundaries of a request
+ */
+enum trace_event {
+    TR_REQ_BEGIN,          //handle_client started
+    TR_READ_DONE,          //request header read from the client
+    TR_PARSE_DONE,         //parse_header finished (dns + filter included)
+    TR_CACHE_HIT,          //the file is in the local filesystem
+    TR_CACHE_MISS,         //the file has to come from the origin
+    TR_LOCAL_HEADER,       //response header written (local file)
+    TR_LOCAL_DONE,         //whole local file written
+    TR_ORIGIN_CONNECT,     //connected to the origin server
+    TR_ORIGIN_SENT,        //request written to the origin
+    TR_ORIGIN_FIRST_BYTE,  //first response bytes from the origin
+    TR_ORIGIN_DONE,        //origin response fully relayed
+    TR_REQ_END,            //client socket closed
+    TR_EVENT_COUNT
+};
+
+
+/**
+ * one trace record (16 bytes)
+ */
+typedef struct trace_rec {
+    uint64_t ts;        //raw timestamp (tsc ticks or coarse ns)
+    uint32_t req;       //request id
+    uint16_t event;     //enum trace_event
+    uint16_t arg;       //event argument (unused by now)
+} trace_rec;
+
+
+/**
+ * per thread ring, only the owner thread writes to it
+ */
+typedef struct trace_ring {
+    struct trace_ring * next;   //next ring in the global list
+    uint32_t tid;               //index of the ring, kept when a new thread reuses it
+    int owned;                  //1 while a live thread writes to the ring
+    uint64_t head;              //total number of records written
+    trace_rec recs[TRACE_RING_SIZE];
+} trace_ring;
+
+
+/**
+ * header of a dump, followed by nrings blocks of
+ * (trace_dump_ring, count * trace_rec)
+ */
+typedef struct trace_dump_hdr {
+    uint32_t magic;
+    uint32_t version;
+    double ticks_per_us;    //timestamp ticks in one microsecond
+    uint32_t nrings;
+    uint32_t pad;
+} trace_dump_hdr;
+
+typedef struct trace_dump_ring {
+    uint32_t tid;
+    uint32_t count;     //records that follow, oldest first
+} trace_dump_ring;
+
+
+extern int trace_enabled;
+extern __thread trace_ring * trace_local;
+extern __thread uint32_t trace_req;
+
+/**
+ * read the trace clock
+ * @return uint64_t timestamp in ticks
+ */
+static inline uint64_t trace_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, & ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+/**
+ * give the calling thread a ring: reuse the ring of a thread that exited,
+ * or create and register a new one
+ * @return trace_ring* the ring, NULL on failure
+ */
+trace_ring * trace_ring_attach(void);
+
+/**
+ * record an event of the current request of this thread
+ * @param int event enum trace_event
+ */
+static inline void trace_event(int event) {
+    if (__builtin_expect(!trace_enabled, 1)) {
+        return;
+    }
+    trace_ring * r = trace_local;
+    if (r == NULL && (r = trace_ring_attach()) == NULL) {
+        return;
+    }
+    trace_rec * rec = & r -> recs[r -> head & (TRACE_RING_SIZE - 1)];
+    rec -> ts = trace_now();
+    rec -> req = trace_req;
+    rec -> event = (uint16_t) event;
+    rec -> arg = 0;
+    __atomic_store_n( & r -> head, r -> head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * give the calling thread a new request id and record TR_REQ_BEGIN
+ */
+void trace_begin(void);
+
+/**
+ * open the trace file, calibrate the clock and install the SIGUSR2 handler
+ * @param char* path the trace file (dumps are appended)
+ * @return int 0 on success, -1 else
+ */
+int trace_init(char * path);
+
+/**
+ * write all rings to the trace file. async-signal-safe.
+ */
+void trace_dump(void);
+
+/**
+ * dump the rings a last time and close the trace file
+ */
+void trace_close(void);
+
+#endif